@@ -23,8 +23,13 @@
 #define VERSION "4.0"
 
 #define _CRT_SECURE_NO_WARNINGS /* avoid security warnings for MSVC */
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L /* fork() and friends for manifest builds */
+#endif
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <math.h>
 #include <stdbool.h>
@@ -40,6 +45,15 @@
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #endif
 
 #define min(a, b) (((a) < (b)) ? (a) : (b))
@@ -93,10 +107,15 @@
 #define D64SIZE_EXTENDED       (D64SIZE + 5 * 17 * BLOCKSIZE)
 #define D71SIZE                (D64SIZE * 2)
 #define D81SIZE                (D81NUMTRACKS * SECTORSPERTRACK_D81 * BLOCKSIZE)
+#define MAXNUMBLOCKS           (D81SIZE / BLOCKSIZE)
 #define D64NUMTRACKS           35
 #define D64NUMTRACKS_EXTENDED  (D64NUMTRACKS + 5)
 #define D71NUMTRACKS           (D64NUMTRACKS * 2)
 #define D81NUMTRACKS           80
+#define G71SIDEHALFTRACKS      84 /* half track entries per side in a G71 */
+#define REVOLUTIONTIME         200000 /* microseconds per disk revolution at 300 rpm */
+#define PLANPASSES             3 /* passes of plan_layout() over all files */
+#define PREFETCHMAXFILES       16 /* input files held open by prefetch_files() */
 #define BAM_OFFSET_SPEED_DOS   0xc0
 #define BAM_OFFSET_DOLPHIN_DOS 0xac
 #define DIRSLOTEXISTS          0
@@ -125,6 +144,8 @@
 #define RESTORE_INVALID_CHAINS  4 /* Also add and fix wild invalid t/s chains */
 #define RESTORE_INVALID_SINGLES 5 /* Also include single block files */
 /* error codes for directory */
+#define DIRNAMEBUCKETS         512 /* size of the filename index of the directory model, power of 2 */
+
 #define DIR_OK                 0
 #define DIR_ILLEGAL_TS         1
 #define DIR_CYCLIC_TS          2
@@ -134,6 +155,10 @@
 #define TRANSWARPBUFFERBLOCKSIZE 0x1f
 #define TRANSWARPBLOCKSIZE       (TRANSWARPBASEBLOCKSIZE + TRANSWARPBUFFERBLOCKSIZE)
 #define TRANSWARPKEYSIZE         29 /* 232 bits */
+#define TRANSWARPSEGMENTBLOCKS   235 /* leaves room for rounding up to whole tracks within 255 blocks */
+#define TRANSWARPSEGMENTSIZE     (TRANSWARPSEGMENTBLOCKS * TRANSWARPBLOCKSIZE)
+#define TRANSWARPMAXSEGMENTS     9
+#define TRANSWARPCYLINDERFLAG    0x80 /* in the track byte of the dir entry, the file alternates between both sides of a D71 */
 #define TRANSWARPKEYHASHROUNDS   33
 
 /* Table for conversion of uppercase PETSCII to Unicode */
@@ -196,8 +221,33 @@ typedef struct {
     int                  last_track;
     bool                 have_key;
     unsigned char        key[TRANSWARPKEYSIZE];
+    int                  segment;                     /* Transwarp segment index, 0 for the first one */
+    int                  num_segments;                /* number of Transwarp segments, 0 if not split */
+    FILE*                input;                       /* opened in advance by prefetch_files() */
+    unsigned char*       source;                      /* Transwarp file read by split_transwarp_files(), shared by its segments */
+    int                  source_size;
 } imagefile;
 
+/* Position and cached data of a directory entry, see dir_parse() */
+typedef struct {
+    int          track;          /* track of the dir block holding the entry */
+    int          sector;         /* sector of the dir block holding the entry */
+    int          offset;         /* image offset of the entry */
+    unsigned int hash;           /* filenamehash() of the filename */
+    int          bucket;         /* filename index bucket the entry is linked into, -1 for none */
+    int          next_in_bucket; /* next entry in the same bucket, -1 for none */
+    bool         reserved;       /* slot was handed out for a new file, even if its file type is still 0 */
+} dir_entry;
+
+/* Directory of the current image in chain order, kept in sync while files are added */
+typedef struct {
+    dir_entry *entries;
+    int        num_entries;
+    int        capacity;
+    int        first_free;              /* there is no free slot before this entry */
+    int        buckets[DIRNAMEBUCKETS]; /* first entry with a filename in each bucket, -1 for none */
+} directory;
+
 enum mode {
     MODE_BEGINNING_SECTOR_MASK   = 0x003f, /* 6 bits */
     MODE_MIN_TRACK_MASK          = 0x0fc0, /* 6 bits */
@@ -215,9 +265,34 @@ typedef enum {
     IMAGE_D64_EXTENDED_SPEED_DOS,
     IMAGE_D64_EXTENDED_DOLPHIN_DOS,
     IMAGE_D71,
-    IMAGE_D81
+    IMAGE_D81,
+    IMAGE_D64_HIGH_DENSITY
 } image_type;
 
+#define NUMIMAGETYPES          (IMAGE_D64_HIGH_DENSITY + 1)
+
+/* Precomputed layout of an image type, filled once by init_geometry() */
+typedef struct {
+    int num_tracks;
+    int num_blocks;
+    int dirtrack;
+    int sectors[D81NUMTRACKS + 1];           /* sectors per track, index is the track number */
+    int first_block[D81NUMTRACKS + 1];       /* linear index of sector 0 of each track */
+    int bam_bitmap_offset[D81NUMTRACKS + 1]; /* image offset of the BAM bitmap of each track */
+    int bam_count_offset[D81NUMTRACKS + 1];  /* image offset of the BAM free block count of each track */
+    int bam_bitmap_size;                     /* number of bytes in the BAM bitmap of a track */
+} image_geometry;
+
+/* In-memory copy of the BAM used by all allocators, see bam_load() and bam_commit() */
+typedef struct {
+    uint64_t free[D81NUMTRACKS + 1];   /* bitmap per track, a set bit marks a free sector */
+    uint64_t loaded[D81NUMTRACKS + 1]; /* bitmap per track as last read from or written to the image */
+    int free_count[D81NUMTRACKS + 1];  /* number of free sectors per track */
+    uint64_t reserved;                 /* dir track sectors kept for the directory, see reserved_dir_sectors() */
+    int reserved_numdirblocks;         /* parameters the reserved sectors were calculated for */
+    int reserved_interleave;
+} allocation_map;
+
 static const char *filetypename_uc[] = {
     "DEL", "SEQ", "PRG", "USR", "REL", "CBM", "???", "???",
     "???", "???", "???", "???", "???", "???", "???", "???"
@@ -248,6 +323,14 @@ sectors_per_track[] = {
     /* 66-70 */ 17,17,17,17,17
 };
 
+static const int
+sectors_per_track_high_density[] = {
+    /*  1-17 */ 22,22,22,22,22,22,22,22,22,22,22,22,22,22,22,22,22,
+    /* 18-24 */ 20,20,20,20,20,20,20,
+    /* 25-30 */ 19,19,19,19,19,19,
+    /* 31-35 */ 18,18,18,18,18
+};
+
 static const int
 sectors_per_track_extended[] = {
     /*  1-17 */ 21,21,21,21,21,21,21,21,21,21,21,21,21,21,21,21,21,
@@ -262,35 +345,111 @@ sectors_per_track_extended[] = {
     /* 76-80 */ 17,17,17,17,17
 };
 
-static int quiet           = 0;      /* global quiet flag */
-static int verbose         = 0;      /* global verbose flag */
-static int num_files       = 0;      /* number of files to be written provided by the user */
-static int max_hash_length = 16;     /* number of bytes of the filenames to calculate the hash over */
-static int unicode         = 0;      /* which unicode mapping to use: 0 = none, 1 = upper case, 2 = lower case */
-static int modified        = 0;      /* image needs to be written */
-static int dir_error       = DIR_OK; /* directory has an error */
+/* State of the image being built, kept together so that manifest jobs cannot interfere with each other */
+typedef struct {
+    int quiet;                /* quiet flag */
+    int verbose;              /* verbose flag */
+    int num_files;            /* number of files to be written provided by the user */
+    int max_hash_length;      /* number of bytes of the filenames to calculate the hash over */
+    int unicode;              /* which unicode mapping to use: 0 = none, 1 = upper case, 2 = lower case */
+    int modified;             /* image needs to be written */
+    int dir_error;            /* directory has an error */
+    allocation_map alloc_map; /* sector allocation of the image */
+    directory image_dir;      /* directory of the image, see dir_parse() */
+    uint64_t dirty[(MAXNUMBLOCKS + 63) / 64]; /* blocks changed since the image was read, see mark_dirty() */
+    bool full_save;           /* file needs to be written completely instead of only the changed blocks */
+    bool mapped;              /* image is a private memory mapping of the file */
+    FILE* output;             /* original stdout if image or G64 are written there, see claim_stdout() */
+} image_context;
+
+/* A Transwarp file to be decoded from the image into a local file, see decode_transwarp_files() */
+typedef struct {
+    const char*   alocalname;
+    unsigned char pfilename[FILENAMEMAXSIZE];
+    bool          have_key;
+    unsigned char key[TRANSWARPKEYSIZE];
+} transwarp_extract;
+
+/* Timing of the loader that plan_layout() optimizes the placement of files for */
+typedef struct {
+    int decode_time; /* microseconds the loader needs for a block before it can read the next one */
+    int step_time;   /* microseconds the head needs to step by one track */
+    int track_skew;  /* sectors that sector 0 of each track is behind the previous track, as in G64 output */
+} load_model;
+
+/* Settings for adding to an image, see parse_options() */
+typedef struct {
+    imagefile      files[MAXNUMFILES_D81];
+    transwarp_extract extracts[MAXNUMFILES_D81];
+    int            num_extracts;
+    image_type     type;
+    char*          imagepath;
+    char*          filename_g64;
+    unsigned char* header;
+    unsigned char* id;
+    unsigned char* bam_message;
+    int            dirtracksplit;
+    int            usedirtrack;
+    unsigned int   shadowdirtrack;
+    int            dir_sector_interleave;
+    int            numdirblocks;
+    int            set_header;
+    int            nooverwrite;
+    int            dovalidate;
+    int            restore_level;
+    int            ignore_collision;
+    bool           print_art_commandline;
+    bool           compact_g64;
+    int            header_gap;    /* GCR bytes behind each sector header, -1 for the default of the layout */
+    int            data_gap;      /* GCR bytes behind each data block, -1 to spread the track remainder */
+    int            g64_skew;      /* sectors that sector 0 of each track is behind sector 0 of the previous track */
+    bool           gcr_image;     /* image is read from and written as G64 or G71 */
+    bool           verify;        /* written files are read back and compared with their sources */
+    bool           plan;          /* interleave and new track sector of the files are chosen by plan_layout() */
+    load_model     model;
+} image_options;
+
+static image_geometry geometry[NUMIMAGETYPES]; /* layout of each image type, see init_geometry() */
+static image_context *job;                     /* context of the image being built, see init_context() */
 
 /* Prints the command line help */
 static void
 usage()
 {
     printf("\n*** This is cc1541 version " VERSION " built on " __DATE__ " ***\n\n");
-    printf("Usage: cc1541 [options] image.[d64|d71|d81]\n\n");
+    printf("Usage: cc1541 [options] image.[d64|d71|d81]\n");
+    printf("       cc1541 -j manifest\n");
+    printf("       cc1541 -Z endpoint\n");
+    printf("Use - as image, or -.d64, -.d71 or -.d81, to write a new image to stdout.\n");
+    printf("Images named .g64 or .g71 are read from and written as GCR images.\n\n");
     printf("-n diskname   Disk name, default='cc1541'.\n");
     printf("-i id         Disk ID, default='00 2a'.\n");
     printf("-H message    Hidden BAM message. Only for D64 (up to 85 chars) or SPEED DOS\n");
     printf("              (up to 20 chars).\n");
     printf("-w localname  Write local file to disk, if filename is not set then the\n");
     printf("              local name is used. After file written, the filename is unset.\n");
+    printf("              Use - as localname to read the file from stdin, this requires -f.\n");
     printf("-W localname  Like -w, but encode file in Transwarp format.\n");
     printf("              Provide Transwarp bootfile as last file using\n");
     printf("              \"-f 'transwarp vX.YZ' -w 'transwarp vX.YZ.prg'\"\n");
+    printf("              Files above 255 blocks are split into segments named\n");
+    printf("              filename.2, filename.3 etc. that load behind each other.\n");
+    printf("              On D71 images, files stay on the first side unless -c is set.\n");
+    printf("-D localname  Decode the Transwarp file set with -f from the image, check its\n");
+    printf("              checksums and write it to localname. Use -K for encrypted files.\n");
+    printf("              Encrypted files at $0801 are decoded with their random padding.\n");
     printf("-K key        Set an encryption key for Transwarp files, a string of up to 29\n");
     printf("              characters.\n");
     printf("-f filename   Use filename as name when writing next file, use prefix # to\n");
     printf("              include arbitrary PETSCII characters (e.g. -f \"start#a0,8,1\").\n");
     printf("-o            Do not overwrite if file with same name exists already.\n");
     printf("-V            Do not modify image unless it is in valid CBM DOS format.\n");
+    printf("-p timing     Plan interleave and first sector on a new track of all files\n");
+    printf("              together, so that loading them in order is predicted to be\n");
+    printf("              fastest. timing is decode[,step], the microseconds the loader\n");
+    printf("              needs per block and per track step (default step=6000).\n");
+    printf("-C            Read all written files back from the image and compare them\n");
+    printf("              with their sources, report the first sector that differs.\n");
     printf("-T filetype   Filetype for next file, allowed parameters are PRG, SEQ, USR, REL\n");
     printf("              and DEL, or a decimal number between 0 and 255. Default is PRG.\n");
     printf("-P            Set write protect flag for next file.\n");
@@ -307,7 +466,7 @@ usage()
     printf("              match loader option FILENAME_MAXLENGTH in Krill's loader.\n");
     printf("              Default is 16.\n");
     printf("-m            Ignore filename hash collisions, without this switch a collision\n");
-    printf("              results in an error.\n");
+    printf("              results in an error and the image is not written.\n");
     printf("-d track      Maintain a shadow directory (copy of the actual directory without\n");
     printf("              a valid BAM).\n");
     printf("-t            Use directory track to also store files (makes -x useless)\n");
@@ -328,7 +487,10 @@ usage()
     printf("-r track      Restrict next file blocks to the specified track or higher.\n");
     printf("-b sector     Set next file beginning sector to the specified value.\n");
     printf("              Not applicable for D81.\n");
-    printf("-c            Save next file cluster-optimized (d71 only).\n");
+    printf("-c            Save next file cluster-optimized (d71 only). Transwarp files\n");
+    printf("              then use the same track on both sides before moving the head.\n");
+    printf("              The stock Transwarp bootfile cannot load such files, they need\n");
+    printf("              a loader that reads the second side and bit 7 of the start track.\n");
     printf("-4            Use tracks 35-40 with SPEED DOS BAM formatting.\n");
     printf("-5            Use tracks 35-40 with DOLPHIN DOS BAM formatting.\n");
     printf("-R level      Try to restore deleted and formatted files.\n");
@@ -338,18 +500,38 @@ usage()
     printf("              level 3: Also fix dir entries with invalid t/s chains.\n");
     printf("              level 4: Also add and fix wild invalid t/s chains.\n");
     printf("              level 5: Also add reasonable wild single blocks.\n");
-    printf("-g filename   Write additional g64 output file with given name.\n");
+    printf("-g filename   Write additional g64 output file with given name, - for stdout.\n");
+    printf("              40 track images get 40 tracks, D71 images are written as g71.\n");
+    printf("-G filename   Like -g, but store each track at its real length instead of\n");
+    printf("              padding all tracks to the length of track 1.\n");
+    printf("-X            High density layout with one extra sector per track in each speed\n");
+    printf("              zone (22, 20, 19 and 18 sectors), only for .g64 images. Needs a\n");
+    printf("              custom loader, the 1541 DOS cannot read the extra sectors.\n");
+    printf("-y gap        GCR bytes between sector header and data block in g64 output,\n");
+    printf("              default is 9, or 2 for -X.\n");
+    printf("-Y gap        GCR bytes behind each data block in g64 output, the rest of the\n");
+    printf("              track goes to the last gap. Default is to spread the track evenly.\n");
+    printf("-k skew       Start sector 0 of each track in g64 output skew sectors after\n");
+    printf("              sector 0 of the previous track, default is 0 for aligned tracks.\n");
     printf("-a            Print command line options that would create the same directory as\n");
     printf("              the one in the given image (for directory art import).\n");
     printf("-U mapping    Print PETSCII as Unicode (requires Unicode 13.0 font, e.g.\n");
     printf("              UNSCII). Use mapping 0 for ASCII output, 1 for upper case, 2 for\n");
     printf("              lower case, default is 0.\n");
+    printf("-j manifest   Build all images listed in the manifest file in parallel. Each\n");
+    printf("              line holds the options and image name like a command line,\n");
+    printf("              use double quotes for arguments with spaces. Empty lines and\n");
+    printf("              lines starting with ; are ignored. Must be the only option.\n");
+    printf("-Z endpoint   Run as server that keeps images in memory, reading commands\n");
+    printf("              from stdin (endpoint -) or a Unix domain socket (endpoint is\n");
+    printf("              its path). Commands are \"open [options] image\", \"add options\",\n");
+    printf("              \"list\", \"validate\", \"save\", \"close\" and \"quit\", each is\n");
+    printf("              answered with OK or ERROR. A failed add leaves the image\n");
+    printf("              unchanged. Must be the only option.\n");
     printf("-q            Be quiet.\n");
     printf("-v            Be verbose.\n");
     printf("-h            Print this command line help.\n");
     printf("\n");
-
-    exit(-1);
 }
 
 /* Returns a pointer to the filename in a path */
@@ -361,11 +543,18 @@ basename(const unsigned char* path)
     return name;
 }
 
+/* Tells whether a path stands for stdin or stdout, which is "-" or, for images, "-.d64", "-.d71" or "-.d81" */
+static bool
+is_stdio_path(const char* path)
+{
+    return (path[0] == '-') && ((path[1] == 0) || ((path[1] == '.') && (strlen(path) == 5)));
+}
+
 /* Calculates a hash from a filename to be used by Krill's loader */
 static unsigned int
 filenamehash(const unsigned char *filename)
 {
-    int pos = min(max_hash_length, (int)strlen((char *)filename));
+    int pos = min(job->max_hash_length, (int)strlen((char *)filename));
     while ((pos > 0) && (((unsigned char) filename[pos - 1]) == FILENAMEEMPTYCHAR)) {
         --pos;
     }
@@ -406,6 +595,9 @@ image_size(image_type type)
     case IMAGE_D81:
         return D81SIZE;
 
+    case IMAGE_D64_HIGH_DENSITY:
+        return geometry[type].num_blocks * BLOCKSIZE;
+
     default:
         return 0;
     }
@@ -415,51 +607,107 @@ image_size(image_type type)
 static unsigned int
 image_num_tracks(image_type type)
 {
-    switch (type) {
-    case IMAGE_D64:
-        return D64NUMTRACKS;
-
-    case IMAGE_D64_EXTENDED_SPEED_DOS:
-    /* fall through */
-    case IMAGE_D64_EXTENDED_DOLPHIN_DOS:
-        return D64NUMTRACKS_EXTENDED;
-
-    case IMAGE_D71:
-        return D71NUMTRACKS;
-
-    case IMAGE_D81:
-        return D81NUMTRACKS;
-
-    default:
-        return 0;
-    }
+    return geometry[type].num_tracks;
 }
 
 /* Returns the number of sectors for a given track */
 static int
 num_sectors(image_type type, int track)
 {
-    return (type == IMAGE_D81) ? SECTORSPERTRACK_D81
-           : (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) ? sectors_per_track_extended[track - 1]
-              : sectors_per_track[track - 1]);
+    return geometry[type].sectors[track];
 }
 
 /* Returns the number of blocks in an image */
 static unsigned int
 image_num_blocks(image_type type)
 {
-    int num_blocks = 0;
-    for (unsigned int t = 1; t <= image_num_tracks(type); t++) {
-        num_blocks += num_sectors(type, t);
-    }
-    return num_blocks;
+    return geometry[type].num_blocks;
 }
 
 /* Returns the directory track of an image */
 static int
 dirtrack(image_type type)
 {
-    return (type == IMAGE_D81) ? DIRTRACK_D81 : DIRTRACK_D41_D71;
+    return geometry[type].dirtrack;
+}
+
+/* Precomputes track layout and BAM locations for all image types */
+static void
+init_geometry(void)
+{
+    for (int type = 0; type < NUMIMAGETYPES; type++) {
+        image_geometry *g = &geometry[type];
+        bool extended = (type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS);
+
+        switch (type) {
+        case IMAGE_D64:
+        case IMAGE_D64_HIGH_DENSITY:
+            g->num_tracks = D64NUMTRACKS;
+            break;
+        case IMAGE_D64_EXTENDED_SPEED_DOS:
+        case IMAGE_D64_EXTENDED_DOLPHIN_DOS:
+            g->num_tracks = D64NUMTRACKS_EXTENDED;
+            break;
+        case IMAGE_D71:
+            g->num_tracks = D71NUMTRACKS;
+            break;
+        case IMAGE_D81:
+            g->num_tracks = D81NUMTRACKS;
+            break;
+        }
+        g->dirtrack = (type == IMAGE_D81) ? DIRTRACK_D81 : DIRTRACK_D41_D71;
+        g->bam_bitmap_size = (type == IMAGE_D81) ? 5 : 3;
+
+        /* sector counts are also provided beyond the last track, as the allocator may look one side ahead */
+        g->sectors[0] = 0;
+        for (int t = 1; t <= D81NUMTRACKS; t++) {
+            if (type == IMAGE_D81) {
+                g->sectors[t] = SECTORSPERTRACK_D81;
+            } else if (extended) {
+                g->sectors[t] = sectors_per_track_extended[t - 1];
+            } else if ((type == IMAGE_D64_HIGH_DENSITY) && (t <= D64NUMTRACKS)) {
+                g->sectors[t] = sectors_per_track_high_density[t - 1];
+            } else {
+                g->sectors[t] = (t <= (int)(sizeof sectors_per_track / sizeof sectors_per_track[0])) ? sectors_per_track[t - 1] : 0;
+            }
+        }
+
+        g->num_blocks = 0;
+        for (int t = 1; t <= g->num_tracks; t++) {
+            g->first_block[t] = g->num_blocks;
+            g->num_blocks += g->sectors[t];
+        }
+
+        int dir = g->first_block[g->dirtrack] * BLOCKSIZE;
+        for (int t = 1; t <= g->num_tracks; t++) {
+            if (type == IMAGE_D81) {
+                int bam = (t <= 40) ? dir + BLOCKSIZE : dir + 2 * BLOCKSIZE; /* sectors 1 and 2 */
+                g->bam_bitmap_offset[t] = bam + (((t <= 40) ? t : t - 40) * 6) + 11;
+                g->bam_count_offset[t] = g->bam_bitmap_offset[t] - 1;
+            } else if ((type == IMAGE_D71) && (t > D64NUMTRACKS)) {
+                /* second side bam */
+                int bam = g->first_block[g->dirtrack + D64NUMTRACKS] * BLOCKSIZE;
+                g->bam_bitmap_offset[t] = bam + (t - D64NUMTRACKS - 1) * 3;
+                g->bam_count_offset[t] = bam + 0xdd + t - D64NUMTRACKS - 1;
+            } else if (extended && (t > D64NUMTRACKS)) {
+                int bam = dir + ((type == IMAGE_D64_EXTENDED_SPEED_DOS) ? BAM_OFFSET_SPEED_DOS : BAM_OFFSET_DOLPHIN_DOS);
+                g->bam_bitmap_offset[t] = bam + (t - D64NUMTRACKS - 1) * 4 + 1;
+                g->bam_count_offset[t] = g->bam_bitmap_offset[t] - 1;
+            } else {
+                g->bam_bitmap_offset[t] = dir + t * 4 + 1;
+                g->bam_count_offset[t] = g->bam_bitmap_offset[t] - 1;
+            }
+        }
+    }
+}
+
+/* Sets up the state for building a new image with default settings */
+static void
+init_context(image_context *context)
+{
+    memset(context, 0, sizeof *context);
+    context->max_hash_length = 16;
+    context->dir_error = DIR_OK;
 }
 
 /* Converts an ASCII character to PETSCII */
@@ -605,33 +853,39 @@ pputhex(unsigned char* string, unsigned int num)
     }
 }
 
-/* Converts a two digit hex string to an int */
-static unsigned int
+/* Converts a hex digit to an int, returns -1 if it is no hex digit */
+static int
 hex2int(char hex)
 {
     if ((hex < '0' || hex > '9') && (hex < 'a' || hex > 'f')) {
         fprintf(stderr, "ERROR: Invalid hex string in filename\n");
 
-        exit(-1);
+        return -1;
     }
     if (hex <= '9') {
         hex -= '0';
     } else {
         hex -= 'a' - 10;
     }
-    return (unsigned int)hex;
+    return hex;
 }
 
-/* Converts an ASCII string to PETSCII with escape evaluation filled up with emptychar to length */
-static void
+/* Converts an ASCII string to PETSCII with escape evaluation filled up with emptychar to length, returns -1 on an invalid escape */
+static int
 evalhexescape(const unsigned char* ascii, unsigned char* petscii, int len, unsigned char emptychar)
 {
     int read = 0, write = 0;
 
     while (ascii[read] != '\0' && write < len) {
         if (ascii[read] == '#') {
-            unsigned int hi = hex2int(ascii[++read]);
-            unsigned int lo = hex2int(ascii[++read]);
+            int hi = hex2int(ascii[++read]);
+            if (hi < 0) {
+                return -1;
+            }
+            int lo = hex2int(ascii[++read]);
+            if (lo < 0) {
+                return -1;
+            }
             petscii[write] = (unsigned char)(16 * hi + lo);
         } else {
             petscii[write] = a2p(ascii[read]);
@@ -643,6 +897,7 @@ evalhexescape(const unsigned char* ascii, unsigned char* petscii, int len, unsig
         petscii[write] = emptychar;
         ++write;
     }
+    return 0;
 }
 
 /* Converts a unicode character to utf8 */
@@ -713,11 +968,25 @@ void reverse_print_off()
 #endif
 }
 
+#ifndef _WIN32
+/* Returns the number of child processes to run at a time, one per online core but at least one */
+static int
+num_workers()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_cpus < 1) ? 1 : (int)num_cpus;
+#else
+    return 1;
+#endif
+}
+#endif
+
 /* Prints a PETSCII character */
 static void
 putp(unsigned char petscii, FILE *file)
 {
-    if (unicode) {
+    if (job->unicode) {
         int u;
         int reverse = 0;
 
@@ -727,7 +996,7 @@ putp(unsigned char petscii, FILE *file)
             petscii += 0x40;
         }
 
-        if (unicode == 1) {
+        if (job->unicode == 1) {
             u = p2u_uppercase_tab[petscii];
         } else {
             u = p2u_lowercase_tab[petscii];
@@ -806,180 +1075,240 @@ print_filename(FILE *file, unsigned char* pfilename)
 static int
 linear_sector(image_type type, int track, int sector)
 {
-    if ((track < 1) || (track > ((type == IMAGE_D81) ? D81NUMTRACKS : ((type == IMAGE_D64) ? D64NUMTRACKS : (type == IMAGE_D71 ? D71NUMTRACKS : D64NUMTRACKS_EXTENDED))))) {
-        return -1;
-    }
+    const image_geometry *g = &geometry[type];
 
-    int numsectors = num_sectors(type, track);
-    if ((sector < 0) || (sector >= numsectors)) {
+    if ((track < 1) || (track > g->num_tracks)) {
         return -1;
     }
-
-    int linear_sector = 0;
-    for (int i = 0; i < track - 1; i++) {
-        linear_sector += num_sectors(type, i + 1);
+    if ((sector < 0) || (sector >= g->sectors[track])) {
+        return -1;
     }
-    linear_sector += sector;
 
-    return linear_sector;
+    return g->first_block[track] + sector;
 }
 
 /* Returns the image offset of the bam entry for a given track */
 static int
 get_bam_offset(image_type type, unsigned int track)
 {
-    int bam;
-    unsigned int offset;
+    return geometry[type].bam_bitmap_offset[track];
+}
 
-    if (type == IMAGE_D81) {
-        if (track <= 40) {
-            bam = linear_sector(type, dirtrack(type), 1 /* sector */) * BLOCKSIZE;
-            offset = bam + (track * 6) + 11;
-        } else {
-            bam = linear_sector(type, dirtrack(type), 2 /* sector */) * BLOCKSIZE;
-            offset = bam + ((track - 40) * 6) + 11;
-        }
-    } else if ((type == IMAGE_D71) && (track > D64NUMTRACKS)) {
-        /* access second side bam */
-        bam = linear_sector(type, dirtrack(type) + D64NUMTRACKS, 0) * BLOCKSIZE;
-        offset = bam + (track - D64NUMTRACKS - 1) * 3;
-    } else {
-        if (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) && (track > D64NUMTRACKS)) {
-            track -= D64NUMTRACKS;
-            bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE + ((type == IMAGE_D64_EXTENDED_SPEED_DOS) ? BAM_OFFSET_SPEED_DOS : BAM_OFFSET_DOLPHIN_DOS);
-        } else {
-            bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
-        }
-        offset = bam + track * 4 + 1;
+/* Returns the number of set bits */
+static int
+popcount64(uint64_t value)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(value);
+#else
+    int count = 0;
+    for (; value != 0; value &= value - 1) {
+        count++;
     }
-    return offset;
+    return count;
+#endif
 }
 
-/* Checks if a given sector is marked as free in the BAM and also not used by directory */
+/* Returns the index of the lowest set bit, value must not be 0 */
 static int
-is_sector_free(image_type type, const unsigned char* image, int track, int sector, int numdirblocks, int dir_sector_interleave)
+lowest_bit64(uint64_t value)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(value);
+#else
+    int bit = 0;
+    for (; (value & 1) == 0; value >>= 1) {
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+/* Returns a mask with the valid sectors of a track set */
+static uint64_t
+track_mask(image_type type, int track)
+{
+    return (((uint64_t)1) << num_sectors(type, track)) - 1;
+}
+
+/* Reads the BAM of the image into the allocation map */
+static void
+bam_load(image_type type, const unsigned char* image)
 {
-    int bam;
-    const unsigned char* bitmap;
+    const image_geometry *g = &geometry[type];
 
-    if (sector < 0) {
-        fprintf(stderr, "ERROR: Illegal sector %d for track %d\n", sector, track);
+    memset(&job->alloc_map, 0, sizeof job->alloc_map);
+    job->alloc_map.reserved_numdirblocks = -1;
+    for (int t = 1; t <= g->num_tracks; t++) {
+        const unsigned char* bitmap = image + get_bam_offset(type, t);
+        uint64_t free = 0;
+        for (int b = 0; b < g->bam_bitmap_size; b++) {
+            free |= ((uint64_t)bitmap[b]) << (b * 8);
+        }
+        job->alloc_map.free[t] = free;
+        job->alloc_map.loaded[t] = free;
+        job->alloc_map.free_count[t] = popcount64(free & track_mask(type, t));
+    }
+}
 
-        exit(-1);
+/* Remembers that the block holding the given image offset was changed, so that it is saved */
+static void
+mark_dirty(unsigned int offset)
+{
+    unsigned int block = offset / BLOCKSIZE;
+    if (block < MAXNUMBLOCKS) {
+        job->dirty[block / 64] |= 1ULL << (block % 64);
     }
+}
 
-    if (type == IMAGE_D81) {
-        if (track <= 40) {
-            bam = linear_sector(type, dirtrack(type), 1 /* sector */) * BLOCKSIZE;
-            bitmap = image + bam + (track * 6) + 11;
-        } else {
-            bam = linear_sector(type, dirtrack(type), 2 /* sector */) * BLOCKSIZE;
-            bitmap = image + bam + ((track - 40) * 6) + 11;
+/* Writes all tracks changed in the allocation map back to the BAM of the image */
+static void
+bam_commit(image_type type, unsigned char* image)
+{
+    const image_geometry *g = &geometry[type];
+
+    for (int t = 1; t <= g->num_tracks; t++) {
+        uint64_t free = job->alloc_map.free[t];
+        if (free == job->alloc_map.loaded[t]) {
+            continue;
         }
-    } else if ((type == IMAGE_D71) && (track > D64NUMTRACKS)) {
-        /* access second side bam */
-        bam = linear_sector(type, dirtrack(type) + D64NUMTRACKS, 0) * BLOCKSIZE;
-        bitmap = image + bam + (track - D64NUMTRACKS - 1) * 3;
-    } else {
-        if (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) && (track > D64NUMTRACKS)) {
-            track -= D64NUMTRACKS+1;
-            bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE + ((type == IMAGE_D64_EXTENDED_SPEED_DOS) ? BAM_OFFSET_SPEED_DOS : BAM_OFFSET_DOLPHIN_DOS);
-        } else {
-            bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
+        unsigned char* bitmap = image + get_bam_offset(type, t);
+        for (int b = 0; b < g->bam_bitmap_size; b++) {
+            bitmap[b] = (free >> (b * 8)) & 0xff;
         }
-        bitmap = image + bam + (track * 4) + 1;
+        /* adjust the number of free sectors by the change, as the stored number may be inconsistent */
+        int delta = popcount64(free) - popcount64(job->alloc_map.loaded[t]);
+        image[g->bam_count_offset[t]] = (unsigned char)(image[g->bam_count_offset[t]] + delta);
+        mark_dirty(get_bam_offset(type, t));
+        mark_dirty(g->bam_count_offset[t]);
+        job->alloc_map.loaded[t] = free;
     }
+}
 
-    int byte = sector >> 3;
-    int bit = sector & 7;
+/* Returns the sectors on the dir track that are kept free for the given number of directory blocks */
+static uint64_t
+reserved_dir_sectors(image_type type, int numdirblocks, int dir_sector_interleave)
+{
+    if ((numdirblocks == job->alloc_map.reserved_numdirblocks) && (dir_sector_interleave == job->alloc_map.reserved_interleave)) {
+        return job->alloc_map.reserved;
+    }
 
-    int is_not_dir_block = 1;
-    if ((track == dirtrack(type)) && (numdirblocks > 0)) {
-        int dirsector = 0;
-        int s = 2;
-        for (int i = 0; is_not_dir_block && (i < numdirblocks); i++) {
-            switch (i) {
-            case 0:
-                dirsector = 0;
-                break;
+    int track = dirtrack(type);
+    uint64_t reserved = 0;
+    int dirsector = 0;
+    int s = 2;
+    for (int i = 0; i < numdirblocks; i++) {
+        switch (i) {
+        case 0:
+            dirsector = 0;
+            break;
 
-            case 1:
-                dirsector = 1;
-                break;
+        case 1:
+            dirsector = 1;
+            break;
 
-            default:
-                dirsector += dir_sector_interleave;
-                if (dirsector >= num_sectors(type, track)) {
-                    dirsector = s;
-                    s++;
-                }
-                break;
+        default:
+            dirsector += dir_sector_interleave;
+            if (dirsector >= num_sectors(type, track)) {
+                dirsector = s;
+                s++;
             }
-            is_not_dir_block = (sector != dirsector);
+            break;
+        }
+        if (dirsector < num_sectors(type, track)) {
+            reserved |= ((uint64_t)1) << dirsector;
         }
     }
 
-    return is_not_dir_block && ((bitmap[byte] & (1 << bit)) != 0);
+    job->alloc_map.reserved = reserved;
+    job->alloc_map.reserved_numdirblocks = numdirblocks;
+    job->alloc_map.reserved_interleave = dir_sector_interleave;
+    return reserved;
 }
 
-/* Marks given sector in BAM */
-static void
-mark_sector(image_type type, unsigned char* image, int track, int sector, int free)
+/* Returns the sectors of a track that are marked as free in the BAM and also not used by directory */
+static uint64_t
+available_sectors(image_type type, int track, int numdirblocks, int dir_sector_interleave)
 {
-    if (free != is_sector_free(type, image, track, sector, 0, 0)) {
-        int bam;
-        unsigned char* bitmap;
-        if (type == IMAGE_D81) {
-            if (track <= 40) {
-                bam = linear_sector(type, dirtrack(type), 1 /* sector */) * BLOCKSIZE;
-                bitmap = image + bam + (track * 6) + 11;
-            } else {
-                bam = linear_sector(type, dirtrack(type), 2 /* sector */) * BLOCKSIZE;
-                bitmap = image + bam + ((track - 40) * 6) + 11;
-            }
+    if ((track < 1) || (track > geometry[type].num_tracks)) {
+        return 0;
+    }
 
-            /* update number of free sectors on track */
-            if (free) {
-                ++bitmap[-1];
-            } else {
-                --bitmap[-1];
-            }
-        } else if ((type == IMAGE_D71) && (track > D64NUMTRACKS)) {
-            /* access second side bam */
-            bam = linear_sector(type, dirtrack(type) + D64NUMTRACKS, 0) * BLOCKSIZE;
-            bitmap = image + bam + (track - D64NUMTRACKS - 1) * 3;
+    uint64_t available = job->alloc_map.free[track];
+    if ((track == dirtrack(type)) && (numdirblocks > 0)) {
+        available &= ~reserved_dir_sectors(type, numdirblocks, dir_sector_interleave);
+    }
+    return available;
+}
 
-            /* update number of free sectors on track */
-            if (free) {
-                image[bam + 0xdd + track - D64NUMTRACKS - 1]++;
-            } else {
-                image[bam + 0xdd + track - D64NUMTRACKS - 1]--;
-            }
-        } else {
-            if (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) && (track > D64NUMTRACKS)) {
-                track -= D64NUMTRACKS+1;
-                bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE + ((type == IMAGE_D64_EXTENDED_SPEED_DOS) ? BAM_OFFSET_SPEED_DOS : BAM_OFFSET_DOLPHIN_DOS);
-            } else {
-                bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
-            }
-            bitmap = image + bam + (track * 4) + 1;
+/* Checks if a given sector is marked as free in the BAM and also not used by directory, illegal sectors are never free */
+static int
+is_sector_free(image_type type, int track, int sector, int numdirblocks, int dir_sector_interleave)
+{
+    if ((sector < 0) || (sector >= 64)) {
+        return 0;
+    }
 
-            /* update number of free sectors on track */
-            if (free) {
-                ++image[bam + (track * 4)];
-            } else {
-                --image[bam + (track * 4)];
-            }
+    return (available_sectors(type, track, numdirblocks, dir_sector_interleave) >> sector) & 1;
+}
+
+/* Returns the number of free sectors on a track that are not used by directory */
+static int
+free_sectors_on_track(image_type type, int track, int numdirblocks, int dir_sector_interleave)
+{
+    if ((track == dirtrack(type)) && (numdirblocks > 0)) {
+        return popcount64(available_sectors(type, track, numdirblocks, dir_sector_interleave) & track_mask(type, track));
+    }
+    return ((track < 1) || (track > geometry[type].num_tracks)) ? 0 : job->alloc_map.free_count[track];
+}
+
+/* Returns the first free sector out of sector, sector + interleave, ... (wrapping around the track) within count steps, or -1 if there is none */
+static int
+next_free_sector(image_type type, int track, int sector, int interleave, int count, int numdirblocks, int dir_sector_interleave)
+{
+    int sectors = num_sectors(type, track);
+    if (sectors <= 0) {
+        return -1;
+    }
+    uint64_t available = available_sectors(type, track, numdirblocks, dir_sector_interleave) & track_mask(type, track);
+    if (available == 0) {
+        return -1;
+    }
+    sector %= sectors;
+
+    if ((interleave == 1) && (count >= sectors)) {
+        uint64_t ahead = available >> sector;
+        return (ahead != 0) ? sector + lowest_bit64(ahead) : lowest_bit64(available);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if ((available >> sector) & 1) {
+            return sector;
         }
+        sector = (sector + interleave) % sectors;
+    }
+    return -1;
+}
 
-        /* update bitmap */
-        int byte = sector >> 3;
-        int bit = sector & 7;
+/* Marks given sector in the allocation map, bam_commit() writes it to the BAM */
+static void
+mark_sector(image_type type, int track, int sector, int free)
+{
+    if ((track < 1) || (track > geometry[type].num_tracks)) {
+        return;
+    }
+    if (free != is_sector_free(type, track, sector, 0, 0)) {
+        uint64_t bit = ((uint64_t)1) << sector;
 
         if (free) {
-            bitmap[byte] |= 1 << bit;
+            job->alloc_map.free[track] |= bit;
         } else {
-            bitmap[byte] &= ~(1 << bit);
+            job->alloc_map.free[track] &= ~bit;
+        }
+
+        /* update number of free sectors on track */
+        if (sector < num_sectors(type, track)) {
+            job->alloc_map.free_count[track] += free ? 1 : -1;
         }
     }
 }
@@ -1012,11 +1341,12 @@ get_id_offset(image_type type)
     return offset;
 }
 
-/* Updates the directory with the given header, id and BAM message */
-static void
+/* Updates the directory with the given header, id and BAM message, returns -1 on an invalid escape */
+static int
 update_directory(image_type type, unsigned char* image, unsigned char* header, unsigned char* id, unsigned char *bam_message, int shadowdirtrack)
 {
     unsigned int bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
+    mark_dirty(bam);
 
     if (type != IMAGE_D81) {
         image[bam + 0x03] = (type == IMAGE_D71) ? 0x80 : 0x00;
@@ -1025,8 +1355,10 @@ update_directory(image_type type, unsigned char* image, unsigned char* header, u
     /* Set header and ID */
     unsigned char pheader[FILENAMEMAXSIZE];
     unsigned char pid[5];
-    evalhexescape(header, pheader, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR);
-    evalhexescape(id, pid, 5, FILENAMEEMPTYCHAR);
+    if ((evalhexescape(header, pheader, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0)
+            || (evalhexescape(id, pid, 5, FILENAMEEMPTYCHAR) != 0)) {
+        return -1;
+    }
     memcpy(image + bam + get_header_offset(type), pheader, FILENAMEMAXSIZE);
     memcpy(image + bam + get_id_offset(type), pid, 5);
 
@@ -1037,7 +1369,9 @@ update_directory(image_type type, unsigned char* image, unsigned char* header, u
         if(type == IMAGE_D64_EXTENDED_SPEED_DOS) {
             bam_message_len = 0xbf - BAMMESSAGEOFFSET; /* avoid conflict with extended BAM and allow for a 0 at the end*/
         }
-        evalhexescape(bam_message, pbam_message, bam_message_len, 0);
+        if (evalhexescape(bam_message, pbam_message, bam_message_len, 0) != 0) {
+            return -1;
+        }
         memcpy(image + bam + BAMMESSAGEOFFSET, pbam_message, bam_message_len);
     }
 
@@ -1045,28 +1379,34 @@ update_directory(image_type type, unsigned char* image, unsigned char* header, u
         unsigned int bam = linear_sector(type, dirtrack(type), 1 /* sector */) * BLOCKSIZE;
         image[bam + 0x04] = id[0];
         image[bam + 0x05] = id[1];
+        mark_dirty(bam);
 
         bam = linear_sector(type, dirtrack(type), 2 /* sector */) * BLOCKSIZE;
         image[bam + 0x04] = id[0];
         image[bam + 0x05] = id[1];
+        mark_dirty(bam);
     }
 
     if (shadowdirtrack > 0) {
+        bam_commit(type, image);
         unsigned int shadowbam = linear_sector(type, shadowdirtrack, 0 /* sector */) * BLOCKSIZE;
         memcpy(image + shadowbam, image + bam, BLOCKSIZE);
 
         image[shadowbam + 0x00] = shadowdirtrack;
+        mark_dirty(shadowbam);
     }
+    return 0;
 }
 
-/* Writes an empty directory and BAM */
-static void
+/* Writes an empty directory and BAM, returns -1 on an invalid escape */
+static int
 initialize_directory(image_type type, unsigned char* image, unsigned char* header, unsigned char* id, unsigned char * bam_message, int shadowdirtrack)
 {
     unsigned int dir = linear_sector(type, dirtrack(type), 0 /* sector */) * BLOCKSIZE;
 
     /* Clear image */
     memset(image, 0, image_size(type));
+    bam_load(type, image);
 
     /* Write initial BAM */
     if (type == IMAGE_D81) {
@@ -1080,14 +1420,14 @@ initialize_directory(image_type type, unsigned char* image, unsigned char* heade
         image[dir + 0x1b] = FILENAMEEMPTYCHAR;
         image[dir + 0x1c] = FILENAMEEMPTYCHAR;
 
-        unsigned int bam = linear_sector(type, dirtrack(type), 1 /* sector */) * BLOCKSIZE;
+        unsigned int bam = (geometry[type].first_block[dirtrack(type)] + 1 /* sector */) * BLOCKSIZE;
         image[bam + 0x00] = dirtrack(type);
         image[bam + 0x01] = 2;
         image[bam + 0x02] = 0x44;
         image[bam + 0x03] = 0xbb;
         image[bam + 0x06] = 0xc0;
 
-        bam = linear_sector(type, dirtrack(type), 2 /* sector */) * BLOCKSIZE;
+        bam = (geometry[type].first_block[dirtrack(type)] + 2 /* sector */) * BLOCKSIZE;
         image[bam + 0x00] = 0;
         image[bam + 0x01] = 255;
         image[bam + 0x02] = 0x44;
@@ -1111,33 +1451,33 @@ initialize_directory(image_type type, unsigned char* image, unsigned char* heade
     /* Mark all sectors unused */
     for (unsigned int t = 1; t <= image_num_tracks(type); t++) {
         for (int s = 0; s < num_sectors(type, t); s++) {
-            mark_sector(type, image, t, s, 1 /* free */);
+            mark_sector(type, t, s, 1 /* free */);
         }
     }
 
     /* Reserve space for BAM */
-    mark_sector(type, image, dirtrack(type), 0 /* sector */, 0 /* not free */);
+    mark_sector(type, dirtrack(type), 0 /* sector */, 0 /* not free */);
     if (type == IMAGE_D71) {
-        mark_sector(type, image, dirtrack(type) + D64NUMTRACKS, 0 /* sector */, 0 /* not free */);
+        mark_sector(type, dirtrack(type) + D64NUMTRACKS, 0 /* sector */, 0 /* not free */);
     } else if (type == IMAGE_D81) {
-        mark_sector(type, image, dirtrack(type), 1 /* sector */, 0 /* not free */);
-        mark_sector(type, image, dirtrack(type), 2 /* sector */, 0 /* not free */);
+        mark_sector(type, dirtrack(type), 1 /* sector */, 0 /* not free */);
+        mark_sector(type, dirtrack(type), 2 /* sector */, 0 /* not free */);
     }
 
     /* first dir block */
-    unsigned int dirblock = linear_sector(type, dirtrack(type), (type == IMAGE_D81) ? 3 : 1) * BLOCKSIZE;
+    unsigned int dirblock = (geometry[type].first_block[dirtrack(type)] + ((type == IMAGE_D81) ? 3 : 1)) * BLOCKSIZE;
     image[dirblock + SECTORLINKOFFSET] = 255;
-    mark_sector(type, image, dirtrack(type), (type == IMAGE_D81) ? 3 : 1 /* sector */, 0 /* not free */);
+    mark_sector(type, dirtrack(type), (type == IMAGE_D81) ? 3 : 1 /* sector */, 0 /* not free */);
 
     if (shadowdirtrack > 0) {
         dirblock = linear_sector(type, shadowdirtrack, (type == IMAGE_D81) ? 3 : 1 /* sector */) * BLOCKSIZE;
         image[dirblock + SECTORLINKOFFSET] = 255;
 
-        mark_sector(type, image, shadowdirtrack, 0 /* sector */, 0 /* not free */);
-        mark_sector(type, image, shadowdirtrack, (type == IMAGE_D81) ? 3 : 1 /* sector */, 0 /* not free */);
+        mark_sector(type, shadowdirtrack, 0 /* sector */, 0 /* not free */);
+        mark_sector(type, shadowdirtrack, (type == IMAGE_D81) ? 3 : 1 /* sector */, 0 /* not free */);
     }
 
-    update_directory(type, image, header, id, bam_message, shadowdirtrack);
+    return update_directory(type, image, header, id, bam_message, shadowdirtrack);
 }
 
 /* Computes Transwarp dirdata checksum */
@@ -1171,14 +1511,35 @@ is_transwarp_bootfile(const unsigned char *image, int dir_entry_offset)
     return memcmp(image + dir_entry_offset + FILENAMEOFFSET, TRANSWARP, strlen(TRANSWARP)) == 0;
 }
 
+/* Returns the track a Transwarp file continues on: outward from the dir track of its side, or for a file stored
+   in cylinders, on the same track of the second D71 side first. Returns 0 where a D71 side ends */
+static int
+transwarp_next_track(image_type type, int track, bool cylinders)
+{
+    int side = ((type == IMAGE_D71) && (track > D64NUMTRACKS)) ? D64NUMTRACKS : 0;
+    if (cylinders) {
+        if (side == 0) {
+            return track + D64NUMTRACKS; /* no head movement */
+        }
+        track -= D64NUMTRACKS;
+        side = 0;
+    }
+    int next = (track - side < DIRTRACK_D41_D71) ? (track - 1) : (track + 1);
+    if ((type == IMAGE_D71) && ((next <= side) || (next > side + D64NUMTRACKS))) {
+        return 0;
+    }
+    return next;
+}
+
 /* Return Transwarp file stat */
 static int
-transwarp_stat(image_type type, const unsigned char *image, int dir_entry_offset, int *start_track, int *end_track, int *low_track, int *high_track)
+transwarp_stat(image_type type, const unsigned char *image, int dir_entry_offset, int *start_track, int *end_track, int *low_track, int *high_track, bool *cylinders)
 {
     *start_track = 0;
     *end_track = 0;
     *low_track = 0;
     *high_track = 0;
+    *cylinders = false;
 
     int filesize = (image[dir_entry_offset + ENDADDRESSLOOFFSET]  | (image[dir_entry_offset + ENDADDRESSHIOFFSET] << 8))
                    - (image[dir_entry_offset + LOADADDRESSLOOFFSET] | (image[dir_entry_offset + LOADADDRESSHIOFFSET] << 8));
@@ -1186,41 +1547,43 @@ transwarp_stat(image_type type, const unsigned char *image, int dir_entry_offset
         return 0;
     }
 
-    *start_track = image[dir_entry_offset + TRANSWARPTRACKOFFSET];
+    *start_track = image[dir_entry_offset + TRANSWARPTRACKOFFSET] & ~TRANSWARPCYLINDERFLAG;
+    *cylinders = (type == IMAGE_D71) && (image[dir_entry_offset + TRANSWARPTRACKOFFSET] & TRANSWARPCYLINDERFLAG);
     *end_track = *start_track;
+    *low_track = *start_track;
+    *high_track = *start_track;
 
     int size = filesize;
 
-    while (filesize > 0) {
+    while ((filesize > 0) && (linear_sector(type, *end_track, 0) >= 0)) {
         filesize -= (TRANSWARPBLOCKSIZE * num_sectors(type, *end_track));
         if (filesize > 0) {
-            *end_track = (*end_track < DIRTRACK_D41_D71) ? (*end_track - 1) : (*end_track + 1);
+            *end_track = transwarp_next_track(type, *end_track, *cylinders);
+            if (*end_track < *low_track) {
+                *low_track = *end_track;
+            }
+            if (*end_track > *high_track) {
+                *high_track = *end_track;
+            }
         }
     }
 
-    *low_track = (*start_track < *end_track) ? *start_track : *end_track;
-    *high_track = (*start_track > *end_track) ? *start_track : *end_track;
-
     return size;
 }
 
 /* Return Transwarp file stat */
 static int
-transwarp_size(image_type type, int start_track, int end_track, int filesize,
+transwarp_size(image_type type, int start_track, int end_track, bool cylinders, int filesize,
                int *transwarp_blocks, int *nonredundant_blocks, int *redundant_blocks, int *nonredundant_blocks_on_last_track)
 {
     *transwarp_blocks = 0;
 
-    int last_track_sectors;
-    if (start_track <= end_track) {
-        for (int track = start_track; track <= end_track; ++track) {
-            last_track_sectors = num_sectors(type, track);
-            *transwarp_blocks += last_track_sectors;
-        }
-    } else {
-        for (int track = start_track; track >= end_track; --track) {
-            last_track_sectors = num_sectors(type, track);
-            *transwarp_blocks += last_track_sectors;
+    int last_track_sectors = 0;
+    for (int track = start_track; track > 0; track = transwarp_next_track(type, track, cylinders)) {
+        last_track_sectors = num_sectors(type, track);
+        *transwarp_blocks += last_track_sectors;
+        if (track == end_track) {
+            break;
         }
     }
 
@@ -1237,7 +1600,7 @@ transwarp_size(image_type type, int start_track, int end_track, int filesize,
 }
 
 /* Deletes a file from disk and BAM, but leaves the directory entry */
-static void
+static int
 wipe_file(image_type type, unsigned char* image, imagefile* file)
 {
     int b = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
@@ -1247,42 +1610,53 @@ wipe_file(image_type type, unsigned char* image, imagefile* file)
         int end_track;
         int low_track;
         int high_track;
-        int filesize = transwarp_stat(type, image, b, &start_track, &end_track, &low_track, &high_track);
+        bool cylinders;
+        int filesize = transwarp_stat(type, image, b, &start_track, &end_track, &low_track, &high_track, &cylinders);
         if (filesize <= 0) {
             fprintf(stderr, "ERROR: Cannot overwrite Transwarp file ");
             print_filename(stderr, file->pfilename);
             fprintf(stderr, "\n");
 
-            exit(-1);
+            return -1;
         }
 
-        for (int track = low_track; track <= high_track; ++track) {
+        for (int track = start_track; track > 0; track = transwarp_next_track(type, track, cylinders)) {
             for (int sector = 0; sector < num_sectors(type, track); ++sector) {
                 int block_offset = linear_sector(type, track, sector) * BLOCKSIZE;
                 memset(image + block_offset, 0, BLOCKSIZE);
-                mark_sector(type, image, track, sector, 1 /* free */);
+                mark_dirty(block_offset);
+                mark_sector(type, track, sector, 1 /* free */);
+            }
+            if (track == end_track) {
+                break;
             }
         }
 
-        return;
+        return 0;
     }
 
     unsigned int track = image[b + FILETRACKOFFSET];
     unsigned int sector = image[b + FILESECTOROFFSET];
 
     if (sector >= 0x80) {
-        return; /* loop file */
+        return 0; /* loop file */
     }
 
     while (track != 0) {
+        if (linear_sector(type, track, sector) < 0) {
+            break; /* broken chain, nothing more to wipe */
+        }
         int block_offset = linear_sector(type, track, sector) * BLOCKSIZE;
         int next_track = image[block_offset + TRACKLINKOFFSET];
         int next_sector = image[block_offset + SECTORLINKOFFSET];
         memset(image + block_offset, 0, BLOCKSIZE); /* this also fixes any cyclic t/s chain */
-        mark_sector(type, image, track, sector, 1 /* free */);
+        mark_dirty(block_offset);
+        mark_sector(type, track, sector, 1 /* free */);
         track = next_track;
         sector = next_sector;
     }
+
+    return 0;
 }
 
 /* Sets image offset to the next DIR entry, returns false when the DIR end was reached */
@@ -1301,11 +1675,11 @@ next_dir_entry(image_type type, const unsigned char* image, int *track, int *sec
         int next_sector = image[b * BLOCKSIZE + SECTORLINKOFFSET];
         b = linear_sector(type, next_track, next_sector);
         if(b < 0) {
-            dir_error = DIR_ILLEGAL_TS;
+            job->dir_error = DIR_ILLEGAL_TS;
             return false;
         }
         if(blockmap[b]) {
-            dir_error = DIR_CYCLIC_TS;
+            job->dir_error = DIR_CYCLIC_TS;
             return false;
         }
         *track = next_track;
@@ -1317,161 +1691,227 @@ next_dir_entry(image_type type, const unsigned char* image, int *track, int *sec
     return true;
 }
 
-/* Finds all filenames with the given hash */
+/* Returns the filename index bucket for a filename */
 static int
-count_hashes(image_type type, const unsigned char* image, unsigned int hash, bool print)
+dir_name_bucket(const unsigned char* filename)
 {
-    int num = 0;
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
+    uint32_t hash = 2166136261u; /* FNV-1a */
+    for (int i = 0; i < FILENAMEMAXSIZE; i++) {
+        hash = (hash ^ filename[i]) * 16777619u;
     }
-
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
-        int filetype = image[dirblock + FILETYPEOFFSET];
-
-        if (filetype != FILETYPEDEL) {
-            unsigned char *filename = (unsigned char *) image + dirblock + FILENAMEOFFSET;
-            if (hash == filenamehash(filename)) {
-                ++num;
-
-                if (print) {
-                    printf(" [$%04x] ", filenamehash(filename));
-                    print_filename(stdout, filename);
-                    printf("\n");
-                }
-            }
-        }
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
-
-    return num;
+    return hash & (DIRNAMEBUCKETS - 1);
 }
 
-/* Checks if multiple filenames have the same hash */
-static bool
-check_hashes(image_type type, const unsigned char* image)
+/* Removes a directory entry from the filename index */
+static void
+dir_unlink_name(int index)
 {
-    bool collision = false;
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
+    dir_entry *entry = &job->image_dir.entries[index];
+    if (entry->bucket < 0) {
+        return;
     }
-    printf("\n");
+    int *link = &job->image_dir.buckets[entry->bucket];
+    while (*link != index) {
+        link = &job->image_dir.entries[*link].next_in_bucket;
+    }
+    *link = entry->next_in_bucket;
+    entry->bucket = -1;
+    entry->next_in_bucket = -1;
+}
 
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
-        int filetype = image[dirblock + FILETYPEOFFSET];
+/* Adds a directory entry to the filename index, keeping each bucket in directory order */
+static void
+dir_link_name(const unsigned char* image, int index)
+{
+    dir_entry *entry = &job->image_dir.entries[index];
+    entry->bucket = dir_name_bucket(image + entry->offset + FILENAMEOFFSET);
+    int *link = &job->image_dir.buckets[entry->bucket];
+    while ((*link >= 0) && (*link < index)) {
+        link = &job->image_dir.entries[*link].next_in_bucket;
+    }
+    entry->next_in_bucket = *link;
+    *link = index;
+}
 
-        if (filetype != FILETYPEDEL) {
-            unsigned char *filename = (unsigned char *) image + dirblock + FILENAMEOFFSET;
-            if (count_hashes(type, image, filenamehash(filename), false /* print */) > 1) {
-                collision = 1;
-                fprintf(stderr, "Hash of filename ");
-                print_filename(stderr, filename);
-                fprintf(stderr, " [$%04x] is not unique\n", filenamehash(filename));
-                count_hashes(type, image, filenamehash(filename), true /* print */);
-            }
+/* Updates the cached data of a directory entry after its file type or filename was changed in the image */
+static void
+dir_sync_entry(const unsigned char* image, int index)
+{
+    dir_entry *entry = &job->image_dir.entries[index];
+    dir_unlink_name(index);
+    dir_link_name(image, index);
+    entry->hash = filenamehash(image + entry->offset + FILENAMEOFFSET);
+    if ((image[entry->offset + FILETYPEOFFSET] == FILETYPEDEL) && !entry->reserved && (index < job->image_dir.first_free)) {
+        job->image_dir.first_free = index;
+    }
+}
+
+/* Updates the cached data of the directory entry at the given image offset, if it is part of the directory */
+static void
+dir_sync_offset(const unsigned char* image, int offset)
+{
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        if (job->image_dir.entries[i].offset == offset) {
+            dir_sync_entry(image, i);
+            return;
         }
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
-    return collision;
+    }
 }
 
-/* Searches for an existing DIR entry with the given name, returns false if it does not exist */
-static bool
-find_existing_file(image_type type, unsigned char* image, unsigned char* filename, int *index, int *track, int *sector, int *offset)
+/* Appends an entry to the directory model */
+static int
+dir_add_entry(image_type type, const unsigned char* image, int track, int sector, int offset)
+{
+    if (job->image_dir.num_entries == job->image_dir.capacity) {
+        int capacity = (job->image_dir.capacity > 0) ? job->image_dir.capacity * 2 : 16 * DIRENTRIESPERBLOCK;
+        dir_entry *entries = (dir_entry *)realloc(job->image_dir.entries, capacity * sizeof(dir_entry));
+        if (entries == NULL) {
+            fprintf(stderr, "ERROR: Memory allocation error\n");
+            return -1;
+        }
+        job->image_dir.entries = entries;
+        job->image_dir.capacity = capacity;
+    }
+    int index = job->image_dir.num_entries++;
+    dir_entry *entry = &job->image_dir.entries[index];
+    entry->track = track;
+    entry->sector = sector;
+    entry->offset = linear_sector(type, track, sector) * BLOCKSIZE + offset;
+    entry->bucket = -1;
+    entry->next_in_bucket = -1;
+    entry->reserved = false;
+    dir_sync_entry(image, index);
+    return 0;
+}
+
+/* Parses the directory sector chain of the image into the directory model */
+static int
+dir_parse(image_type type, const unsigned char* image)
 {
-    *track = dirtrack(type);
-    *sector = (type == IMAGE_D81) ? 3 : 1;
-    *offset = 0;
-    *index = 0;
+    job->image_dir.num_entries = 0;
+    job->image_dir.first_free = 0;
+    for (int i = 0; i < DIRNAMEBUCKETS; i++) {
+        job->image_dir.buckets[i] = -1;
+    }
+
     char *blockmap = calloc(image_num_blocks(type), sizeof(char));
     if(blockmap == NULL) {
         fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
+        return -1;
     }
-
+    int dt = dirtrack(type);
+    int ds = (type == IMAGE_D81) ? 3 : 1;
+    int offset = 0;
     do {
-        int b = linear_sector(type, *track, *sector) * BLOCKSIZE + *offset;
-        int filetype = image[b + FILETYPEOFFSET];
-        if(filetype != 0 && memcmp(image + b + FILENAMEOFFSET, filename, FILENAMEMAXSIZE) == 0) {
-            return true;
+        if (dir_add_entry(type, image, dt, ds, offset) != 0) {
+            free(blockmap);
+            return -1;
         }
-        ++(*index);
-    } while (next_dir_entry(type, image, track, sector, offset, blockmap));
-
+    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
     free(blockmap);
-    return false;
+    return 0;
 }
 
-/* Returns an empty DIR slot, allocates a new DIR sector if required */
-static void
-new_dir_slot(image_type type, unsigned char* image, int dir_sector_interleave, int shadowdirtrack, int *index, int *dirsector,  int *entry_offset, imagefile files[])
+/* Checks if multiple filenames have the same hash, prints each colliding group for every member.
+   Also returns true if the check could not be done */
+static bool
+check_hashes(const unsigned char* image)
 {
-    int track = dirtrack(type);
-    *dirsector = (type == IMAGE_D81) ? 3 : 1;
-    *entry_offset = 0;
-    int lindex = 0;
+    bool collision = false;
+    printf("\n");
 
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
+    /* chain the entries of each hash in directory order */
+    int *first = (int *)malloc(0x10000 * sizeof(int));
+    int *next = (int *)malloc((job->image_dir.num_entries + 1) * sizeof(int));
+    if ((first == NULL) || (next == NULL)) {
         fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
+        free(next);
+        free(first);
+        return true;
+    }
+    for (int h = 0; h < 0x10000; h++) {
+        first[h] = -1;
+    }
+    for (int i = job->image_dir.num_entries - 1; i >= 0; i--) {
+        const dir_entry *entry = &job->image_dir.entries[i];
+        if (image[entry->offset + FILETYPEOFFSET] != FILETYPEDEL) {
+            next[i] = first[entry->hash];
+            first[entry->hash] = i;
+        }
     }
 
-    do {
-        int b = linear_sector(type, track, *dirsector) * BLOCKSIZE + *entry_offset;
-        if (image[b + FILETYPEOFFSET] == FILETYPEDEL) {
-            /* Check if the apparently free slot is used by a new filetype 0 file */
-            bool used = false;
-            for(int f = 0; f < num_files; f++) {
-                if(files[f].direntryindex == lindex) {
-                    used = true;
-                    break;
-                }
-            }
-            if(!used) {
-                *index = lindex;
-                free(blockmap);
-                return; /* found an empty slot */
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        const dir_entry *entry = &job->image_dir.entries[i];
+        if ((image[entry->offset + FILETYPEOFFSET] != FILETYPEDEL) && (next[first[entry->hash]] >= 0)) {
+            collision = 1;
+            fprintf(stderr, "Hash of filename ");
+            print_filename(stderr, (unsigned char *) image + entry->offset + FILENAMEOFFSET);
+            fprintf(stderr, " [$%04x] is not unique\n", entry->hash);
+            for (int j = first[entry->hash]; j >= 0; j = next[j]) {
+                printf(" [$%04x] ", entry->hash);
+                print_filename(stdout, (unsigned char *) image + job->image_dir.entries[j].offset + FILENAMEOFFSET);
+                printf("\n");
             }
         }
-        ++lindex;
-    } while (next_dir_entry(type, image, &track, dirsector, entry_offset, blockmap));
-    free(blockmap);
+    }
 
-    /* allocate new dir block */
-    int last_sector = *dirsector;
-    int next_sector = -1;
-    for (int s = 1; s < num_sectors(type, dirtrack(type)); s++) {
-        int sector = (last_sector + s * dir_sector_interleave) % num_sectors(type, dirtrack(type));
-        if (is_sector_free(type, image, dirtrack(type), sector, 0, 0)) {
-            next_sector = sector;
-            break;
+    free(next);
+    free(first);
+    return collision;
+}
+
+/* Searches for an existing DIR entry with the given name, returns false if it does not exist */
+static bool
+find_existing_file(const unsigned char* image, const unsigned char* filename, int *index, int *track, int *sector, int *offset)
+{
+    for (int i = job->image_dir.buckets[dir_name_bucket(filename)]; i >= 0; i = job->image_dir.entries[i].next_in_bucket) {
+        dir_entry *entry = &job->image_dir.entries[i];
+        if ((image[entry->offset + FILETYPEOFFSET] != 0) && (memcmp(image + entry->offset + FILENAMEOFFSET, filename, FILENAMEMAXSIZE) == 0)) {
+            *index = i;
+            *track = entry->track;
+            *sector = entry->sector;
+            *offset = entry->offset % BLOCKSIZE;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Returns an empty DIR slot, allocates a new DIR sector if required */
+static int
+new_dir_slot(image_type type, unsigned char* image, int dir_sector_interleave, int shadowdirtrack, int *index, int *dirsector,  int *entry_offset)
+{
+    /* slots handed out before are reserved, as new files may have file type 0 */
+    for (int i = job->image_dir.first_free; i < job->image_dir.num_entries; i++) {
+        dir_entry *entry = &job->image_dir.entries[i];
+        if ((image[entry->offset + FILETYPEOFFSET] == FILETYPEDEL) && !entry->reserved) {
+            entry->reserved = true;
+            job->image_dir.first_free = i + 1;
+            *index = i;
+            *dirsector = entry->sector;
+            *entry_offset = entry->offset % BLOCKSIZE;
+            return 0; /* found an empty slot */
         }
     }
+    job->image_dir.first_free = job->image_dir.num_entries;
+
+    /* allocate new dir block */
+    int last_sector = job->image_dir.entries[job->image_dir.num_entries - 1].sector;
+    int next_sector = next_free_sector(type, dirtrack(type), last_sector + dir_sector_interleave, dir_sector_interleave, num_sectors(type, dirtrack(type)) - 1, 0, 0);
     if (next_sector == -1) {
         fprintf(stderr, "ERROR: Dir track full\n");
-        exit(-1);
+        return -1;
     }
     int b = linear_sector(type, dirtrack(type), last_sector) * BLOCKSIZE;
     image[b + TRACKLINKOFFSET] = dirtrack(type);
     image[b + SECTORLINKOFFSET] = next_sector;
+    mark_dirty(b);
 
-    mark_sector(type, image, dirtrack(type), next_sector, 0 /* not free */);
+    mark_sector(type, dirtrack(type), next_sector, 0 /* not free */);
     b = linear_sector(type, dirtrack(type), next_sector) * BLOCKSIZE;
     memset(image + b, 0, BLOCKSIZE);
     image[b + SECTORLINKOFFSET] = 255;
+    mark_dirty(b);
     *dirsector = next_sector;
     *entry_offset = 0;
 
@@ -1479,36 +1919,47 @@ new_dir_slot(image_type type, unsigned char* image, int dir_sector_interleave, i
         b = linear_sector(type, shadowdirtrack, last_sector) * BLOCKSIZE;
         image[b + TRACKLINKOFFSET] = shadowdirtrack;
         image[b + SECTORLINKOFFSET] = next_sector;
-        mark_sector(type, image, shadowdirtrack, next_sector, 0 /* not free */);
+        mark_dirty(b);
+        mark_sector(type, shadowdirtrack, next_sector, 0 /* not free */);
 
         b = linear_sector(type, shadowdirtrack, next_sector) * BLOCKSIZE;
         memset(image + b, 0, BLOCKSIZE);
         image[b + SECTORLINKOFFSET] = 255;
+        mark_dirty(b);
+    }
+
+    *index = job->image_dir.num_entries;
+    for (int offset = 0; offset < DIRENTRIESPERBLOCK * DIRENTRYSIZE; offset += DIRENTRYSIZE) {
+        if (dir_add_entry(type, image, dirtrack(type), next_sector, offset) != 0) {
+            return -1;
+        }
     }
-    *index = lindex;
+    job->image_dir.entries[*index].reserved = true;
+    job->image_dir.first_free = *index + 1;
+    return 0;
 }
 
-/* Returns suitable index and offset for given filename (either existing slot when overwriting, first free slot or slot in newly allocated segment) */
-static bool
-find_dir_slot(image_type type, unsigned char* image, unsigned char* filename, int dir_sector_interleave, int shadowdirtrack, int *index, int *dirsector,  int *entry_offset, imagefile files[])
+/* Returns suitable index and offset for given filename (either existing slot when overwriting, first free slot or slot in newly allocated segment), returns 1 for an existing file and -1 on error */
+static int
+find_dir_slot(image_type type, unsigned char* image, unsigned char* filename, int dir_sector_interleave, int shadowdirtrack, int *index, int *dirsector,  int *entry_offset)
 {
     int track;
-    if(find_existing_file(type, image, filename, index, &track, dirsector, entry_offset)) {
-        return true;
+    if(find_existing_file(image, filename, index, &track, dirsector, entry_offset)) {
+        job->image_dir.entries[*index].reserved = true;
+        return 1;
     }
-    new_dir_slot(type, image, dir_sector_interleave, shadowdirtrack, index, dirsector, entry_offset, files);
-    return false;
+    return new_dir_slot(type, image, dir_sector_interleave, shadowdirtrack, index, dirsector, entry_offset);
 }
 
 /* Adds the specified new entries to the directory */
-static void
+static int
 create_dir_entries(image_type type, unsigned char* image, imagefile* files, int num_files, int dir_sector_interleave, unsigned int shadowdirtrack, int nooverwrite)
 {
     /* this does not check for uniqueness of filenames */
 
     int num_overwritten_files = 0;
 
-    if (verbose && num_files > 0) {
+    if (job->verbose && num_files > 0) {
         printf("\nCreating dir entries:\n");
     }
 
@@ -1516,55 +1967,63 @@ create_dir_entries(image_type type, unsigned char* image, imagefile* files, int
         /* find or create slot */
         imagefile *file = files + i;
 
-        if (verbose) {
+        if (job->verbose) {
             printf("  ");
             print_dirfilename(file->pfilename);
         }
 
-        if(file->force_new) {
-            new_dir_slot(type, image, dir_sector_interleave, shadowdirtrack, &file->direntryindex, &file->direntrysector, &file->direntryoffset, files);
-        } else if (find_dir_slot(type, image, file->pfilename, dir_sector_interleave, shadowdirtrack, &file->direntryindex, &file->direntrysector, &file->direntryoffset, files)) {
+        int slot = file->force_new
+                   ? new_dir_slot(type, image, dir_sector_interleave, shadowdirtrack, &file->direntryindex, &file->direntrysector, &file->direntryoffset)
+                   : find_dir_slot(type, image, file->pfilename, dir_sector_interleave, shadowdirtrack, &file->direntryindex, &file->direntrysector, &file->direntryoffset);
+        if (slot < 0) {
+            return -1;
+        }
+        if (slot > 0) {
             if (nooverwrite) {
                 fprintf(stderr, "ERROR: Filename exists on disk image already and -o was set\n");
-                exit(-1);
+                return -1;
             }
 
-            wipe_file(type, image, file);
+            if (wipe_file(type, image, file) != 0) {
+                return -1;
+            }
             num_overwritten_files++;
         }
 
         int file_entry_offset = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+        mark_dirty(file_entry_offset);
         image[file_entry_offset + FILETYPEOFFSET] = file->filetype & 0xff;
-        if (verbose && (file->filetype & FILETYPETRANSWARPMASK)) {
+        if (job->verbose && (file->filetype & FILETYPETRANSWARPMASK)) {
             printf(" [Transwarp]");
         }
         memcpy(image + file_entry_offset + FILENAMEOFFSET, file->pfilename, FILENAMEMAXSIZE);
+        dir_sync_entry(image, file->direntryindex);
 
         if (is_transwarp_bootfile(image, file_entry_offset)) {
             if (file->filetype & FILETYPETRANSWARPMASK) {
-                if (verbose) {
+                if (job->verbose) {
                     printf("\n");
                 }
 
                 fprintf(stderr, "ERROR: Attempt to write Transwarp bootfile as Transwarp file\n");
 
-                exit(-1);
+                return -1;
             }
 
             file->mode |= MODE_TRANSWARPBOOTFILE;
-            if (verbose) {
+            if (job->verbose) {
                 printf(" [Transwarp bootfile]");
             }
 
             if (i != 0) {
                 // allocate Transwarp bootfile first
                 if ((files[0].mode & MODE_TRANSWARPBOOTFILE) != 0) {
-                    if (verbose) {
+                    if (job->verbose) {
                         printf("\n");
                     }
 
                     fprintf(stderr, "ERROR: Multiple Transwarp bootfiles\n");
-                    exit(-1);
+                    return -1;
                 }
 
                 imagefile transwarp_bootfile = *file;
@@ -1578,105 +2037,92 @@ create_dir_entries(image_type type, unsigned char* image, imagefile* files, int
 
         if (shadowdirtrack > 0) {
             file_entry_offset = linear_sector(type, shadowdirtrack, file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+            mark_dirty(file_entry_offset);
             image[file_entry_offset + FILETYPEOFFSET] = file->filetype;
             memcpy(image + file_entry_offset + FILENAMEOFFSET, file->pfilename, FILENAMEMAXSIZE);
         }
 
-        if (verbose) {
+        if (job->verbose) {
             printf("\n");
         }
     }
 
-    if (!quiet && (num_overwritten_files > 0)) {
+    if (!job->quiet && (num_overwritten_files > 0)) {
         printf("%d out of %d files exist and will be overwritten\n", num_overwritten_files, num_files);
     }
+    return 0;
 }
 
 /* Prints the allocated tracks and sectors for every file */
 static void
 print_file_allocation(image_type type, const unsigned char* image, imagefile* files, int num_files)
 {
+    imagefile *existing_files = NULL;
     if (num_files <= 0) {
-        imagefile existing_files[144];
-        memset(existing_files, 0, sizeof existing_files);
-
-        int t = dirtrack(type);
-        int s = (type == IMAGE_D81) ? 3 : 1;
-        int o = 0;
-        char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-        if(blockmap == NULL) {
+        existing_files = (imagefile *)calloc(job->image_dir.num_entries, sizeof(imagefile));
+        if(existing_files == NULL) {
             fprintf(stderr, "ERROR: Memory allocation error\n");
-            exit(-1);
+            return;
         }
 
-        do {
-            int b = linear_sector(type, t, s) * BLOCKSIZE + o;
+        for (int i = 0; i < job->image_dir.num_entries; i++) {
+            int b = job->image_dir.entries[i].offset;
             int filetype = image[b + FILETYPEOFFSET] & 0xf;
-            switch (filetype) {
-            case FILETYPEPRG: {
-                int track = image[b + FILETRACKOFFSET];
-                int sector = image[b + FILESECTOROFFSET];
-                int b = linear_sector(type, track, sector);
-                if(b >= 0) {
-                    unsigned char *filename = (unsigned char *) image + b + FILENAMEOFFSET;
-                    memcpy(existing_files[num_files].pfilename, filename, FILENAMEMAXSIZE);
-                    existing_files[num_files].track = track;
-                    existing_files[num_files].sector = sector;
-                    existing_files[num_files].direntryindex = num_files;
-                    existing_files[num_files].direntrysector = s;
-                    existing_files[num_files].direntryoffset = o;
-                    existing_files[num_files].nrSectors = image[b + FILEBLOCKSLOOFFSET] + 256 * image[b + FILEBLOCKSHIOFFSET];
-
-                    if (is_transwarp_file(image, b)) {
-                        existing_files[num_files].filetype = filetype | FILETYPETRANSWARPMASK;
-                        existing_files[num_files].sectorInterleave = 1;
-
-                        int start_track;
-                        int end_track;
-                        int low_track;
-                        int high_track;
-                        int filesize = transwarp_stat(type, image, b, &start_track, &end_track, &low_track, &high_track);
-
-                        existing_files[num_files].size = filesize;
-
-                        existing_files[num_files].track = start_track;
-                        existing_files[num_files].last_track = end_track;
-
-                        ++num_files;
-
-                        break;
-                    }
-
-                    while (true) {
-                        b = linear_sector(type, track, sector);
-                        if(b < 0) {
-                            break; // TODO: print info about illegal t/s
-                        }
-                        int offset = b * BLOCKSIZE;
-                        int next_track = image[offset + 0];
-                        int next_sector = image[offset + 1];
-                        if ((track == 0) || (next_track == 0)) {
-                            break;
-                        }
-                        if ((track == next_track) && (next_sector > sector)) {
-                            existing_files[num_files].sectorInterleave = next_sector - sector;
-                            break;
-                        }
-                        track = next_track;
-                        sector = next_sector;
-                    }
+            if (filetype != FILETYPEPRG) {
+                continue;
+            }
+            int track = image[b + FILETRACKOFFSET];
+            int sector = image[b + FILESECTOROFFSET];
+            if(linear_sector(type, track, sector) < 0) {
+                continue;
+            }
+            imagefile *file = existing_files + num_files;
+            memcpy(file->pfilename, image + b + FILENAMEOFFSET, FILENAMEMAXSIZE);
+            file->track = track;
+            file->sector = sector;
+            file->direntryindex = num_files;
+            file->direntrysector = job->image_dir.entries[i].sector;
+            file->direntryoffset = b % BLOCKSIZE;
+            file->nrSectors = image[b + FILEBLOCKSLOOFFSET] + 256 * image[b + FILEBLOCKSHIOFFSET];
+            ++num_files;
 
-                    ++num_files;
+            if (is_transwarp_file(image, b)) {
+                file->filetype = filetype | FILETYPETRANSWARPMASK;
+                file->sectorInterleave = 1;
 
-                    break;
+                int start_track;
+                int end_track;
+                int low_track;
+                int high_track;
+                bool cylinders;
+                file->size = transwarp_stat(type, image, b, &start_track, &end_track, &low_track, &high_track, &cylinders);
+                file->track = start_track;
+                file->last_track = end_track;
+                if (cylinders) {
+                    file->mode |= MODE_SAVECLUSTEROPTIMIZED;
                 }
+                continue;
             }
 
-            default:
-                break;
+            while (true) {
+                int block = linear_sector(type, track, sector);
+                if(block < 0) {
+                    break; // TODO: print info about illegal t/s
+                }
+                int offset = block * BLOCKSIZE;
+                int next_track = image[offset + 0];
+                int next_sector = image[offset + 1];
+                if ((track == 0) || (next_track == 0)) {
+                    break;
+                }
+                if ((track == next_track) && (next_sector > sector)) {
+                    file->sectorInterleave = next_sector - sector;
+                    break;
+                }
+                track = next_track;
+                sector = next_sector;
             }
-        } while (next_dir_entry(type, image, &t, &s, &o, blockmap));
-        free(blockmap);
+        }
         files = existing_files;
     }
 
@@ -1703,7 +2149,8 @@ print_file_allocation(image_type type, const unsigned char* image, imagefile* fi
             int nonredundant_blocks;
             int redundant_blocks;
             int nonredundant_blocks_on_last_track;
-            int spare_bytes = transwarp_size(type, files[i].track, files[i].last_track, files[i].size, &transwarp_blocks, &nonredundant_blocks, &redundant_blocks, &nonredundant_blocks_on_last_track);
+            bool cylinders = (type == IMAGE_D71) && (files[i].mode & MODE_SAVECLUSTEROPTIMIZED);
+            int spare_bytes = transwarp_size(type, files[i].track, files[i].last_track, cylinders, files[i].size, &transwarp_blocks, &nonredundant_blocks, &redundant_blocks, &nonredundant_blocks_on_last_track);
 
             int num_blocks = 0;
             int filesize = files[i].size + 2;
@@ -1794,6 +2241,7 @@ print_file_allocation(image_type type, const unsigned char* image, imagefile* fi
         printf("\n");
     }
     printf("\n");
+    free(existing_files);
 }
 
 
@@ -1802,16 +2250,8 @@ assign_blocktags(image_type type, const unsigned char *image, int(*blocktags)[SE
 {
     char c = '@';
 
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        int dirblock = job->image_dir.entries[i].offset;
         int filetype = image[dirblock + FILETYPEOFFSET] & 0xf;
         if (filetype != 0) {
             int filetrack = image[dirblock + FILETRACKOFFSET];
@@ -1822,7 +2262,8 @@ assign_blocktags(image_type type, const unsigned char *image, int(*blocktags)[SE
                 int end_track;
                 int low_track;
                 int high_track;
-                int filesize = transwarp_stat(type, image, dirblock, &start_track, &end_track, &low_track, &high_track);
+                bool cylinders;
+                int filesize = transwarp_stat(type, image, dirblock, &start_track, &end_track, &low_track, &high_track, &cylinders);
                 if (filesize <= 0) {
                     continue;
                 }
@@ -1831,12 +2272,15 @@ assign_blocktags(image_type type, const unsigned char *image, int(*blocktags)[SE
                 int nonredundant_blocks;
                 int redundant_blocks;
                 int nonredundant_blocks_on_last_track;
-                transwarp_size(type, start_track, end_track, filesize, &transwarp_blocks, &nonredundant_blocks, &redundant_blocks, &nonredundant_blocks_on_last_track);
+                transwarp_size(type, start_track, end_track, cylinders, filesize, &transwarp_blocks, &nonredundant_blocks, &redundant_blocks, &nonredundant_blocks_on_last_track);
 
-                for (int track = low_track; track <= high_track; ++track) {
+                for (int track = start_track; track > 0; track = transwarp_next_track(type, track, cylinders)) {
                     for (int sector = 0; sector < SECTORSPERTRACK_D81; ++sector) {
                         blocktags[track][sector] = c + (((track == end_track) && (sector >= nonredundant_blocks_on_last_track)) ? 256 : 0);
                     }
+                    if (track == end_track) {
+                        break;
+                    }
                 }
             } else {
                 bool new_track = true;
@@ -1872,9 +2316,7 @@ assign_blocktags(image_type type, const unsigned char *image, int(*blocktags)[SE
                 break;
             }
         }
-
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
+    }
 }
 
 /* Returns true if the file starting on the given filetrack and filesector uses the given track */
@@ -1904,17 +2346,8 @@ fileontrack(image_type type, const unsigned char *image, int track, int filetrac
 static void
 print_track_usage(image_type type, const unsigned char *image, int(*blocktags)[SECTORSPERTRACK_D81], int track)
 {
-
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        int dirblock = job->image_dir.entries[i].offset;
         int filetype = image[dirblock + FILETYPEOFFSET] & 0xf;
         if (filetype != 0) {
             int filetrack = image[dirblock + FILETRACKOFFSET];
@@ -1926,12 +2359,21 @@ print_track_usage(image_type type, const unsigned char *image, int(*blocktags)[S
                 int end_track;
                 int low_track;
                 int high_track;
-                int filesize = transwarp_stat(type, image, dirblock, &start_track, &end_track, &low_track, &high_track);
+                bool cylinders;
+                int filesize = transwarp_stat(type, image, dirblock, &start_track, &end_track, &low_track, &high_track, &cylinders);
                 if (filesize <= 0) {
                     continue;
                 }
 
-                ontrack = (low_track <= track) && (track <= high_track);
+                ontrack = false;
+                for (int t = start_track; t > 0; t = transwarp_next_track(type, t, cylinders)) {
+                    if ((t == track) || ((type == IMAGE_D71) && (t == track + D64NUMTRACKS))) {
+                        ontrack = true;
+                    }
+                    if (t == end_track) {
+                        break;
+                    }
+                }
                 if (ontrack == false) {
                     continue;
                 }
@@ -1953,8 +2395,7 @@ print_track_usage(image_type type, const unsigned char *image, int(*blocktags)[S
                 printf(" ");
             }
         }
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
+    }
 }
 
 /* Prints the BAM allocation map and returns the number of free blocks */
@@ -1966,26 +2407,24 @@ check_bam(image_type type, const unsigned char* image)
     int sectorsOccupied = 0;
     int sectorsOccupiedOnDirTrack = 0;
 
-    int blocktags[D81NUMTRACKS][SECTORSPERTRACK_D81];
+    int blocktags[D81NUMTRACKS + 1][SECTORSPERTRACK_D81];
 
-    if (verbose) {
+    if (job->verbose) {
         memset(blocktags, 0, sizeof blocktags);
         assign_blocktags(type, image, blocktags);
 
         printf("Block allocation:\n");
     }
 
-    int max_track = (type == IMAGE_D81) ? D81NUMTRACKS
-                    : (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) ? D64NUMTRACKS_EXTENDED
-                       : D64NUMTRACKS);
+    int max_track = (type == IMAGE_D71) ? D64NUMTRACKS : image_num_tracks(type); /* both sides of a D71 are printed side by side */
     for (int t = 1; t <= max_track; t++) {
 
-        if (verbose) {
+        if (job->verbose) {
             printf("  %2d: ", t);
         }
         for (int s = 0; s < num_sectors(type, t); s++) {
-            if (is_sector_free(type, image, t, s, 0, 0)) {
-                if (verbose) {
+            if (is_sector_free(type, t, s, 0, 0)) {
+                if (job->verbose) {
                     printf(".");
                 }
                 if (t != dirtrack(type)) {
@@ -1994,7 +2433,7 @@ check_bam(image_type type, const unsigned char* image)
                     sectorsFreeOnDirTrack++;
                 }
             } else {
-                if (verbose) {
+                if (job->verbose) {
                     int blocktag = blocktags[t][s];
                     if (blocktag == 0) {
                         blocktag = '#';
@@ -2017,18 +2456,18 @@ check_bam(image_type type, const unsigned char* image)
 
         if (type == IMAGE_D71) {
             for (int i = num_sectors(type, t); i < 23; i++) {
-                if (verbose) {
+                if (job->verbose) {
                     printf(" ");
                 }
             }
             int t2 = t + D64NUMTRACKS;
 
-            if (verbose) {
+            if (job->verbose) {
                 printf("%2d: ", t2);
             }
             for (int s = 0; s < num_sectors(type, t2); s++) {
-                if (is_sector_free(type, image, t2, s, 0, 0)) {
-                    if (verbose) {
+                if (is_sector_free(type, t2, s, 0, 0)) {
+                    if (job->verbose) {
                         printf(".");
                     }
                     if (t2 != dirtrack(type)) {
@@ -2038,7 +2477,7 @@ check_bam(image_type type, const unsigned char* image)
                         sectorsFreeOnDirTrack++;
                     }
                 } else {
-                    if (verbose) {
+                    if (job->verbose) {
                         printf("#");
                     }
                     sectorsOccupied++;
@@ -2047,16 +2486,16 @@ check_bam(image_type type, const unsigned char* image)
         }
 
         for (int i = ((type == IMAGE_D81) ? 42 : 23) - num_sectors(type, t); i > 0; --i) {
-            if (verbose) {
+            if (job->verbose) {
                 printf(" ");
             }
         }
-        if (verbose) {
+        if (job->verbose) {
             print_track_usage(type, image, blocktags, t);
             printf("\n");
         }
     }
-    if (verbose) {
+    if (job->verbose) {
         printf("%3d/%3d blocks free (%d/%d including dir track)\n", sectorsFree, sectorsFree + sectorsOccupied,
                sectorsFree + sectorsFreeOnDirTrack, sectorsFree + sectorsFreeOnDirTrack + sectorsOccupied + sectorsOccupiedOnDirTrack);
     }
@@ -2073,7 +2512,7 @@ print_filetype(int filetype)
     } else {
         printf(" ");
     }
-    if(unicode == 1) {
+    if(job->unicode == 1) {
         printf("%s", filetypename_uc[filetype & 0xf]);
     } else {
         printf("%s", filetypename_lc[filetype & 0xf]);
@@ -2090,11 +2529,6 @@ static void
 print_directory(image_type type, unsigned char* image, int blocks_free)
 {
     unsigned char* bam = image + linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
 
     printf("\n0 ");
     reverse_print_on();
@@ -2104,16 +2538,13 @@ print_directory(image_type type, unsigned char* image, int blocks_free)
     print_petscii(bam + get_id_offset(type), 5);
     reverse_print_off();
 
-    if (verbose) {
+    if (job->verbose) {
         printf("   fn hash");
     }
     printf("\n");
 
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        int dirblock = job->image_dir.entries[i].offset;
         int filetype = image[dirblock + FILETYPEOFFSET];
         int blocks = image[dirblock + FILEBLOCKSLOOFFSET] + 256 * image[dirblock + FILEBLOCKSHIOFFSET];
 
@@ -2122,14 +2553,13 @@ print_directory(image_type type, unsigned char* image, int blocks_free)
             printf("%-3d  ", blocks);
             print_dirfilename(filename);
             print_filetype(filetype);
-            if (verbose) {
-                printf(" [$%04x]", filenamehash(filename));
+            if (job->verbose) {
+                printf(" [$%04x]", job->image_dir.entries[i].hash);
             }
             printf("\n");
         }
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
-    if(unicode == 1) {
+    }
+    if(job->unicode == 1) {
         printf("%d BLOCKS FREE.\n", blocks_free);
     } else {
         printf("%d blocks free.\n", blocks_free);
@@ -2149,7 +2579,7 @@ print_directory(image_type type, unsigned char* image, int blocks_free)
     }
 }
 
-/* Performs GCR encoding on 32 bit value */
+/* GCR codec, every byte maps to a 10 bit code, 4 bytes to 5 GCR bytes */
 
 static const unsigned char NIBBLE_TO_GCR[] = {
     0x0a, 0x0b, 0x12, 0x13,
@@ -2158,30 +2588,97 @@ static const unsigned char NIBBLE_TO_GCR[] = {
     0x0d, 0x1d, 0x1e, 0x15
 };
 
-static void
-encode_4_bytes_gcr(char* in, char* out)
-{
-    out[0] = (NIBBLE_TO_GCR[(in[0] >> 4) & 0xf] << 3) | (NIBBLE_TO_GCR[ in[0]       & 0xf] >> 2); /* 11111222 */
-    out[1] = (NIBBLE_TO_GCR[ in[0]       & 0xf] << 6) | (NIBBLE_TO_GCR[(in[1] >> 4) & 0xf] << 1) | (NIBBLE_TO_GCR[ in[1]       & 0xf] >> 4); /* 22333334 */
-    out[2] = (NIBBLE_TO_GCR[ in[1]       & 0xf] << 4) | (NIBBLE_TO_GCR[(in[2] >> 4) & 0xf] >> 1); /* 44445555 */
-    out[3] = (NIBBLE_TO_GCR[(in[2] >> 4) & 0xf] << 7) | (NIBBLE_TO_GCR[ in[2]       & 0xf] << 2) | (NIBBLE_TO_GCR[(in[3] >> 4) & 0xf] >> 3); /* 56666677 */
-    out[4] = (NIBBLE_TO_GCR[(in[3] >> 4) & 0xf] << 5) |  NIBBLE_TO_GCR[ in[3]       & 0xf]; /* 77788888 */
-}
-
-/* Transwarp encoding utility functions */
+static uint16_t BYTE_TO_GCR[256];
+static int16_t GCR_TO_BYTE[1024]; /* negative for invalid codes */
 
 static void
-generate_gcr_decoding_table(const unsigned char nibble_to_gcr[], int8_t gcr_to_nibble[])
+generate_gcr_tables(void)
 {
+    static bool generated = false;
+    if (generated) {
+        return;
+    }
+
+    int gcr_to_nibble[32];
     for (int i = 0; i < 32; ++i) {
         gcr_to_nibble[i] = -(i + 1);
     }
-
     for (int i = 0; i < 16; ++i) {
-        gcr_to_nibble[nibble_to_gcr[i]] = i;
+        gcr_to_nibble[NIBBLE_TO_GCR[i]] = i;
+    }
+
+    for (int i = 0; i < 256; ++i) {
+        BYTE_TO_GCR[i] = (NIBBLE_TO_GCR[i >> 4] << 5) | NIBBLE_TO_GCR[i & 0xf];
+    }
+    for (int i = 0; i < 1024; ++i) {
+        GCR_TO_BYTE[i] = (gcr_to_nibble[i >> 5] * 16) | gcr_to_nibble[i & 0x1f];
+    }
+
+    generated = true;
+}
+
+/* Encodes len bytes, a multiple of 4, into len * 5 / 4 GCR bytes */
+static void
+encode_gcr(const unsigned char *in, int len, unsigned char *out)
+{
+    for (int i = 0; i < len; i += 4, out += 5) {
+        uint64_t bits = ((uint64_t)BYTE_TO_GCR[in[i]] << 30)
+                        | ((uint64_t)BYTE_TO_GCR[in[i + 1]] << 20)
+                        | ((uint64_t)BYTE_TO_GCR[in[i + 2]] << 10)
+                        | BYTE_TO_GCR[in[i + 3]];
+        out[0] = (unsigned char)(bits >> 32);
+        out[1] = (unsigned char)(bits >> 24);
+        out[2] = (unsigned char)(bits >> 16);
+        out[3] = (unsigned char)(bits >> 8);
+        out[4] = (unsigned char)bits;
     }
 }
 
+/* Decodes len GCR bytes, a multiple of 5, into len * 4 / 5 bytes, returns false if there were invalid codes */
+static bool
+decode_gcr(const unsigned char *in, int len, unsigned char *out)
+{
+    int invalid = 0;
+    for (int i = 0; i < len; i += 5, out += 4) {
+        uint64_t bits = ((uint64_t)in[i] << 32)
+                        | ((uint64_t)in[i + 1] << 24)
+                        | ((uint64_t)in[i + 2] << 16)
+                        | ((uint64_t)in[i + 3] << 8)
+                        | in[i + 4];
+        int out0 = GCR_TO_BYTE[(bits >> 30) & 0x3ff];
+        int out1 = GCR_TO_BYTE[(bits >> 20) & 0x3ff];
+        int out2 = GCR_TO_BYTE[(bits >> 10) & 0x3ff];
+        int out3 = GCR_TO_BYTE[bits & 0x3ff];
+        out[0] = out0;
+        out[1] = out1;
+        out[2] = out2;
+        out[3] = out3;
+        invalid |= out0 | out1 | out2 | out3;
+    }
+
+    return invalid >= 0;
+}
+
+/* Encodes a sector as its GCR data block: block ID, data, checksum and two padding bytes */
+static void
+encode_gcr_data_block(const unsigned char *data, unsigned char encoded[325])
+{
+    unsigned char block[260];
+    block[0] = 0x07;
+    memcpy(block + 1, data, BLOCKSIZE);
+    unsigned char checksum = 0;
+    for (int i = 0; i < BLOCKSIZE; ++i) {
+        checksum ^= data[i];
+    }
+    block[257] = checksum;
+    block[258] = 0;
+    block[259] = 0;
+
+    encode_gcr(block, sizeof block, encoded);
+}
+
+/* Transwarp encoding utility functions */
+
 static unsigned char
 even_bits(unsigned char value)
 {
@@ -2201,7 +2698,7 @@ odd_bits(unsigned char value)
 }
 
 typedef struct transwarp_encode_context {
-    unsigned int  version;
+    unsigned char receive_offset; /* depends on the Transwarp version, see encode_receive_diff() */
     unsigned char previous;
     unsigned char previous1;
     unsigned char previous2;
@@ -2213,6 +2710,20 @@ typedef struct transwarp_encode_context {
     unsigned char sendcarry;
 } transwarp_encode_context;
 
+/* A Transwarp file with allocated tracks, waiting to be encoded */
+typedef struct {
+    imagefile* file;
+    unsigned char* filedata; /* owned by the plan */
+    int filesize;
+    unsigned int first_track;
+    bool cylinders;
+    unsigned char scramble[4][256];
+    int sectors[21];
+    int initial_block_recvaccu_value;
+    int initial_buffer_recvaccu_value;
+    transwarp_encode_context ctx;
+} transwarp_plan;
+
 static const int ENCODE[5][64] = {
     {
         0xf6, 0xee, 0xf5, 0xed, 0x9a, 0xde, 0x96, 0xda, 0xf3, 0xea, 0xf2, 0x9e, 0x93, 0xd6, 0x92, 0xd3,
@@ -2258,18 +2769,41 @@ static const int DECODE[256] = {
         -1,   -1, 0x78, 0x7a,   -1, 0x7c, 0x7e,   -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1,   -1
     };
 
-static unsigned char
-encode_read_diff(const int encode[64], unsigned char *accu, unsigned char *carry, unsigned char value)
-{
-    unsigned char value_to_encode;
+/* First index into ENCODE[table] whose decoded value plus a sum has the given bits 1-6, 0xff if there is none.
+   Indexed by table, sum of accu and carry modulo 256 and bits 1-6 of the target */
+static unsigned char ENCODE_INVERSE[5][256][64];
 
-    unsigned char target = DECODE[encode[value]] & 0x7e;
-    for (value_to_encode = 0; value_to_encode < 64; ++value_to_encode) {
-        unsigned char val = DECODE[encode[value_to_encode]] + *accu + *carry;
-        if ((val & 0x7e) == target) {
-            break;
+/* Generates the inverse encoding tables, so that encode_read_diff() does not need to search all encodings */
+static void
+generate_encode_inverse_tables()
+{
+    static bool generated = false;
+    if (generated) {
+        return;
+    }
+    memset(ENCODE_INVERSE, 0xff, sizeof ENCODE_INVERSE);
+    for (int table = 0; table < 5; table++) {
+        if (table == 2) {
+            continue; /* only used for the buffer bytes, see encode_buffer_byte() */
+        }
+        for (int sum = 0; sum < 256; sum++) {
+            /* descending, so that the first matching encoding wins */
+            for (int value = 63; value >= 0; value--) {
+                unsigned char val = DECODE[ENCODE[table][value]] + sum;
+                ENCODE_INVERSE[table][sum][(val & 0x7e) >> 1] = value;
+            }
         }
     }
+    generated = true;
+}
+
+static int
+encode_read_diff(int table, unsigned char *accu, unsigned char *carry, unsigned char value)
+{
+    const int *encode = ENCODE[table];
+
+    unsigned char target = DECODE[encode[value]] & 0x7e;
+    unsigned char value_to_encode = ENCODE_INVERSE[table][(unsigned char)(*accu + *carry)][target >> 1];
     if (value_to_encode >= 64) {
         printf("Encoding error, 0x%x = 0x%x + %d + ?\n", target, *accu, *carry);
         for (value_to_encode = 0; value_to_encode < 64; ++value_to_encode) {
@@ -2278,7 +2812,7 @@ encode_read_diff(const int encode[64], unsigned char *accu, unsigned char *carry
         }
 
         fprintf(stderr, "ERROR: Transwarp encoding error\n");
-        exit(-2);
+        return -2;
     }
 
     int sum = DECODE[encode[value_to_encode]] + *accu + *carry;
@@ -2288,7 +2822,7 @@ encode_read_diff(const int encode[64], unsigned char *accu, unsigned char *carry
     unsigned char check = DECODE[encode[value]];
     if ((*accu & 0x7e) != (check & 0x7e)) {
         fprintf(stderr, "ERROR: Transwarp encoding error, 0x%x: actual 0x%x != 0x%x expected\n", DECODE[encode[check & 0x3f]], *accu, check);
-        exit(-3);
+        return -3;
     }
 
     unsigned char temp = (*carry << 7) | (*accu >> 1);
@@ -2326,9 +2860,7 @@ encode_send_diff(unsigned char value, unsigned char *accu, unsigned char *carry)
 static unsigned char
 encode_receive_diff(const transwarp_encode_context *ctx, unsigned char in, unsigned char *previous, unsigned char *carry)
 {
-    int offset = (ctx->version <= 84) ? 0 : 2;
-
-    int out = in - *carry - offset;
+    int out = in - *carry - ctx->receive_offset;
     int diff = out - ((*previous & 0xc0) | (out & 0x3f));
     *carry = (diff < 0);
     out = ((out ^ *previous) & 0x3f) | diff;
@@ -2337,6 +2869,18 @@ encode_receive_diff(const transwarp_encode_context *ctx, unsigned char in, unsig
     return out;
 }
 
+/* Reverses encode_receive_diff(), returns the original byte */
+static unsigned char
+decode_receive_diff(const transwarp_encode_context *ctx, unsigned char out, unsigned char *previous, unsigned char *carry)
+{
+    int high = ((out & 0xc0) + (*previous & 0xc0)) & 0xc0;
+    int in = (high | ((out ^ *previous) & 0x3f)) + *carry + ctx->receive_offset;
+    *carry = (in >= 0x100) || (high < (*previous & 0xc0));
+    *previous = in;
+
+    return in;
+}
+
 static unsigned char
 encode_buffer_byte(const int encode[][64], unsigned char previous, unsigned char *carry, unsigned char in, unsigned char *out)
 {
@@ -2351,10 +2895,13 @@ encode_buffer_byte(const int encode[][64], unsigned char previous, unsigned char
     return in;
 }
 
-static void
+/* Returns 0 or the error of encode_read_diff() */
+static int
 encode_base_bytes(const unsigned char scramble[][256],
                   transwarp_encode_context *ctx, const unsigned char in[3], unsigned char *out)
 {
+    int encoded;
+
     unsigned char in0 = encode_receive_diff(ctx, in[0], &(ctx->previous), &(ctx->recvcarry));
     unsigned char in1 = encode_receive_diff(ctx, in[1], &(ctx->previous), &(ctx->recvcarry));
     unsigned char in2 = encode_receive_diff(ctx, in[2], &(ctx->previous), &(ctx->recvcarry));
@@ -2364,18 +2911,32 @@ encode_base_bytes(const unsigned char scramble[][256],
     in2 = scramble[2][in2];
 
     unsigned char val3 = in0 & 0x3f;
-    out[0] = encode_read_diff(ENCODE[3], &(ctx->accu), &(ctx->carry), val3);
+    if ((encoded = encode_read_diff(3, &(ctx->accu), &(ctx->carry), val3)) < 0) {
+        return encoded;
+    }
+    out[0] = encoded;
 
     unsigned char val4 = ((in0 >> 6)
                           | (in1 << 2)) & 0x3f;
-    out[1] = encode_read_diff(ENCODE[4], &(ctx->accu), &(ctx->carry), val4);
+    if ((encoded = encode_read_diff(4, &(ctx->accu), &(ctx->carry), val4)) < 0) {
+        return encoded;
+    }
+    out[1] = encoded;
 
     unsigned char val0 = ((in1 >> 4)
                           | (in2 << 4)) & 0x3f;
-    out[2] = encode_read_diff(ENCODE[0], &(ctx->accu), &(ctx->carry), val0);
+    if ((encoded = encode_read_diff(0, &(ctx->accu), &(ctx->carry), val0)) < 0) {
+        return encoded;
+    }
+    out[2] = encoded;
 
     unsigned char val1 = in2 >> 2;
-    out[3] = encode_read_diff(ENCODE[1], &(ctx->accu), &(ctx->carry), val1);
+    if ((encoded = encode_read_diff(1, &(ctx->accu), &(ctx->carry), val1)) < 0) {
+        return encoded;
+    }
+    out[3] = encoded;
+
+    return 0;
 }
 
 static unsigned char
@@ -2388,65 +2949,25 @@ crc8(unsigned char value)
     return value;
 }
 
-static bool
-decode_5_bytes_gcr(const int8_t decoding_map[], const unsigned char *in, unsigned char *out)
-{
-    unsigned char gcr_hi;
-    unsigned char gcr_lo;
-
-    gcr_hi = in[0] >> 3;
-    gcr_lo = ((in[0] & 0x7) << 2) | (in[1] >> 6);
-    int out0 = (decoding_map[gcr_hi] << 4) | decoding_map[gcr_lo];
-
-    gcr_hi = (in[1] & 0x3e) >> 1;
-    gcr_lo = ((in[1] & 0x1) << 4) | (in[2] >> 4);
-    int out1 = (decoding_map[gcr_hi] << 4) | decoding_map[gcr_lo];
-
-    gcr_hi = ((in[2] & 0xf) << 1) | (in[3] >> 7);
-    gcr_lo = (in[3] & 0x7c) >> 2;
-    int out2 = (decoding_map[gcr_hi] << 4) | decoding_map[gcr_lo];
-
-    gcr_hi = ((in[3] & 0x3) << 3) | (in[4] >> 5);
-    gcr_lo = in[4] & 0x1f;
-    int out3 = (decoding_map[gcr_hi] << 4) | decoding_map[gcr_lo];
-
-    out[0] = out0;
-    out[1] = out1;
-    out[2] = out2;
-    out[3] = out3;
-
-    return (out0 | out1 | out2 | out3) >= 0;
-}
-
+/* Decodes a GCR data block, returns the checksum of the decoded sector or -1 if there were invalid codes */
 static int
-decode_gcr_block(const int8_t decoding_map[], const unsigned char *encoded, unsigned char decoded[])
+decode_gcr_block(const unsigned char *encoded, unsigned char decoded[])
 {
-    bool ok = decode_5_bytes_gcr(decoding_map, encoded, decoded);
-    decoded[0] = decoded[1];
-    decoded[1] = decoded[2];
-    decoded[2] = decoded[3];
+    unsigned char block[260];
+    bool ok = decode_gcr(encoded, 325, block);
+    memcpy(decoded, block + 1, BLOCKSIZE);
 
-    int computed_checksum = decoded[0] ^ decoded[1] ^ decoded[2];
-
-    int i = 5;
-    for (int j = 3; i < 320; i += 5, j += 4) {
-        ok &= decode_5_bytes_gcr(decoding_map, encoded + i, decoded + j);
-        computed_checksum ^= decoded[j] ^ decoded[j + 1] ^ decoded[j + 2] ^ decoded[j + 3];
+    int computed_checksum = 0;
+    for (int i = 0; i < BLOCKSIZE; ++i) {
+        computed_checksum ^= decoded[i];
     }
 
-    unsigned char last_byte[4];
-    ok &= decode_5_bytes_gcr(decoding_map, encoded + i, last_byte);
-    decoded[255] = last_byte[0];
-
-    computed_checksum ^= last_byte[0];
-    computed_checksum = ok ? computed_checksum : -1;
-
     return ok ? computed_checksum : -1;
 }
 
+/* Returns 0, a negative exit code if the encoding failed or 1 if the result cannot be decoded */
 static int
-encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_nibble[32],
-                       transwarp_encode_context* ctx, const unsigned char *indata, int filepos, unsigned char encoded[325])
+encode_transwarp_block(const unsigned char scramble[][256], transwarp_encode_context* ctx, const unsigned char *indata, int filepos, unsigned char encoded[325])
 {
     const unsigned char *unencoded = indata + filepos;
 
@@ -2495,10 +3016,10 @@ encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_
         previous = crc8(previous);
     }
 
-    char head_data[4] = { 7, 0, 0, 0 };
-    encode_4_bytes_gcr(head_data, (char *) encoded);
-    char tail_data[4] = { 0, 0, 0, 0 };
-    encode_4_bytes_gcr(tail_data, (char *) encoded + 320);
+    const unsigned char head_data[4] = { 7, 0, 0, 0 };
+    encode_gcr(head_data, sizeof head_data, encoded);
+    const unsigned char tail_data[4] = { 0, 0, 0, 0 };
+    encode_gcr(tail_data, sizeof tail_data, encoded + 320);
 
     unsigned char accu = ctx->previous;
     unsigned char carry = 0;
@@ -2535,7 +3056,10 @@ encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_
     ctx->accu = 0;
     ctx->carry = 0;
     for (int i = 0, j = 0; i < TRANSWARPBASEBLOCKSIZE; i += 3, j += 5) {
-        encode_base_bytes(scramble, ctx, unencoded + i, encoded + 3 + j);
+        int error = encode_base_bytes(scramble, ctx, unencoded + i, encoded + 3 + j);
+        if (error != 0) {
+            return error;
+        }
 
         ctx->accu = 8;
         ctx->carry = 0;
@@ -2547,7 +3071,7 @@ encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_
         if (target != target_check) {
             fprintf(stderr, "ERROR: Transwarp encoding error, [%d] 0x%x != 0x%x <- 0x%x\n", i, target, target_check, DECODE[target]);
 
-            exit(-4);
+            return -4;
         }
 
         unsigned char store = ctx->accu ^ target_accu;
@@ -2559,13 +3083,13 @@ encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_
         if (ctx->accu != target_accu) {
             fprintf(stderr, "ERROR: Transwarp encoding error, [%d] actual 0x%x != 0x%x expected <- 0x%x\n", i, ctx->accu, target_accu, stored);
 
-            exit(-5);
+            return -5;
         }
     }
     if (carry != ctx->recvcarry) {
         fprintf(stderr, "ERROR: Transwarp encoding error, carry %d != %d recvcarry\n", carry, ctx->recvcarry);
 
-        exit(-6);
+        return -6;
     }
 
     unsigned char top_fix = encoded[2] ^ (DECODE[encoded[322]] & 0xf);
@@ -2582,24 +3106,106 @@ encode_transwarp_block(const unsigned char scramble[][256], const int8_t gcr_to_
     if (block_checksum != checksum) {
         fprintf(stderr, "ERROR: Transwarp encoding error, actual 0x%x != 0x%x expected, 0x%x -> [0x%x] -> 0x%x -> 0x%x -> [0x%x]\n", block_checksum, checksum, checksum & 0xaa, ((checksum & 0xaa) >> 1) | (checksum & 0xaa), odd, ENCODE[2][odd], DECODE[encoded[317]]);
 
-        exit(-1);
+        return -1;
     }
 
     unsigned char gcr_decoded[4];
-    bool ok = decode_5_bytes_gcr(gcr_to_nibble, encoded + 320, gcr_decoded);
+    bool ok = decode_gcr(encoded + 320, 5, gcr_decoded);
     int gcr_checksum = ok ? gcr_decoded[1] : -1;
 
     unsigned char decoded[256];
-    int computed_checksum = decode_gcr_block(gcr_to_nibble, encoded, decoded);
+    int computed_checksum = decode_gcr_block(encoded, decoded);
 
-    ok &= decode_5_bytes_gcr(gcr_to_nibble, encoded, gcr_decoded);
+    ok &= decode_gcr(encoded, 5, gcr_decoded);
     gcr_decoded[1] ^= gcr_checksum ^ computed_checksum;
 
-    encode_4_bytes_gcr((char *) gcr_decoded, (char *) encoded);
+    encode_gcr(gcr_decoded, sizeof gcr_decoded, encoded);
 
     return ok == 0;
 }
 
+/* Reverses encode_transwarp_block() by following what the loader reads, the checksums are checked per file */
+static bool
+decode_transwarp_block(const unsigned char unscramble[][256], transwarp_encode_context* ctx, const unsigned char encoded[325], unsigned char decoded[TRANSWARPBLOCKSIZE])
+{
+    /* the value the loader reads from the last GCR byte of each 5 byte group, the last group holds checksum bits */
+    int target_accu[(TRANSWARPBASEBLOCKSIZE / 3) - 1];
+    for (int j = 0; j < (TRANSWARPBASEBLOCKSIZE / 3) - 1; ++j) {
+        int stored = DECODE[encoded[3 + (5 * j) + 4]];
+        if (stored < 0) {
+            return false;
+        }
+        target_accu[j] = 8 ^ stored;
+    }
+
+    /* buffer bytes, spread over the odd bits of two of those values each */
+    unsigned char semiencoded[TRANSWARPBUFFERBLOCKSIZE];
+    unsigned char buffer_previous = ctx->previous1;
+    unsigned char buffer_carry = 0;
+    for (int i = 0; i < TRANSWARPBUFFERBLOCKSIZE; ++i) {
+        int shuffle = (TRANSWARPBUFFERBLOCKSIZE - 1) - (i / 2) - ((i & 1) ? ((TRANSWARPBUFFERBLOCKSIZE / 2) + 1) : 0);
+        int group = TRANSWARPBUFFERBLOCKSIZE - 1 - shuffle;
+        unsigned char even = (target_accu[group + 31] & 0xaa) >> 1;
+        unsigned char odd = target_accu[group] & 0xaa;
+        unsigned char value = ((even ^ (buffer_previous >> 1)) & 0x55)
+                              | ((odd ^ ((buffer_carry << 7) | (buffer_previous >> 1))) & 0xaa);
+        buffer_carry = buffer_previous & 1;
+        buffer_previous = value;
+        semiencoded[shuffle] = value;
+    }
+
+    for (int i = TRANSWARPBUFFERBLOCKSIZE - 1; i >= 0; --i) {
+        unsigned char value = (semiencoded[i] + ctx->sendaccu + ctx->sendcarry) ^ 0xff;
+        value = (value & ~((1 << 3) | (1 << 0)))
+                | (((value >> 3) & 1) << 0)
+                | (((value >> 0) & 1) << 3);
+        encode_send_diff(value, &(ctx->sendaccu), &(ctx->sendcarry));
+
+        decoded[TRANSWARPBASEBLOCKSIZE + i] = decode_receive_diff(ctx, unscramble[3][value], &(ctx->previous2), &(ctx->carry2));
+    }
+
+    /* base bytes, 3 in the first 4 GCR bytes of each group */
+    static const int TABLES[4] = { 3, 4, 0, 1 };
+    unsigned char accu = 0;
+    unsigned char carry = 0;
+    ctx->recvcarry = 0;
+    for (int i = 0, j = 0; i < TRANSWARPBASEBLOCKSIZE; i += 3, ++j) {
+        unsigned char val[4];
+        for (int k = 0; k < 4; ++k) {
+            int code = DECODE[encoded[3 + (5 * j) + k]];
+            if (code < 0) {
+                return false;
+            }
+            int sum = code + accu + carry;
+            accu = sum;
+            carry = sum >= 256;
+            val[k] = ENCODE_INVERSE[TABLES[k]][0][(accu & 0x7e) >> 1];
+            if (val[k] >= 64) {
+                return false;
+            }
+
+            unsigned char temp = (carry << 7) | (accu >> 1);
+            carry = accu & 1;
+            accu = (carry << 7) | ((temp & 0xfb) >> 1);
+            carry = (accu >> 6) & 1;
+        }
+        if (j < (TRANSWARPBASEBLOCKSIZE / 3) - 1) {
+            accu = target_accu[j];
+        }
+        carry = 0;
+
+        unsigned char in[3];
+        in[0] = val[0] | (val[1] << 6);
+        in[1] = (val[1] >> 2) | (val[2] << 4);
+        in[2] = (val[2] >> 4) | (val[3] << 2);
+        for (int k = 0; k < 3; ++k) {
+            decoded[i + k] = decode_receive_diff(ctx, unscramble[k][in[k]], &(ctx->previous), &(ctx->recvcarry));
+        }
+    }
+
+    return true;
+}
+
 static void
 permute(unsigned char *key, int len, int *set)
 {
@@ -2619,88 +3225,163 @@ permute(unsigned char *key, int len, int *set)
     }
 }
 
-/* Write file to disk using Transwarp encoding */
-static unsigned long long
-write_transwarp_file(image_type type, unsigned char *image, imagefile *file, unsigned char *filedata, int *filesize, unsigned int version, bool transwarp_bootfile_fits_on_dir_track)
+/* Derives scrambling, sector order and initial values of a Transwarp file from its key, provides the key for the dir entry data */
+static void
+transwarp_key_schedule(bool have_key, const unsigned char file_key[TRANSWARPKEYSIZE], unsigned int version, unsigned long long *dirdatakey, transwarp_plan *plan)
 {
-    file->size = *filesize - 2;
+    unsigned char key[TRANSWARPKEYSIZE];
+    memset(key, 0, sizeof key);
 
-    unsigned int track = DIRTRACK_D41_D71 - 1;
+    if (have_key) {
+        memcpy(key, file_key, sizeof key);
 
-    if ((file->mode & MODE_MIN_TRACK_MASK) > 0) {
-        /* for Transwarp files, a set minimum track is the file's starting track */
-        track = (file->mode & MODE_MIN_TRACK_MASK) >> MODE_MIN_TRACK_SHIFT;
-    } else {
-        /* allocate */
-        bool free_tracks[40];
-        for (unsigned int t = 1; t <= image_num_tracks(type); ++t) {
-            bool track_free = true;
-            for (int sector = 0; sector < num_sectors(type, t); ++sector) {
-                if (is_sector_free(type, image, t, sector, 0 /* numdirblocks */, 0 /* dir_sector_interleave */) == false) {
-                    track_free = false;
-                    break;
-                }
+        for (int round = TRANSWARPKEYHASHROUNDS; round > 0; --round) {
+            for (int i = 0; i < (TRANSWARPKEYSIZE - 1); ++i) {
+                key[i] ^= key[i + 1];
             }
-            free_tracks[t - 1] = track_free;
-        }
 
-        /* below dir track */
-        while (track > 0) {
-            if (free_tracks[track - 1]) {
-                int filesize = file->size;
-                int t = track;
-                while ((filesize > 0)
-                        && (t > 0)) {
-                    filesize -= (TRANSWARPBLOCKSIZE * num_sectors(type, t));
-                    if (filesize >= 0) {
-                        if (free_tracks[t - 1] == false) {
-                            break;
-                        }
-                        --t;
-                    }
+            for (int i = TRANSWARPKEYSIZE - 1; i >= 0; --i) {
+                int product = key[i] * 0x6b;
+                key[i] = product;
+                int msb = product >> 8;
+                for (int j = i + 1; j < TRANSWARPKEYSIZE; ++j) {
+                    msb += key[j];
+                    key[j] = msb;
+                    msb >>= 8;
                 }
+            }
 
-                if (filesize <= 0) {
-                    break;
-                }
+            int sum = round;
+            for (int i = 0; i < TRANSWARPKEYSIZE; ++i) {
+                sum += key[i];
+                key[i] = sum;
+                sum >>= 8;
             }
-            --track;
-        }
-
-        if (track <= 0) {
-            /* above dir track */
-            track = DIRTRACK_D41_D71 + (transwarp_bootfile_fits_on_dir_track ? 1 : 2);
-            while (track <= image_num_tracks(type)) {
-                if (free_tracks[track - 1]) {
-                    int filesize = file->size;
-                    int t = track;
-                    while (filesize > 0) {
-                        filesize -= (TRANSWARPBLOCKSIZE * num_sectors(type, t));
-                        if (filesize >= 0) {
-                            if (free_tracks[t - 1] == false) {
-                                break;
-                            }
-                            ++t;
-                        }
-                    }
+        }
+    }
+
+    *dirdatakey = (key[TRANSWARPKEYSIZE - 1] * (1ULL << 56))
+                  + (key[TRANSWARPKEYSIZE - 2] * (1ULL << 48))
+                  + (key[TRANSWARPKEYSIZE - 3] * (1ULL << 40))
+                  + (key[TRANSWARPKEYSIZE - 4] * (1ULL << 32))
+                  + (key[TRANSWARPKEYSIZE - 5] * (1ULL << 24))
+                  + (key[TRANSWARPKEYSIZE - 6] * (1ULL << 16))
+                  + (key[TRANSWARPKEYSIZE - 7] * (1ULL << 8))
+                  + key[TRANSWARPKEYSIZE - 8];
+
+    int initial_buffer_store_value = key[TRANSWARPKEYSIZE - 9];
+    plan->initial_buffer_recvaccu_value = key[TRANSWARPKEYSIZE - 10];
+    plan->initial_block_recvaccu_value = key[TRANSWARPKEYSIZE - 11];
+
+    for (int i = 0; i < 4; ++i) {
+        int set[] = { 0, 2, 4, 1, 3, 5 };
+        if (have_key) {
+            permute(key, 6, set);
+        }
 
-                    if (filesize <= 0) {
+        int set2[3][4];
+        for (int j = 0; j < 3; ++j) {
+            int set3[] = { 0, 1, 2, 3 };
+            if (have_key) {
+                permute(key, 4, set3);
+            }
+            for (int k = 0; k < 4; ++k) {
+                for (int l = 0; l < 4; ++l) {
+                    if (k == set3[l]) {
+                        set2[j][k] = l;
                         break;
                     }
                 }
-                ++track;
             }
         }
+
+        for (int j = 0; j < 256; ++j) {
+            unsigned char scrambled = (set2[0][(((j >> set[0]) & 1) << 0)
+                                               | (((j >> set[3]) & 1) << 1)] << 0)
+                                      | (set2[1][(((j >> set[1]) & 1) << 0)
+                                                 | (((j >> set[4]) & 1) << 1)] << 2)
+                                      | (set2[2][(((j >> set[2]) & 1) << 0)
+                                                 | (((j >> set[5]) & 1) << 1)] << 4)
+                                      | (j & 0xc0);
+            plan->scramble[i][j] = scrambled;
+        }
+    }
+
+    for (int s = 0; s < 21; ++s) {
+        plan->sectors[s] = s;
+    }
+    if (have_key) {
+        permute(key, 17, plan->sectors);
+    }
+
+    memset(&plan->ctx, 0, sizeof plan->ctx);
+    plan->ctx.receive_offset = (version <= 84) ? 0 : 2;
+
+    plan->ctx.previous1 = initial_buffer_store_value;
+}
+
+/* Checks if a Transwarp file of the given size fits onto free tracks from the given track on */
+static bool
+transwarp_tracks_fit(image_type type, int track, int size, bool cylinders, const bool *free_tracks)
+{
+    while (size > 0) {
+        if ((track < 1) || (track > (int)image_num_tracks(type)) || !free_tracks[track - 1]) {
+            return false;
+        }
+        size -= (TRANSWARPBLOCKSIZE * num_sectors(type, track));
+        track = transwarp_next_track(type, track, cylinders);
+    }
+    return true;
+}
+
+/* Allocates the tracks of a Transwarp file and prepares its encoding, provides the key for the dir entry data.
+   The file data is finalized here, it is encoded later by encode_transwarp_file() */
+static int
+plan_transwarp_file(image_type type, unsigned char *image, imagefile *file, unsigned char *filedata, int *filesize, unsigned int version, bool transwarp_bootfile_fits_on_dir_track, unsigned long long *dirdatakey, transwarp_plan *plan)
+{
+    file->size = *filesize - 2;
+
+    bool cylinders = (type == IMAGE_D71) && (file->mode & MODE_SAVECLUSTEROPTIMIZED);
+    unsigned int track = DIRTRACK_D41_D71 - 1;
+
+    if ((file->mode & MODE_MIN_TRACK_MASK) > 0) {
+        /* for Transwarp files, a set minimum track is the file's starting track */
+        track = (file->mode & MODE_MIN_TRACK_MASK) >> MODE_MIN_TRACK_SHIFT;
+        if ((type == IMAGE_D71) && !cylinders && (track > D64NUMTRACKS)) {
+            fprintf(stderr, "ERROR: Transwarp file ");
+            print_filename(stderr, file->pfilename);
+            fprintf(stderr, " can only start on the second side with -c\n");
+            return -4;
+        }
+    } else {
+        /* allocate */
+        bool free_tracks[D71NUMTRACKS];
+        for (unsigned int t = 1; t <= image_num_tracks(type); ++t) {
+            free_tracks[t - 1] = (free_sectors_on_track(type, t, 0 /* numdirblocks */, 0 /* dir_sector_interleave */) == num_sectors(type, t));
+        }
+
+        /* below dir track, then above dir track, the second side of a D71 is only used in cylinders */
+        int last = (type == IMAGE_D71) ? D64NUMTRACKS : (int)image_num_tracks(type);
+        int above = DIRTRACK_D41_D71 + (transwarp_bootfile_fits_on_dir_track ? 1 : 2);
+        bool found = false;
+        for (int t = DIRTRACK_D41_D71 - 1; (t > 0) && !found; --t) {
+            found = transwarp_tracks_fit(type, t, file->size, cylinders, free_tracks);
+            track = t;
+        }
+        for (int t = above; (t <= last) && !found; ++t) {
+            found = transwarp_tracks_fit(type, t, file->size, cylinders, free_tracks);
+            track = t;
+        }
+        if (!found) {
+            track = image_num_tracks(type) + 1;
+        }
     }
 
     file->track = track;
     file->sector = 0;
 
-    int8_t gcr_to_nibble[32];
-    generate_gcr_decoding_table(NIBBLE_TO_GCR, gcr_to_nibble);
-
-    unsigned char key[TRANSWARPKEYSIZE];
-    memset(key, 0, sizeof key);
+    generate_encode_inverse_tables();
+    generate_gcr_tables();
 
     if (file->have_key != 0) {
         if ((filedata[0] == 0x01)
@@ -2727,7 +3408,7 @@ write_transwarp_file(image_type type, unsigned char *image, imagefile *file, uns
             while (file_size > 0) {
                 file_size -= (TRANSWARPBLOCKSIZE * num_sectors(type, filetrack));
                 if (file_size > 0) {
-                    filetrack = (filetrack < DIRTRACK_D41_D71) ? (filetrack - 1) : (filetrack + 1);
+                    filetrack = transwarp_next_track(type, filetrack, cylinders);
                 }
             }
             int spare_blocks = (0 - file_size) / TRANSWARPBLOCKSIZE;
@@ -2751,192 +3432,584 @@ write_transwarp_file(image_type type, unsigned char *image, imagefile *file, uns
             }
         }
 
-        memcpy(key, file->key, sizeof key);
-
-        for (int round = TRANSWARPKEYHASHROUNDS; round > 0; --round) {
-            for (int i = 0; i < (TRANSWARPKEYSIZE - 1); ++i) {
-                key[i] ^= key[i + 1];
-            }
-
-            for (int i = TRANSWARPKEYSIZE - 1; i >= 0; --i) {
-                int product = key[i] * 0x6b;
-                key[i] = product;
-                int msb = product >> 8;
-                for (int j = i + 1; j < TRANSWARPKEYSIZE; ++j) {
-                    msb += key[j];
-                    key[j] = msb;
-                    msb >>= 8;
-                }
-            }
-
-            int sum = round;
-            for (int i = 0; i < TRANSWARPKEYSIZE; ++i) {
-                sum += key[i];
-                key[i] = sum;
-                sum >>= 8;
-            }
-        }
     }
 
-    unsigned long long dirdatakey = (key[TRANSWARPKEYSIZE - 1] * (1ULL << 56))
-                                    + (key[TRANSWARPKEYSIZE - 2] * (1ULL << 48))
-                                    + (key[TRANSWARPKEYSIZE - 3] * (1ULL << 40))
-                                    + (key[TRANSWARPKEYSIZE - 4] * (1ULL << 32))
-                                    + (key[TRANSWARPKEYSIZE - 5] * (1ULL << 24))
-                                    + (key[TRANSWARPKEYSIZE - 6] * (1ULL << 16))
-                                    + (key[TRANSWARPKEYSIZE - 7] * (1ULL << 8))
-                                    + key[TRANSWARPKEYSIZE - 8];
+    transwarp_key_schedule(file->have_key, file->key, version, dirdatakey, plan);
 
-    int initial_buffer_store_value = key[TRANSWARPKEYSIZE - 9];
-    int initial_buffer_recvaccu_value = key[TRANSWARPKEYSIZE - 10];
-    int initial_block_recvaccu_value = key[TRANSWARPKEYSIZE - 11];
+    plan->file = file;
+    plan->filesize = *filesize;
+    plan->first_track = track;
+    plan->cylinders = cylinders;
 
-    unsigned char scramble[4][256];
-    for (int i = 0; i < 4; ++i) {
-        int set[] = { 0, 2, 4, 1, 3, 5 };
-        if (file->have_key) {
-            permute(key, 6, set);
+    /* all sectors of the file's tracks are used, including the last track */
+    int total_blocks = 0;
+    for (int filepos = 2; filepos < *filesize; track = transwarp_next_track(type, track, cylinders)) {
+        if ((track < 1)
+                || (track > image_num_tracks(type))) {
+            fprintf(stderr, "ERROR: Disk full (track %d out of range) while writing Transwarp file ", track);
+            print_filename(stderr, file->pfilename);
+            fprintf(stderr, "\n");
+            return -4;
         }
 
-        int set2[3][4];
-        for (int j = 0; j < 3; ++j) {
-            int set3[] = { 0, 1, 2, 3 };
-            if (file->have_key) {
-                permute(key, 4, set3);
-            }
-            for (int k = 0; k < 4; ++k) {
-                for (int l = 0; l < 4; ++l) {
-                    if (k == set3[l]) {
-                        set2[j][k] = l;
-                        break;
-                    }
-                }
+        for (int sector = 0; sector < num_sectors(type, track); ++sector) {
+            if (is_sector_free(type, track, sector, 0 /* numdirblocks */, 0 /* dir_sector_interleave */) == false) {
+                fprintf(stderr, "ERROR: t%d/s%d not free for Transwarp file ", track, sector);
+                print_filename(stderr, file->pfilename);
+                fprintf(stderr, "\n");
+                check_bam(type, image);
+
+                return -5;
             }
+            mark_sector(type, track, sector, 0 /* not free */);
+            ++total_blocks;
         }
 
-        for (int j = 0; j < 256; ++j) {
-            unsigned char scrambled = (set2[0][(((j >> set[0]) & 1) << 0)
-                                               | (((j >> set[3]) & 1) << 1)] << 0)
-                                      | (set2[1][(((j >> set[1]) & 1) << 0)
-                                                 | (((j >> set[4]) & 1) << 1)] << 2)
-                                      | (set2[2][(((j >> set[2]) & 1) << 0)
-                                                 | (((j >> set[5]) & 1) << 1)] << 4)
-                                      | (j & 0xc0);
-            scramble[i][j] = scrambled;
-        }
+        filepos += num_sectors(type, track) * TRANSWARPBLOCKSIZE;
+        file->last_track = track;
     }
 
-    int sectors[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20 };
-    if (file->have_key != 0) {
-        permute(key, 17, sectors);
-    }
+    file->nrSectors = total_blocks;
 
-    transwarp_encode_context ctx;
-    memset(&ctx, 0, sizeof ctx);
-    ctx.version = version;
+    return 0;
+}
 
-    ctx.previous1 = initial_buffer_store_value;
+/* The position of a Transwarp file while walking its blocks in the order they are encoded and decoded */
+typedef struct {
+    image_type type;
+    transwarp_plan *plan;
+    transwarp_encode_context ctx; /* set up for the current block */
+    transwarp_encode_context trackctx;
+    int track;
+    int sector; /* -1 before the first block */
+    int pos; /* file position of the data in the current block */
+    int filepos;
+    int block_index;
+    bool last_block;
+    bool done;
+} transwarp_walk;
 
-    bool done = false;
-    int block_index = 0;
-    int total_blocks = 0;
+static void
+transwarp_walk_start(transwarp_walk *walk, image_type type, transwarp_plan *plan)
+{
+    walk->type = type;
+    walk->plan = plan;
+    walk->ctx = plan->ctx;
+    walk->track = plan->first_track;
+    walk->sector = -1;
+    walk->filepos = 2;
+    walk->block_index = 0;
+    walk->last_block = false;
+    walk->done = false;
+}
+
+/* Advances to the next block of a Transwarp file and sets up the context for it.
+   Returns 1 for a block, 0 after the last one, or -1 if the file leaves the image */
+static int
+transwarp_walk_next(transwarp_walk *walk)
+{
+    image_type type = walk->type;
+    transwarp_plan *plan = walk->plan;
+    int *sectors = plan->sectors;
 
-    int filepos = 2;
+    if (walk->last_block) {
+        walk->ctx = walk->trackctx;
+        walk->done = true;
+    }
 
-    for (; !done; (track >= DIRTRACK_D41_D71) ? ++track : --track) {
-        if ((track < 1)
-                || (track > image_num_tracks(type))) {
-            fprintf(stderr, "ERROR: Disk full (track %d out of range) while writing Transwarp file ", track);
-            print_filename(stderr, file->pfilename);
-            fprintf(stderr, "\n");
-            exit(-4);
+    if ((walk->sector < 0) || (++walk->sector >= num_sectors(type, walk->track))) {
+        if (walk->sector >= 0) {
+            walk->filepos += num_sectors(type, walk->track) * TRANSWARPBLOCKSIZE;
+            walk->block_index += num_sectors(type, walk->track);
+            if (walk->done) {
+                return 0;
+            }
+            walk->track = transwarp_next_track(type, walk->track, plan->cylinders);
+        }
+        if ((walk->track < 1) || (walk->track > (int)image_num_tracks(type))) {
+            return -1;
         }
 
-        int next_track_pos = filepos + (num_sectors(type, track) * TRANSWARPBLOCKSIZE);
-        bool last_track = (next_track_pos >= *filesize);
+        int next_track_pos = walk->filepos + (num_sectors(type, walk->track) * TRANSWARPBLOCKSIZE);
+        bool last_track = (next_track_pos >= plan->filesize);
         if (last_track) {
             int sector = 0;
-            for (int s = 0; s < num_sectors(type, track); ++s) {
+            for (int s = 0; s < num_sectors(type, walk->track); ++s) {
                 sectors[s] = sector;
-                if ((filepos + ((sector + 1) * TRANSWARPBLOCKSIZE)) >= *filesize) {
+                if ((walk->filepos + ((sector + 1) * TRANSWARPBLOCKSIZE)) >= plan->filesize) {
                     sector = 0;
                 } else {
                     ++sector;
                 }
             }
         }
-        int next_track_block_index = block_index + num_sectors(type, track);
-        int trackpos = filepos;
-
-        transwarp_encode_context trackctx = ctx;
-
-        for (int sector = 0; sector < num_sectors(type, track); ++sector) {
-            if (is_sector_free(type, image, track, sector, 0 /* numdirblocks */, 0 /* dir_sector_interleave */) == false) {
-                fprintf(stderr, "ERROR: t%d/s%d not free for Transwarp file ", track, sector);
-                print_filename(stderr, file->pfilename);
-                fprintf(stderr, "\n");
-                check_bam(type, image);
-
-                exit(-5);
-            }
-
-            bool last_block = false;
-            int pos = trackpos + (sectors[sector] * TRANSWARPBLOCKSIZE);
-            if ((pos + TRANSWARPBLOCKSIZE) >= *filesize) {
-                pos = *filesize - TRANSWARPBLOCKSIZE;
-                last_block = true;
-            }
-
-            unsigned char encoded[320 + 5];
-            unsigned char previous = block_index + sectors[sector];
-            previous ^= initial_block_recvaccu_value;
 
-            ctx.previous = previous;
-            ctx.previous2 = initial_buffer_recvaccu_value;
+        walk->trackctx = walk->ctx;
+        walk->sector = 0;
+    }
 
-            int error = encode_transwarp_block((const unsigned char (*)[256]) scramble, gcr_to_nibble, &ctx, filedata, pos, encoded);
-            if (error) {
-                fprintf(stderr, "ERROR: encoding error on t%d/s%d\n", track, sector);
+    walk->last_block = false;
+    walk->pos = walk->filepos + (sectors[walk->sector] * TRANSWARPBLOCKSIZE);
+    if ((walk->pos + TRANSWARPBLOCKSIZE) >= plan->filesize) {
+        walk->pos = plan->filesize - TRANSWARPBLOCKSIZE;
+        walk->last_block = true;
+    }
 
-                exit(-6);
-            }
+    unsigned char previous = walk->block_index + sectors[walk->sector];
+    previous ^= plan->initial_block_recvaccu_value;
 
-            unsigned char decoded[256];
-            int checksum = decode_gcr_block(gcr_to_nibble, encoded, decoded);
-            if (checksum < 0) {
-                fprintf(stderr, "ERROR: decoding error on t%d/s%d\n", track, sector);
+    walk->ctx.previous = previous;
+    walk->ctx.previous2 = plan->initial_buffer_recvaccu_value;
 
-                exit(-7);
-            }
+    return 1;
+}
 
-            int offset = linear_sector(type, track, sector) * BLOCKSIZE;
-            memcpy(image + offset, decoded, BLOCKSIZE);
+/* Encodes a Transwarp file into the sectors allocated by plan_transwarp_file() */
+static int
+encode_transwarp_file(image_type type, unsigned char *image, transwarp_plan *plan)
+{
+    transwarp_walk walk;
+    transwarp_walk_start(&walk, type, plan);
+    while (transwarp_walk_next(&walk) > 0) {
+        unsigned char encoded[320 + 5];
+        int error = encode_transwarp_block((const unsigned char (*)[256]) plan->scramble, &walk.ctx, plan->filedata, walk.pos, encoded);
+        if (error != 0) {
+            fprintf(stderr, "ERROR: encoding error on t%d/s%d\n", walk.track, walk.sector);
 
-            ++total_blocks;
+            return (error < 0) ? error : -6;
+        }
 
-            if (last_block) {
-                ctx = trackctx;
-                done = true;
-            }
+        unsigned char decoded[256];
+        int checksum = decode_gcr_block(encoded, decoded);
+        if (checksum < 0) {
+            fprintf(stderr, "ERROR: decoding error on t%d/s%d\n", walk.track, walk.sector);
 
-            mark_sector(type, image, track, sector, 0 /* not free */);
+            return -7;
         }
 
-        filepos = next_track_pos;
-        block_index = next_track_block_index;
-        file->last_track = track;
+        int offset = linear_sector(type, walk.track, walk.sector) * BLOCKSIZE;
+        memcpy(image + offset, decoded, BLOCKSIZE);
+        mark_dirty(offset);
     }
 
-    file->nrSectors = total_blocks;
-
-    return dirdatakey;
+    return 0;
 }
 
-/* Write files to disk */
-static void
-write_files(image_type type, unsigned char *image, imagefile *files, int num_files, int usedirtrack, int dirtracksplit, int shadowdirtrack, int numdirblocks, int dir_sector_interleave)
+/* Returns the version of the Transwarp bootfile on the image, like place_files() takes it from the bootfile name */
+static unsigned int
+transwarp_bootfile_version(const unsigned char *image)
 {
-    unsigned char track = 1;
+    for (int e = 0; e < job->image_dir.num_entries; e++) {
+        int b = job->image_dir.entries[e].offset;
+        if (((image[b + FILETYPEOFFSET] & 0xf) != FILETYPEDEL) && is_transwarp_bootfile(image, b)) {
+            char name[FILENAMEMAXSIZE + 1];
+            memcpy(name, image + b + FILENAMEOFFSET, FILENAMEMAXSIZE);
+            name[FILENAMEMAXSIZE] = 0;
+            int version_major;
+            int version_minor;
+            if (sscanf(name, "TRANSWARP V%d.%d", &version_major, &version_minor) == 2) {
+                return (version_major * 100) + version_minor;
+            }
+        }
+    }
+    return 100;
+}
+
+/* Decodes the Transwarp file of a dir entry and checks its dir data and file checksums, and if given, the expected data.
+   Returns the file data including the load address or NULL on error */
+static unsigned char*
+decode_transwarp_file(image_type type, const unsigned char *image, int entry_offset, bool have_key, const unsigned char key[TRANSWARPKEYSIZE], int *filesize,
+                      const unsigned char *expected, int expected_size)
+{
+    generate_encode_inverse_tables();
+    generate_gcr_tables();
+
+    transwarp_plan plan;
+    unsigned long long dirdatakey;
+    transwarp_key_schedule(have_key, key, transwarp_bootfile_version(image), &dirdatakey, &plan);
+
+    unsigned char entry[DIRENTRYSIZE];
+    memcpy(entry, image + entry_offset, DIRENTRYSIZE);
+    for (int offset = DIRDATACHECKSUMOFFSET; offset <= FILEBLOCKSLOOFFSET; ++offset) {
+        entry[offset] ^= dirdatakey;
+        dirdatakey >>= 8;
+    }
+    if ((entry[TRANSWARPSIGNATROFFSLO] != TRANSWARPSIGNATURELO)
+            || (entry[TRANSWARPSIGNATROFFSHI] != TRANSWARPSIGNATUREHI)) {
+        fprintf(stderr, "ERROR: ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, " is not a Transwarp file\n");
+        return NULL;
+    }
+    if (transwarp_dirdata_checksum(entry, 0) != 0) {
+        fprintf(stderr, "ERROR: Dir data checksum error in Transwarp file ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, "%s\n", have_key ? ", wrong key?" : ", missing key?");
+        return NULL;
+    }
+
+    int loadaddress = entry[LOADADDRESSLOOFFSET] | (entry[LOADADDRESSHIOFFSET] << 8);
+    int endaddress = entry[ENDADDRESSLOOFFSET] | (entry[ENDADDRESSHIOFFSET] << 8);
+    *filesize = ((endaddress - loadaddress) & 0xffff) + 2;
+    if (*filesize <= 2) {
+        fprintf(stderr, "ERROR: Invalid size of Transwarp file ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, "\n");
+        return NULL;
+    }
+    if ((expected != NULL) && (*filesize != expected_size)) {
+        fprintf(stderr, "ERROR: Transwarp file ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, " has size %d instead of %d\n", *filesize, expected_size);
+        return NULL;
+    }
+    unsigned char *filedata = (unsigned char*)calloc(*filesize, sizeof(unsigned char));
+    if (filedata == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        return NULL;
+    }
+    filedata[0] = loadaddress;
+    filedata[1] = loadaddress >> 8;
+
+    unsigned char unscramble[4][256];
+    for (int i = 0; i < 4; ++i) {
+        for (int j = 0; j < 256; ++j) {
+            unscramble[i][plan.scramble[i][j]] = j;
+        }
+    }
+
+    /* same walk as encode_transwarp_file() */
+    plan.filesize = *filesize;
+    plan.cylinders = (type == IMAGE_D71) && (entry[TRANSWARPTRACKOFFSET] & TRANSWARPCYLINDERFLAG);
+    plan.first_track = entry[TRANSWARPTRACKOFFSET] & ~TRANSWARPCYLINDERFLAG;
+    transwarp_walk walk;
+    transwarp_walk_start(&walk, type, &plan);
+    int result;
+    while ((result = transwarp_walk_next(&walk)) > 0) {
+        unsigned char encoded[325];
+        encode_gcr_data_block(image + (linear_sector(type, walk.track, walk.sector) * BLOCKSIZE), encoded);
+        unsigned char decoded[TRANSWARPBLOCKSIZE];
+        if (!decode_transwarp_block((const unsigned char (*)[256]) unscramble, &walk.ctx, encoded, decoded)) {
+            fprintf(stderr, "ERROR: decoding error on t%d/s%d\n", walk.track, walk.sector);
+            free(filedata);
+            return NULL;
+        }
+        int pos = walk.pos;
+        for (int i = (pos < 2) ? (2 - pos) : 0; i < TRANSWARPBLOCKSIZE; ++i) {
+            if ((expected != NULL) && (expected[pos + i] != decoded[i])) {
+                fprintf(stderr, "ERROR: Transwarp file ");
+                print_filename(stderr, entry + FILENAMEOFFSET);
+                fprintf(stderr, " differs from its source on t%d/s%d\n", walk.track, walk.sector);
+                free(filedata);
+                return NULL;
+            }
+            filedata[pos + i] = decoded[i];
+        }
+    }
+    if (result < 0) {
+        fprintf(stderr, "ERROR: Transwarp file ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, " exceeds the image on track %d\n", walk.track);
+        free(filedata);
+        return NULL;
+    }
+
+    unsigned char file_checksum = 0xff;
+    for (int i = 2; i < *filesize; ++i) {
+        file_checksum ^= filedata[i];
+        file_checksum = crc8(file_checksum);
+    }
+    if (file_checksum != entry[FILECHECKSUMOFFSET]) {
+        fprintf(stderr, "ERROR: File checksum error in Transwarp file ");
+        print_filename(stderr, entry + FILENAMEOFFSET);
+        fprintf(stderr, "\n");
+        free(filedata);
+        return NULL;
+    }
+
+    return filedata;
+}
+
+/* Copies the sectors of a Transwarp file between image and stream, see encode_transwarp_files() */
+static bool
+transfer_transwarp_sectors(image_type type, unsigned char *image, const transwarp_plan *plan, FILE *stream, bool to_image)
+{
+    for (unsigned int track = plan->first_track; ; track = transwarp_next_track(type, track, plan->cylinders)) {
+        for (int sector = 0; sector < num_sectors(type, track); ++sector) {
+            int offset = linear_sector(type, track, sector) * BLOCKSIZE;
+            if (to_image) {
+                if (fread(image + offset, BLOCKSIZE, 1, stream) != 1) {
+                    return false;
+                }
+                mark_dirty(offset);
+            } else if (fwrite(image + offset, BLOCKSIZE, 1, stream) != 1) {
+                return false;
+            }
+        }
+        if (track == (unsigned int)plan->file->last_track) {
+            return true;
+        }
+    }
+}
+
+/* Encodes all planned Transwarp files, in parallel child processes, one per core, if there are several.
+   The files use disjoint tracks, each child sends back the sectors of its file.
+   Files that cannot be given to a child are encoded in this process */
+static int
+encode_transwarp_files(image_type type, unsigned char *image, transwarp_plan *plans, int num_plans)
+{
+#ifndef _WIN32
+    int workers = num_workers();
+    if ((num_plans > 1) && (workers > 1)) {
+        pid_t* pids = (pid_t*)calloc(num_plans, sizeof(pid_t));
+        FILE** sectors = (FILE**)calloc(num_plans, sizeof(FILE*));
+        if (pids == NULL || sectors == NULL) {
+            fprintf(stderr, "ERROR: Memory allocation error\n");
+            free(pids);
+            free(sectors);
+            return -1;
+        }
+
+        int failed = 0;
+        int started = 0;
+        int running = 0;
+        int first_serial = num_plans;
+        fflush(stdout);
+        fflush(stderr);
+        while (started < first_serial || running > 0) {
+            while (running < workers && started < first_serial && !failed) {
+                sectors[started] = tmpfile();
+                pid_t pid = (sectors[started] == NULL) ? -1 : fork();
+                if (pid == 0) {
+                    /* the exit code of the encoding is passed on by the parent */
+                    int error = encode_transwarp_file(type, image, plans + started);
+                    if ((error == 0)
+                            && (!transfer_transwarp_sectors(type, image, plans + started, sectors[started], false)
+                                || (fflush(sectors[started]) != 0))) {
+                        error = -1;
+                    }
+                    fflush(NULL);
+                    _exit(error & 0xff);
+                }
+                if (pid < 0) {
+                    first_serial = started;
+                    break;
+                }
+                pids[started++] = pid;
+                running++;
+            }
+            if (running == 0) {
+                break;
+            }
+
+            int wstatus;
+            pid_t pid = wait(&wstatus);
+            if (pid < 0) {
+                fprintf(stderr, "ERROR: Lost track of Transwarp encoding\n");
+                failed = -1;
+                for (int i = 0; i < started; i++) {
+                    if (pids[i] > 0) {
+                        waitpid(pids[i], &wstatus, 0);
+                    }
+                }
+                break;
+            }
+            for (int i = 0; i < started; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = 0;
+                    running--;
+                    rewind(sectors[i]);
+                    if (!WIFEXITED(wstatus)) {
+                        failed = -1;
+                    } else if (WEXITSTATUS(wstatus) != 0) {
+                        failed = WEXITSTATUS(wstatus) - 256;
+                    } else if (!transfer_transwarp_sectors(type, image, plans + i, sectors[i], true)) {
+                        failed = -1;
+                    }
+                    break;
+                }
+            }
+        }
+
+        for (int i = 0; i < num_plans; i++) {
+            if (sectors[i] != NULL) {
+                fclose(sectors[i]);
+            }
+        }
+        free(pids);
+        free(sectors);
+        for (int i = first_serial; (failed == 0) && (i < num_plans); i++) {
+            failed = encode_transwarp_file(type, image, plans + i);
+        }
+        return failed;
+    }
+#endif
+    for (int i = 0; i < num_plans; i++) {
+        int error = encode_transwarp_file(type, image, plans + i);
+        if (error != 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+/* Input data of a plain file, kept for verify_files() */
+typedef struct {
+    unsigned char* data;
+    int size;
+} file_source;
+
+/* Compares a file written as a sector chain with its source, reports the first sector that differs */
+static bool
+verify_sector_chain(image_type type, const unsigned char *image, const imagefile *file, const file_source *source)
+{
+    int track = file->track;
+    int sector = file->sector;
+    int pos = 0;
+    for (int blocks = 0; blocks < MAXNUMBLOCKS; blocks++) {
+        int block = linear_sector(type, track, sector);
+        if (block < 0) {
+            fprintf(stderr, "ERROR: File \"%s\" has an invalid sector chain at t%d/s%d\n", file->alocalname, track, sector);
+            return false;
+        }
+        const unsigned char *data = image + (block * BLOCKSIZE);
+        bool last = (data[TRACKLINKOFFSET] == 0);
+        int length = last ? (data[SECTORLINKOFFSET] - 1) : (BLOCKSIZE - BLOCKOVERHEAD);
+        if ((length < 0)
+                || (pos + length > source->size)
+                || (last && (pos + length != source->size))
+                || (memcmp(data + BLOCKOVERHEAD, source->data + pos, length) != 0)) {
+            fprintf(stderr, "ERROR: File \"%s\" differs from its source on t%d/s%d\n", file->alocalname, track, sector);
+            return false;
+        }
+        if (last) {
+            return true;
+        }
+        pos += length;
+        track = data[TRACKLINKOFFSET];
+        sector = data[SECTORLINKOFFSET];
+    }
+    fprintf(stderr, "ERROR: File \"%s\" has a cyclic sector chain\n", file->alocalname);
+    return false;
+}
+
+/* Verifies every step-th written file from the first one on, returns false if any of them differs from its source */
+static bool
+verify_file_range(image_type type, const unsigned char *image, const imagefile *files, int num_files, const file_source *sources, const transwarp_plan *plans, int num_plans, int first, int step)
+{
+    bool ok = true;
+    for (int i = first; i < num_files; i += step) {
+        const imagefile *file = files + i;
+        if (file->filetype & FILETYPETRANSWARPMASK) {
+            for (int p = 0; p < num_plans; p++) {
+                if (plans[p].file == file) {
+                    int entry_offset = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+                    int filesize;
+                    unsigned char *filedata = decode_transwarp_file(type, image, entry_offset, file->have_key, file->key, &filesize, plans[p].filedata, plans[p].filesize);
+                    ok &= (filedata != NULL);
+                    free(filedata);
+                }
+            }
+        } else if (sources[i].data != NULL) {
+            ok &= verify_sector_chain(type, image, file, sources + i);
+        }
+    }
+    return ok;
+}
+
+/* Reads all written files back from the image and compares them with their sources, in parallel child processes,
+   one per core, if there are several files */
+static int
+verify_files(image_type type, const unsigned char *image, const imagefile *files, int num_files, const file_source *sources, const transwarp_plan *plans, int num_plans)
+{
+    bool ok = true;
+#ifndef _WIN32
+    int workers = min(num_workers(), num_files);
+    if (workers > 1) {
+        fflush(stdout);
+        fflush(stderr);
+        int started = 0;
+        for (; started < workers; started++) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                bool worker_ok = verify_file_range(type, image, files, num_files, sources, plans, num_plans, started, workers);
+                fflush(NULL);
+                _exit(worker_ok ? 0 : 1);
+            }
+            if (pid < 0) {
+                fprintf(stderr, "ERROR: Could not start verification of written files\n");
+                ok = false;
+                break;
+            }
+        }
+        for (; started > 0; started--) {
+            int wstatus;
+            if ((wait(&wstatus) < 0) || !WIFEXITED(wstatus) || (WEXITSTATUS(wstatus) != 0)) {
+                ok = false;
+            }
+        }
+    } else
+#endif
+    {
+        ok = verify_file_range(type, image, files, num_files, sources, plans, num_plans, 0, 1);
+    }
+
+    if (ok && job->verbose) {
+        printf("\nWritten files are identical to their sources\n");
+    }
+    return ok ? 0 : -1;
+}
+
+/* Reads all of stdin into memory, followed by the given number of spare zero bytes, returns NULL on error */
+static unsigned char*
+read_stdin(int* size, int spare)
+{
+    size_t capacity = 0x10000;
+    size_t length = 0;
+    unsigned char* data = (unsigned char*)malloc(capacity + spare);
+#ifdef _WIN32
+    _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    while (data != NULL) {
+        if (length == capacity) {
+            capacity *= 2;
+            unsigned char* grown = (unsigned char*)realloc(data, capacity + spare);
+            if (grown == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t read_size = fread(data + length, 1, capacity - length, stdin);
+        if (read_size == 0) {
+            break;
+        }
+        length += read_size;
+    }
+    if (data == NULL || ferror(stdin) || length > INT_MAX) {
+        free(data);
+        return NULL;
+    }
+    memset(data + length, 0, capacity - length + spare);
+    *size = (int)length;
+    return data;
+}
+
+/* Releases an input file of write_files(), either still open for reading or read into memory */
+static void
+close_input(FILE* f, unsigned char* filedata)
+{
+    if (f != NULL) {
+        fclose(f);
+    }
+    free(filedata);
+}
+
+/* Writes plain files and plans Transwarp files, see write_files(). A dry run only places the files without reading them */
+static int
+place_files(image_type type, unsigned char *image, imagefile *files, int num_files, int usedirtrack, int dirtracksplit, int shadowdirtrack, int numdirblocks, int dir_sector_interleave, transwarp_plan *plans, int *num_plans, file_source *sources, bool dry_run)
+{
+    unsigned char track = 1;
     unsigned char sector = 0;
     int bytes_to_write = 0;
     int lastTrack = track;
@@ -2991,12 +4064,14 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
             file->track = 0;
             file->sector = 0;
             int entryOffset = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+            mark_dirty(entryOffset);
             image[entryOffset + FILETRACKOFFSET] = file->track;
             image[entryOffset + FILESECTOROFFSET] = file->sector;
             image[entryOffset + FILEBLOCKSLOOFFSET] = file->nrSectorsShown & 255;
             image[entryOffset + FILEBLOCKSHIOFFSET] = file->nrSectorsShown >> 8;
             if (shadowdirtrack > 0) {
                 entryOffset = linear_sector(type, shadowdirtrack, file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+                mark_dirty(entryOffset);
                 image[entryOffset + FILETRACKOFFSET] = file->track;
                 image[entryOffset + FILESECTOROFFSET] = file->sector;
                 image[entryOffset + FILEBLOCKSLOOFFSET] = file->nrSectors & 255;
@@ -3007,7 +4082,9 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
             int fileSize = 0;
 
             struct stat st;
-            if (stat((char*)files[i].alocalname, &st) == 0) {
+            if (file->source != NULL) {
+                fileSize = file->source_size;
+            } else if (stat((char*)files[i].alocalname, &st) == 0) {
                 fileSize = (int)st.st_size;
             }
 
@@ -3020,23 +4097,79 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 track = DIRTRACK_D41_D71;
             }
 
-            unsigned char* filedata = (unsigned char*)calloc(fileSize + ((file->filetype & FILETYPETRANSWARPMASK) ? (21 * TRANSWARPBLOCKSIZE) : 0), sizeof(unsigned char));
-            if (filedata == NULL) {
-                fprintf(stderr, "ERROR: Memory allocation error\n");
+            unsigned char* filedata = NULL;
+            FILE* f = NULL;
+            if (file->source != NULL) {
+                /* each segment takes its part of the file, with the load address it has in memory */
+                int offset = file->segment * TRANSWARPSEGMENTSIZE;
+                int loadaddress = ((file->source[1] << 8) | file->source[0]) + offset;
+                int segmentsize = min(fileSize - 2 - offset, TRANSWARPSEGMENTSIZE);
+                if (loadaddress + segmentsize > 0x10000) {
+                    fprintf(stderr, "ERROR: Transwarp file \"%s\" does not fit into memory\n", file->alocalname);
+                    return -1;
+                }
+                filedata = (unsigned char*)calloc(segmentsize + 2 + 21 * TRANSWARPBLOCKSIZE, sizeof(unsigned char));
+                if (filedata == NULL) {
+                    fprintf(stderr, "ERROR: Memory allocation error\n");
+                    return -1;
+                }
+                filedata[0] = loadaddress;
+                filedata[1] = loadaddress >> 8;
+                memcpy(filedata + 2, file->source + 2 + offset, segmentsize);
+                fileSize = segmentsize + 2;
+            } else if (dry_run) {
+                /* only the placement is needed, Transwarp files are planned with blank data */
+                if (file->filetype & FILETYPETRANSWARPMASK) {
+                    filedata = (unsigned char*)calloc(fileSize + 21 * TRANSWARPBLOCKSIZE, sizeof(unsigned char));
+                    if (filedata == NULL) {
+                        fprintf(stderr, "ERROR: Memory allocation error\n");
+                        return -1;
+                    }
+                }
+            } else if (strcmp((char*)file->alocalname, "-") == 0) {
+                filedata = read_stdin(&fileSize, 21 * TRANSWARPBLOCKSIZE);
+                if (filedata == NULL) {
+                    fprintf(stderr, "ERROR: Could not read file from stdin\n");
 
-                exit(-1);
-            }
-            FILE* f = fopen((char*)file->alocalname, "rb");
-            if (f == NULL) {
-                fprintf(stderr, "ERROR: Could not open file \"%s\" for reading\n", file->alocalname);
+                    return -1;
+                }
+            } else {
+                f = (file->input != NULL) ? file->input : fopen((char*)file->alocalname, "rb");
+                file->input = NULL;
+                if (f == NULL) {
+                    fprintf(stderr, "ERROR: Could not open file \"%s\" for reading\n", file->alocalname);
 
-                exit(-1);
+                    return -1;
+                }
             }
-            if (fread(filedata, fileSize, 1, f) != 1) {
+            if (fileSize == 0) {
                 fprintf(stderr, "ERROR: Unexpected filesize when reading %s\n", file->alocalname);
-                exit(-1);
+                close_input(f, filedata);
+                return -1;
+            }
+            if ((f != NULL) && ((file->filetype & FILETYPETRANSWARPMASK) || (sources != NULL))) {
+                /* Transwarp files are encoded as a whole and files to verify are kept, others are read block by block into the image */
+                filedata = (unsigned char*)calloc(fileSize + 21 * TRANSWARPBLOCKSIZE, sizeof(unsigned char));
+                if (filedata == NULL) {
+                    fprintf(stderr, "ERROR: Memory allocation error\n");
+                    fclose(f);
+
+                    return -1;
+                }
+                if (fread(filedata, fileSize, 1, f) != 1) {
+                    fprintf(stderr, "ERROR: Unexpected filesize when reading %s\n", file->alocalname);
+                    close_input(f, filedata);
+                    return -1;
+                }
+                fclose(f);
+                f = NULL;
+            }
+            if ((file->segment > 0) && ((file->mode & MODE_MIN_TRACK_MASK) > 0)) {
+                /* a segment continues on the track after the previous one */
+                int previous = files[i - 1].last_track;
+                int next = transwarp_next_track(type, previous, (type == IMAGE_D71) && (file->mode & MODE_SAVECLUSTEROPTIMIZED));
+                file->mode = (file->mode & ~MODE_MIN_TRACK_MASK) | ((next << MODE_MIN_TRACK_SHIFT) & MODE_MIN_TRACK_MASK);
             }
-            fclose(f);
 
             if ((!(file->filetype & FILETYPETRANSWARPMASK))
                     && ((file->mode & MODE_MIN_TRACK_MASK) > 0)) {
@@ -3049,8 +4182,9 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                         fprintf(stderr, "ERROR: Invalid minimum track %u for file %s (", track, file->alocalname);
                         print_filename(stderr, file->pfilename);
                         fprintf(stderr, ") specified\n");
+                        close_input(f, filedata);
 
-                        exit(-1);
+                        return -1;
                     }
                     while ((!file_usedirtrack)
                             && ((track == dirtrack(type))
@@ -3078,76 +4212,63 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 /* find first empty track */
                 int found = 0;
                 while (!found) {
-                    for (int s = 0; s < num_sectors(type, track); s++) {
-                        if (is_sector_free(type, image, track, s, file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave)) {
-                            if (s == (num_sectors(type, track) - 1)) {
-                                found = 1;
-                                /* In first pass, use sector as left by previous file (or as set by -b) to reach first file block quickly. */
-                                /* Claus: according to Krill, on real HW tracks are not aligned anyway, so it does not make a difference. */
-                                /* Emulators tend to reset the disk angle on track changes, so this should rather be 3. */
-                                if (sector >= num_sectors(type, track)) {
-                                    if ((file->mode & MODE_BEGINNING_SECTOR_MASK) > 0) {
-                                        fprintf(stderr, "ERROR: Invalid beginning sector %u on track %u for file %s (", sector, track, file->alocalname);
-                                        print_filename(stderr, file->pfilename);
-                                        fprintf(stderr, ") specified\n");
-
-                                        exit(-1);
-                                    }
+                    if (free_sectors_on_track(type, track, file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave) == num_sectors(type, track)) {
+                        found = 1;
+                        /* In first pass, use sector as left by previous file (or as set by -b) to reach first file block quickly. */
+                        /* Claus: according to Krill, on real HW tracks are not aligned anyway, so it does not make a difference. */
+                        /* Emulators tend to reset the disk angle on track changes, so this should rather be 3. */
+                        if (sector >= num_sectors(type, track)) {
+                            if ((file->mode & MODE_BEGINNING_SECTOR_MASK) > 0) {
+                                fprintf(stderr, "ERROR: Invalid beginning sector %u on track %u for file %s (", sector, track, file->alocalname);
+                                print_filename(stderr, file->pfilename);
+                                fprintf(stderr, ") specified\n");
+                                close_input(f, filedata);
 
-                                    sector %= num_sectors(type, track);
-                                }
+                                return -1;
                             }
-                        } else {
-                            int prev_track = track;
-                            if (file->mode & MODE_SAVECLUSTEROPTIMIZED) {
-                                if (track > D64NUMTRACKS) {
-                                    int next_track = track - D64NUMTRACKS + 1; /* to next track on first side */
-                                    if (next_track < D64NUMTRACKS) {
-                                        track = next_track;
-                                    } else {
-                                        ++track; /* disk full */
-                                    }
+
+                            sector %= num_sectors(type, track);
+                        }
+                    } else {
+                        int prev_track = track;
+                        if (file->mode & MODE_SAVECLUSTEROPTIMIZED) {
+                            if (track > D64NUMTRACKS) {
+                                int next_track = track - D64NUMTRACKS + 1; /* to next track on first side */
+                                if (next_track < D64NUMTRACKS) {
+                                    track = next_track;
                                 } else {
-                                    track += D64NUMTRACKS; /* to same track on second side */
+                                    ++track; /* disk full */
                                 }
                             } else {
-                                ++track;
+                                track += D64NUMTRACKS; /* to same track on second side */
                             }
-                            while ((!file_usedirtrack)
-                                    && ((track == dirtrack(type))
-                                        || (track == shadowdirtrack)
-                                        || ((type == IMAGE_D71) && (track == D64NUMTRACKS + dirtrack(type))))) { /* .d71 track 53 is usually empty except the extra BAM block */
-                                ++track; /* skip dir track */
-                            }
-                            if (file->mode & MODE_FITONSINGLETRACK) {
-                                int file_size = fileSize;
-                                int first_sector = -1;
-                                for (int s = 0; s < num_sectors(type, prev_track); s++) {
-                                    if (is_sector_free(type, image, prev_track, s, file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave)) {
-                                        if (first_sector < 0) {
-                                            first_sector = s;
-                                        }
-                                        file_size -= BLOCKSIZE + BLOCKOVERHEAD;
-                                        if (file_size <= 0) {
-                                            found = 1;
-                                            track = prev_track;
-                                            sector = first_sector;
-                                            break;
-                                        }
-                                    }
-                                }
+                        } else {
+                            ++track;
+                        }
+                        while ((!file_usedirtrack)
+                                && ((track == dirtrack(type))
+                                    || (track == shadowdirtrack)
+                                    || ((type == IMAGE_D71) && (track == D64NUMTRACKS + dirtrack(type))))) { /* .d71 track 53 is usually empty except the extra BAM block */
+                            ++track; /* skip dir track */
+                        }
+                        if (file->mode & MODE_FITONSINGLETRACK) {
+                            int free_sectors = free_sectors_on_track(type, prev_track, file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave);
+                            if ((free_sectors > 0) && (fileSize <= free_sectors * (BLOCKSIZE + BLOCKOVERHEAD))) {
+                                found = 1;
+                                track = prev_track;
+                                sector = next_free_sector(type, prev_track, 0, 1, num_sectors(type, prev_track), file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave);
                             }
+                        }
 
-                            if (track > image_num_tracks(type)) {
-                                fprintf(stderr, "ERROR: Disk full, file %s (", file->alocalname);
-                                print_filename(stderr, file->pfilename);
-                                fprintf(stderr, ")\n");
+                        if (track > image_num_tracks(type)) {
+                            fprintf(stderr, "ERROR: Disk full, file %s (", file->alocalname);
+                            print_filename(stderr, file->pfilename);
+                            fprintf(stderr, ")\n");
+                            close_input(f, filedata);
 
-                                exit(-1);
-                            }
-                            break;
+                            return -1;
                         }
-                    } /* for each sector on track */
+                    }
 
                     if ((track == (lastTrack + 2))
                             && ((file->mode & MODE_BEGINNING_SECTOR_MASK) == 0)) {
@@ -3162,8 +4283,9 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                     fprintf(stderr, "ERROR: Specified beginning sector of file %s (", file->alocalname);
                     print_filename(stderr, file->pfilename);
                     fprintf(stderr, ") not free on track %u\n", track);
+                    close_input(f, filedata);
 
-                    exit(-1);
+                    return -1;
                 }
             }
 
@@ -3172,12 +4294,16 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 sector = 0;
             }
 
-            int byteOffset = 0;
             int bytesLeft = fileSize;
 
             unsigned long long key0 = 0;
             if (file->filetype & FILETYPETRANSWARPMASK) {
-                key0 = write_transwarp_file(type, image, file, filedata, &fileSize, transwarp_version, transwarp_bootfile_fits_on_dir_track);
+                int error = plan_transwarp_file(type, image, file, filedata, &fileSize, transwarp_version, transwarp_bootfile_fits_on_dir_track, &key0, plans + *num_plans);
+                if (error != 0) {
+                    close_input(f, filedata);
+                    return error;
+                }
+                ++*num_plans;
 
                 bytesLeft = 0;
             }
@@ -3192,14 +4318,8 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
                 while (!blockfound) {
                     /* find spare block on the current track */
-                    for (int s = sector; s < sector + num_sectors(type, track); s++) {
-                        findSector = s % num_sectors(type, track);
-
-                        if (is_sector_free(type, image, track, findSector, file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave)) {
-                            blockfound = 1;
-                            break;
-                        }
-                    }
+                    findSector = next_free_sector(type, track, sector, 1, num_sectors(type, track), file_usedirtrack ? file_numdirblocks : 0, dir_sector_interleave);
+                    blockfound = (findSector >= 0);
 
                     if (!blockfound) {
                         /* find next track, use some magic to make up for track seek delay */
@@ -3242,22 +4362,25 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                                             break;
                                         }
                                         int offset = b * BLOCKSIZE;
-                                        mark_sector(type, image, deltrack, delsector, 1 /* free */);
+                                        mark_sector(type, deltrack, delsector, 1 /* free */);
                                         deltrack = image[offset + 0];
                                         delsector = image[offset + 1];
                                         memset(image + offset, 0, BLOCKSIZE);
+                                        mark_dirty(offset);
                                     }
                                 }
 
                                 bytesLeft = fileSize;
-                                byteOffset = 0;
+                                if (f != NULL) {
+                                    rewind(f);
+                                }
                                 file->nrSectors = 0;
                             }
                             ++track;
                         }
 
                         if (track > image_num_tracks(type)) {
-                            if (verbose) {
+                            if (job->verbose) {
                                 print_file_allocation(type, image, files, num_files);
                                 check_bam(type, image);
                             }
@@ -3265,15 +4388,16 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                             fprintf(stderr, "ERROR: Disk full, file %s (", file->alocalname);
                             print_filename(stderr, file->pfilename);
                             fprintf(stderr, ")\n");
-                            free(filedata);
+                            close_input(f, filedata);
 
-                            exit(-1);
+                            return -1;
                         }
                     }
                 } /* while not block found */
 
                 sector = findSector;
                 int offset = linear_sector(type, track, sector) * BLOCKSIZE;
+                mark_dirty(offset);
 
                 if (bytesLeft == fileSize) {
                     file->track = track;
@@ -3288,24 +4412,30 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
                 /* write sector */
                 bytes_to_write = min(BLOCKSIZE - BLOCKOVERHEAD, bytesLeft);
-                memset(image + offset + 2, 0, 254);
-                memcpy(image + offset + 2, filedata + byteOffset, bytes_to_write);
+                memset(image + offset + 2 + bytes_to_write, 0, 254 - bytes_to_write);
+                if (filedata != NULL) {
+                    memcpy(image + offset + 2, filedata + fileSize - bytesLeft, bytes_to_write);
+                } else if ((f != NULL) && (fread(image + offset + 2, bytes_to_write, 1, f) != 1)) {
+                    fprintf(stderr, "ERROR: Unexpected filesize when reading %s\n", file->alocalname);
+                    close_input(f, filedata);
+                    return -1;
+                }
 
                 bytesLeft -= bytes_to_write;
-                byteOffset += bytes_to_write;
 
                 lastTrack = track;
                 lastSector = sector;
                 lastOffset = offset;
 
-                mark_sector(type, image, track, sector, 0 /* not free */);
+                mark_sector(type, track, sector, 0 /* not free */);
 
                 if (num_sectors(type, track) <= abs(file->sectorInterleave)) {
                     fprintf(stderr, "ERROR: Invalid interleave %d on track %u (%d sectors), file %s (", file->sectorInterleave, track, num_sectors(type, track), file->alocalname);
                     print_filename(stderr, file->pfilename);
                     fprintf(stderr, ")\n");
+                    close_input(f, filedata);
 
-                    exit(-1);
+                    return -1;
                 }
 
                 sector += abs(file->sectorInterleave);
@@ -3321,6 +4451,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
             /* update directory entry */
             int entryOffset = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+            mark_dirty(entryOffset);
             image[entryOffset + FILETRACKOFFSET] = file->track;
             image[entryOffset + FILESECTOROFFSET] = file->sector;
 
@@ -3331,14 +4462,15 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 image[entryOffset + TRANSWARPSIGNATROFFSLO] = TRANSWARPSIGNATURELO;
                 image[entryOffset + TRANSWARPSIGNATROFFSHI] = TRANSWARPSIGNATUREHI;
 
-                image[entryOffset + TRANSWARPTRACKOFFSET] = file->track;
+                image[entryOffset + TRANSWARPTRACKOFFSET] = file->track | (plans[*num_plans - 1].cylinders ? TRANSWARPCYLINDERFLAG : 0);
 
                 image[entryOffset + FILEBLOCKSLOOFFSET] = file->nrSectors;
                 image[entryOffset + FILEBLOCKSHIOFFSET] = (file->nrSectors >> 8);
                 if (image[entryOffset + FILEBLOCKSHIOFFSET] > 0) {
                     fprintf(stderr, "ERROR: Transwarp file \"%s\" is %d > 255 blocks big\n", file->alocalname, file->nrSectors);
+                    close_input(f, filedata);
 
-                    exit(-8);
+                    return -8;
                 }
 
                 int loadaddress = (filedata[1] << 8) | filedata[0];
@@ -3365,8 +4497,9 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                     dirdata_checksum = transwarp_dirdata_checksum(image, entryOffset);
                     if (dirdata_checksum != 0) {
                         fprintf(stderr, "ERROR: Encoding error with \"%s\", 0x%x\n", file->alocalname, dirdata_checksum);
+                        close_input(f, filedata);
 
-                        exit(-9);
+                        return -9;
                     }
                 }
 
@@ -3388,6 +4521,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
             if (shadowdirtrack > 0) {
                 entryOffset = linear_sector(type, shadowdirtrack, file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+                mark_dirty(entryOffset);
                 image[entryOffset + FILETRACKOFFSET] = file->track;
                 image[entryOffset + FILESECTOROFFSET] = file->sector;
 
@@ -3395,31 +4529,31 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 image[entryOffset + FILEBLOCKSHIOFFSET] = file->nrSectors >> 8;
             }
 
-            free(filedata);
+            if (file->filetype & FILETYPETRANSWARPMASK) {
+                /* the plan encodes the data later */
+                plans[*num_plans - 1].filedata = filedata;
+                filedata = NULL;
+            } else if (sources != NULL) {
+                /* compared with the image by verify_files() */
+                sources[i].data = filedata;
+                sources[i].size = fileSize;
+                filedata = NULL;
+            }
+            close_input(f, filedata);
         }
     } /* for each file */
 
     /* Set track/sector of Transwarp file entries to Transwarp bootfile */
     int transwarp_boot_track = 0;
     int transwarp_boot_sector = 0;
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
 
     for (int i = 0; i < num_files; i++) {
         imagefile *file = files + i;
         if (file->filetype & FILETYPETRANSWARPMASK) {
             if (transwarp_boot_track == 0) {
                 /* find Transwarp bootfile */
-
-                int t = dirtrack(type);
-                int s = (type == IMAGE_D81) ? 3 : 1;
-                int o = 0;
-
-                do {
-                    int b = linear_sector(type, t, s) * BLOCKSIZE + o;
+                for (int e = 0; e < job->image_dir.num_entries; e++) {
+                    int b = job->image_dir.entries[e].offset;
                     int filetype = image[b + FILETYPEOFFSET] & 0xf;
                     if (filetype == FILETYPEDEL) {
                         continue;
@@ -3439,7 +4573,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                         continue;
                     }
 
-                    if (verbose) {
+                    if (job->verbose) {
                         printf("\nTranswarp bootfile at T%d/S%d\n", filetrack, filesector);
                     }
 
@@ -3447,21 +4581,21 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                     transwarp_boot_sector = filesector;
 
                     break;
-                } while (next_dir_entry(type, image, &t, &s, &o, blockmap));
+                }
             }
 
             if (transwarp_boot_track == 0) {
                 fprintf(stderr, "ERROR: No Transwarp bootfile provided\n");
 
-                exit(-10);
+                return -10;
             }
 
             int b = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+            mark_dirty(b);
             image[b + FILETRACKOFFSET] = transwarp_boot_track;
             image[b + FILESECTOROFFSET] = transwarp_boot_sector;
         }
     }
-    free(blockmap);
 
     /* update loop files */
     for (int i = 0; i < num_files; i++) {
@@ -3469,7 +4603,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
         if (((file->filetype & 0xf) != FILETYPEDEL) && (file->mode & MODE_LOOPFILE)) {
             int track, sector, offset;
             int index;
-            if (find_existing_file(type, image, file->plocalname, &index, &track, &sector, &offset)) {
+            if (find_existing_file(image, file->plocalname, &index, &track, &sector, &offset)) {
                 /* read track/sector and nrSectors from disk image */
                 int b = linear_sector(type, track, sector) * BLOCKSIZE + offset;
                 file->track = image[b + FILETRACKOFFSET];
@@ -3478,6 +4612,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
                 /* update directory entry */
                 b = linear_sector(type, dirtrack(type), file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+                mark_dirty(b);
                 image[b + FILETRACKOFFSET] = file->track;
                 image[b + FILESECTOROFFSET] = file->sector;
 
@@ -3489,6 +4624,7 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
 
                 if (shadowdirtrack > 0) {
                     b = linear_sector(type, shadowdirtrack, file->direntrysector) * BLOCKSIZE + file->direntryoffset;
+                    mark_dirty(b);
                     image[b + FILETRACKOFFSET] = file->track;
                     image[b + FILESECTOROFFSET] = file->sector;
 
@@ -3510,143 +4646,417 @@ write_files(image_type type, unsigned char *image, imagefile *files, int num_fil
                 continue;
             } else {
                 fprintf(stderr, "ERROR: Loop source file '%s' (%d) not found\n", file->alocalname, i + 1);
-                exit(-1);
+                return -1;
             }
         }
     }
-}
-
-/* Writes 16 bit value to file */
-static size_t
-write16(unsigned int value, FILE* f)
-{
-    char byte = value & 0xff;
-    size_t bytes_written = fwrite(&byte, 1, 1, f);
-
-    byte = (value >> 8) & 0xff;
-    bytes_written += fwrite(&byte, 1, 1, f);
-
-    return bytes_written;
-}
 
-/* Writes 32 bit value to file */
-static size_t
-write32(unsigned int value, FILE* f)
-{
-    size_t bytes_written = write16(value, f);
-    bytes_written += write16(value >> 16, f);
-
-    return bytes_written;
+    return 0;
 }
 
-/* Writes image as G64 file */
-static int
-generate_uniformat_g64(unsigned char* image, const char *imagepath)
+/* Predicts the time to load all files in order along their sector chains. The head starts on the dir track and steps
+   to each track it needs, the loader reads a block when it passes under the head and needs its decode time before it
+   can read the next one. Sector 0 of all tracks is aligned, unless the model has a track skew */
+static long long
+predict_load_time(image_type type, const unsigned char *image, const imagefile *files, int num_files, const load_model *model)
 {
-    FILE* f = fopen(imagepath, "wb");
-
-    size_t filepos = 0;
-
-    static const char signature[] = "GCR-1541";
-    filepos += fwrite(signature, 1, sizeof signature - 1, f);
-
-    const char version = 0;
-    filepos += fwrite(&version, 1, 1, f);
-
-    const char num_tracks = 35 * 2;
-    filepos += fwrite(&num_tracks, 1, 1, f);
-
-    const unsigned int track_size = 7692; /* = track_bytes on tracks 1..17 */
-    filepos += write16(track_size, f);
+    long long track_start[D81NUMTRACKS + 1]; /* passing time of sector 0 within a revolution */
+    double angle = 0.0;
+    for (int track = 1; track <= (int)image_num_tracks(type); track++) {
+        if ((type == IMAGE_D71) && (track == D64NUMTRACKS + 1)) {
+            angle = 0.0;
+        } else if (track > 1) {
+            angle += (double)model->track_skew / num_sectors(type, track);
+            angle -= floor(angle);
+        }
+        track_start[track] = (long long)(angle * REVOLUTIONTIME);
+    }
 
-    const unsigned int table_size = num_tracks * 4;
-    const unsigned int tracks_offset = (int)filepos + (table_size * 2);
+    long long time = 0;
+    int cylinder = dirtrack(type);
+    for (int i = 0; i < num_files; i++) {
+        const imagefile *file = files + i;
+        if ((file->mode & (MODE_NOFILE | MODE_LOOPFILE)) || (file->filetype & FILETYPETRANSWARPMASK)) {
+            continue;
+        }
+        int track = file->track;
+        int sector = file->sector;
+        for (int blocks = 0; (track != 0) && (blocks < MAXNUMBLOCKS); blocks++) {
+            int block = linear_sector(type, track, sector);
+            if (block < 0) {
+                break;
+            }
+            int head = ((type == IMAGE_D71) && (track > D64NUMTRACKS)) ? (track - D64NUMTRACKS) : track;
+            time += (long long)abs(head - cylinder) * model->step_time;
+            cylinder = head;
 
-    for (int track = 0; track < num_tracks; ++track) {
-        unsigned int track_offset = 0;
+            long long block_time = REVOLUTIONTIME / num_sectors(type, track);
+            long long wait = track_start[track] + (sector * block_time) - (time % REVOLUTIONTIME);
+            time += ((wait % REVOLUTIONTIME) + REVOLUTIONTIME) % REVOLUTIONTIME;
+            time += block_time + model->decode_time;
 
-        if ((track & 1) == 0) {
-            track_offset = tracks_offset + ((track >> 1) * (2 + track_size));
+            track = image[block * BLOCKSIZE + TRACKLINKOFFSET];
+            sector = image[block * BLOCKSIZE + SECTORLINKOFFSET];
         }
-
-        filepos += write32(track_offset, f);
     }
+    return time;
+}
 
-    for (int track = 0; track < num_tracks; ++track) {
-        unsigned int bit_rate = 0;
+#ifndef _WIN32
+/* A different interleave and new track sector for one file, see plan_layout() */
+typedef struct {
+    int       file;
+    int       interleave;
+    int       first_sector_new_track;
+    long long time; /* predicted load time of all files, -1 if they do not fit */
+} layout_candidate;
+
+/* Predicts the load time of each candidate from a dry run of place_files() in a child process, one per core at a time.
+   Children do not report errors, a layout that does not fit just has no time */
+static bool
+evaluate_layouts(image_type type, unsigned char *image, imagefile *files, int num_files, int usedirtrack, int dirtracksplit, int shadowdirtrack, int numdirblocks, int dir_sector_interleave, const load_model *model, layout_candidate *candidates, int num_candidates)
+{
+    int workers = num_workers();
+    int results[2];
+    if (pipe(results) != 0) {
+        fprintf(stderr, "ERROR: Could not start planning the layout\n");
+        return false;
+    }
 
-        if ((track & 1) == 0) {
-            switch (sectors_per_track[track >> 1]) {
-            case 21:
-                bit_rate = 3;
-                break;
-            case 19:
-                bit_rate = 2;
-                break;
-            case 18:
-                bit_rate = 1;
-                break;
-            case 17:
-                bit_rate = 0;
+    bool ok = true;
+    int started = 0;
+    int running = 0;
+    fflush(stdout);
+    fflush(stderr);
+    while ((started < num_candidates) || (running > 0)) {
+        while ((running < workers) && (started < num_candidates) && ok) {
+            candidates[started].time = -1;
+            pid_t pid = fork();
+            if (pid == 0) {
+                close(results[0]);
+                if ((freopen("/dev/null", "w", stdout) == NULL) || (freopen("/dev/null", "w", stderr) == NULL)) {
+                    _exit(1);
+                }
+                imagefile *file = files + candidates[started].file;
+                file->sectorInterleave = candidates[started].interleave;
+                file->first_sector_new_track = candidates[started].first_sector_new_track;
+                transwarp_plan* plans = (transwarp_plan*)calloc(num_files + 1, sizeof(transwarp_plan));
+                int num_plans = 0;
+                long long result[2] = { started, -1 };
+                if ((plans != NULL)
+                        && (place_files(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave, plans, &num_plans, NULL, true) == 0)) {
+                    result[1] = predict_load_time(type, image, files, num_files, model);
+                }
+                _exit((write(results[1], result, sizeof result) == (ssize_t)sizeof result) ? 0 : 1);
+            }
+            if (pid < 0) {
+                fprintf(stderr, "ERROR: Could not start planning the layout\n");
+                ok = false;
                 break;
             }
+            started++;
+            running++;
+        }
+        if (running == 0) {
+            break;
+        }
+        int wstatus;
+        if (wait(&wstatus) < 0) {
+            fprintf(stderr, "ERROR: Lost track of planning the layout\n");
+            ok = false;
+            break;
         }
+        running--;
+    }
 
-        filepos += write32(bit_rate, f);
+    /* results of all children fit into the pipe, it is only read when they are done */
+    close(results[1]);
+    long long result[2];
+    while (read(results[0], result, sizeof result) == (ssize_t)sizeof result) {
+        if ((result[0] >= 0) && (result[0] < num_candidates)) {
+            candidates[result[0]].time = result[1];
+        }
     }
+    close(results[0]);
+    return ok;
+}
 
-    const unsigned char sync[] = { 0xff, 0xff, 0xff, 0xff, 0xff };
-    const char gap[] = { 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55 };
-    char header_gcr[10];
+/* Chooses the interleave and new track sector of the files that loading them all in order is predicted to be fastest.
+   The settings of one file at a time are changed while the others are kept, as long as this makes loading faster.
+   The files are still placed by place_files(), so that all other settings of the files apply as before */
+static int
+plan_layout(image_type type, unsigned char *image, imagefile *files, int num_files, int usedirtrack, int dirtracksplit, int shadowdirtrack, int numdirblocks, int dir_sector_interleave, const load_model *model)
+{
+    int max_interleave = SECTORSPERTRACK_D81;
+    for (int track = 1; track <= (int)image_num_tracks(type); track++) {
+        max_interleave = min(max_interleave, num_sectors(type, track) - 1);
+    }
 
-    const unsigned int block_size =
+    layout_candidate candidates[SECTORSPERTRACK_D81];
+    if (num_files == 0) {
+        return 0;
+    }
+    candidates[0].file = 0;
+    candidates[0].interleave = files[0].sectorInterleave;
+    candidates[0].first_sector_new_track = files[0].first_sector_new_track;
+    if (!evaluate_layouts(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave, model, candidates, 1)) {
+        return -1;
+    }
+    long long initial_time = candidates[0].time;
+    long long best_time = initial_time;
+    if (best_time < 0) {
+        return 0; /* the files do not fit, this is reported when they are written */
+    }
+
+    bool improved = true;
+    for (int pass = 0; (pass < PLANPASSES) && improved; pass++) {
+        improved = false;
+        for (int i = 0; i < num_files; i++) {
+            imagefile *file = files + i;
+            if ((file->mode & (MODE_NOFILE | MODE_LOOPFILE | MODE_TRANSWARPBOOTFILE)) || (file->filetype & FILETYPETRANSWARPMASK)) {
+                continue;
+            }
+            /* first the interleave, then the sector on a new track, either absolute 0 or relative to the interleave */
+            for (int setting = 0; setting < 2; setting++) {
+                int num_candidates = 0;
+                for (int value = (setting == 0) ? 1 : 0; value <= max_interleave; value++) {
+                    candidates[num_candidates].file = i;
+                    candidates[num_candidates].interleave = (setting == 0) ? value : file->sectorInterleave;
+                    candidates[num_candidates].first_sector_new_track = (setting == 0) ? file->first_sector_new_track : -value;
+                    num_candidates++;
+                }
+                if (!evaluate_layouts(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave, model, candidates, num_candidates)) {
+                    return -1;
+                }
+                for (int c = 0; c < num_candidates; c++) {
+                    if ((candidates[c].time >= 0) && (candidates[c].time < best_time)) {
+                        best_time = candidates[c].time;
+                        file->sectorInterleave = candidates[c].interleave;
+                        file->first_sector_new_track = candidates[c].first_sector_new_track;
+                        improved = true;
+                    }
+                }
+            }
+        }
+    }
+
+    if (job->verbose) {
+        printf("\nPlanned layout loads in %.1f ms instead of %.1f ms\n", best_time / 1000.0, initial_time / 1000.0);
+    }
+    return 0;
+}
+#endif
+
+/* Write files to disk, Transwarp files are encoded after all files are placed.
+   With a load model, the layout of the files is planned before */
+static int
+write_files(image_type type, unsigned char *image, imagefile *files, int num_files, int usedirtrack, int dirtracksplit, int shadowdirtrack, int numdirblocks, int dir_sector_interleave, bool verify, const load_model *model)
+{
+#ifndef _WIN32
+    if ((model != NULL) && (plan_layout(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave, model) != 0)) {
+        return -1;
+    }
+#else
+    (void)model;
+#endif
+
+    transwarp_plan* plans = (transwarp_plan*)calloc(num_files + 1, sizeof(transwarp_plan));
+    file_source* sources = verify ? (file_source*)calloc(num_files + 1, sizeof(file_source)) : NULL;
+    if ((plans == NULL) || (verify && (sources == NULL))) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        free(plans);
+        return -1;
+    }
+
+    int num_plans = 0;
+    int result = place_files(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave, plans, &num_plans, sources, false);
+    if (result == 0) {
+        result = encode_transwarp_files(type, image, plans, num_plans);
+    }
+    if ((result == 0) && verify) {
+        result = verify_files(type, image, files, num_files, sources, plans, num_plans);
+    }
+
+    for (int i = 0; i < num_plans; i++) {
+        free(plans[i].filedata);
+    }
+    free(plans);
+    if (sources != NULL) {
+        for (int i = 0; i < num_files; i++) {
+            free(sources[i].data);
+        }
+        free(sources);
+    }
+
+    return result;
+}
+
+/* Stores 16 bit value little endian */
+static unsigned char*
+store16(unsigned int value, unsigned char* buffer)
+{
+    buffer[0] = value & 0xff;
+    buffer[1] = (value >> 8) & 0xff;
+
+    return buffer + 2;
+}
+
+/* Stores 32 bit value little endian */
+static unsigned char*
+store32(unsigned int value, unsigned char* buffer)
+{
+    return store16(value >> 16, store16(value, buffer));
+}
+
+/* Returns the speed zone of a track, 3 on the outermost tracks down to 0 */
+static unsigned int
+g64_speed_zone(image_type type, int track)
+{
+    if ((type == IMAGE_D71) && (track > D64NUMTRACKS)) {
+        track -= D64NUMTRACKS;
+    }
+    return (track <= 17) ? 3 : (track <= 24) ? 2 : (track <= 30) ? 1 : 0;
+}
+
+/* Number of GCR bytes on a track of the given speed zone */
+static int
+g64_track_bytes(unsigned int zone)
+{
+    static const int track_bytes[] = { 6250, 6666, 7142, 7692 };
+    return track_bytes[zone];
+}
+
+/* Returns the gap behind each sector header, high density tracks only fit their extra sector with a short gap */
+static int
+g64_header_gap(const image_options* options)
+{
+    if (options->header_gap >= 0) {
+        return options->header_gap;
+    }
+    return (options->type == IMAGE_D64_HIGH_DENSITY) ? 2 : 9;
+}
+
+/* Returns the half track entry of a track in the G64 or G71 track table */
+static int
+g64_half_track(image_type type, int track)
+{
+    if ((type == IMAGE_D71) && (track > D64NUMTRACKS)) {
+        return G71SIDEHALFTRACKS + (track - D64NUMTRACKS - 1) * 2;
+    }
+    return (track - 1) * 2;
+}
+
+/* Writes image as G64 file, or as G71 file for D71 images, each track is assembled in memory and written at once.
+   Compact files store each track at its real length instead of padding it to the longest track.
+   The gap behind each header and, if set, behind each data block and the skew between tracks come from the options */
+static int
+generate_uniformat_g64(const image_options* options, unsigned char* image, const char *imagepath)
+{
+    image_type type = options->type;
+    bool compact = options->compact_g64;
+
+    /* the image itself may also go to stdout as "-.g64" or "-.g71", the G64 image of -g only as "-" */
+    bool to_stdout = (imagepath == options->imagepath) ? is_stdio_path(imagepath) : (strcmp(imagepath, "-") == 0);
+    FILE* f = to_stdout ? job->output : fopen(imagepath, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file %s for writing\n", imagepath);
+        return -1;
+    }
+
+    generate_gcr_tables();
+
+    const int num_tracks = image_num_tracks(type);
+    const int num_half_tracks = (type == IMAGE_D71) ? (2 * G71SIDEHALFTRACKS) : (num_tracks * 2);
+    const int track_size = 7692; /* = track_bytes on tracks 1..17 */
+
+    unsigned int track_offsets[2 * G71SIDEHALFTRACKS] = { 0 };
+    unsigned int speed_zones[2 * G71SIDEHALFTRACKS] = { 0 };
+    unsigned int track_offset = 8 + 4 + (num_half_tracks * 4 * 2); /* behind signature, version, track count, size and tables */
+    for (int track = 1; track <= num_tracks; ++track) {
+        int half_track = g64_half_track(type, track);
+        track_offsets[half_track] = track_offset;
+        speed_zones[half_track] = g64_speed_zone(type, track);
+        track_offset += 2 + (compact ? g64_track_bytes(speed_zones[half_track]) : track_size);
+    }
+
+    unsigned char header[8 + 4 + (2 * G71SIDEHALFTRACKS * 4 * 2)];
+    memcpy(header, (type == IMAGE_D71) ? "GCR-1571" : "GCR-1541", 8);
+    unsigned char* p = header + 8;
+    *p++ = 0; /* version */
+    *p++ = num_half_tracks;
+    p = store16(track_size, p);
+    for (int half_track = 0; half_track < num_half_tracks; ++half_track) {
+        p = store32(track_offsets[half_track], p);
+    }
+    for (int half_track = 0; half_track < num_half_tracks; ++half_track) {
+        p = store32(speed_zones[half_track], p);
+    }
+
+    size_t header_size = p - header;
+    bool ok = (fwrite(header, 1, header_size, f) == header_size);
+
+    const unsigned char sync[] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+    const unsigned char gap = 0x55;
+    const int header_gcr_size = 10;
+    const int data_gcr_size = 325;
+    const int header_gap = g64_header_gap(options);
+
+    const int block_size =
         (sizeof sync)
-        + (sizeof header_gcr)
-        + (sizeof gap)
+        + header_gcr_size
+        + header_gap
         + (sizeof sync)
-        + 325; /* data */
+        + data_gcr_size;
 
     const char id[3] = { '2', 'A', '\0' };
 
     bool is_uniform = true;
 
-    for (int track = 0; track < (num_tracks >> 1); ++track) {
-        int track_bytes = 0;
-        int num_sectors = sectors_per_track[track];
-        switch (num_sectors) {
-        case 21:
-            track_bytes = 7692;
-            break; /* = track_size */
-        case 19:
-            track_bytes = 7142;
-            break;
-        case 18:
-            track_bytes = 6666;
-            break;
-        case 17:
-            track_bytes = 6250;
-            break;
-        }
+    unsigned char track_buffer[2 + 7692];
+    unsigned char skewed[7692];
+    double angle = 0.0; /* of sector 0 on the current track, in revolutions */
 
-        filepos += write16(track_bytes, f);
-        size_t track_begin = filepos;
+    for (int track = 1; ok && (track <= num_tracks); ++track) {
+        int sectors = num_sectors(type, track);
+        int track_bytes = g64_track_bytes(g64_speed_zone(type, track));
 
-        int data_bytes = num_sectors * block_size;
-        int gap_size = (track_bytes - data_bytes) / num_sectors;
-        if (gap_size < 0) {
-            printf("\nERROR: Track too small for G64 output\n");
-            fclose(f);
+        if ((type == IMAGE_D71) && (track == D64NUMTRACKS + 1)) {
+            angle = 0.0; /* the other side starts aligned again */
+        } else if (track > 1) {
+            /* like the allocator, count the skew in sectors of the track stepped to */
+            angle += (double)options->g64_skew / sectors;
+            while (angle >= 1.0) {
+                angle -= 1.0;
+            }
+            while (angle < 0.0) {
+                angle += 1.0;
+            }
+        }
+
+        unsigned char* track_begin = store16(track_bytes, track_buffer);
+        p = track_begin;
 
+        int data_bytes = sectors * block_size;
+        int gap_size = (options->data_gap >= 0) ? options->data_gap : (track_bytes - data_bytes) / sectors;
+        if ((track_bytes - data_bytes) < (gap_size * sectors) || (gap_size < 0)) {
+            fprintf(stderr, "ERROR: %d sectors do not fit on track %d of %s with these gaps\n", sectors, track, imagepath);
+            if (f != job->output) {
+                fclose(f);
+            }
             return -1;
         }
 
-        float average_gap_remainder = (((float) (track_bytes - data_bytes)) / num_sectors) - gap_size;
-        if (average_gap_remainder >= 1.0f) {
-            average_gap_remainder = 0.0f; /* 0..1 */
+        float average_gap_remainder = 0.0f;
+        if (options->data_gap < 0) {
+            /* spread the remaining bytes over all data gaps */
+            average_gap_remainder = (((float) (track_bytes - data_bytes)) / sectors) - gap_size;
+            if (average_gap_remainder >= 1.0f) {
+                average_gap_remainder = 0.0f; /* 0..1 */
+            }
         }
 
         float remainder = 0.0f;
-        for (int sector = 0; sector < num_sectors; ++sector) {
+        for (int sector = 0; sector < sectors; ++sector) {
             unsigned int gap_bytes = gap_size;
             remainder += average_gap_remainder;
             if (remainder >= 0.5f) {
@@ -3654,69 +5064,69 @@ generate_uniformat_g64(unsigned char* image, const char *imagepath)
                 ++gap_bytes;
             }
 
-            filepos += fwrite(sync, 1, sizeof sync, f);
-            char header[8] = {
+            memcpy(p, sync, sizeof sync);
+            p += sizeof sync;
+            unsigned char sector_header[8] = {
                 0x08, /* header ID */
-                (char) (sector ^ (track + 1) ^ id[1] ^ id[0]), /* checksum */
-                (char) sector,
-                (char) (track + 1),
-                id[1],
-                id[0],
+                (unsigned char) (sector ^ track ^ id[1] ^ id[0]), /* checksum */
+                (unsigned char) sector,
+                (unsigned char) track,
+                (unsigned char) id[1],
+                (unsigned char) id[0],
                 0x0f, 0x0f
             };
 
-            encode_4_bytes_gcr(header, header_gcr);
-            encode_4_bytes_gcr(header + 4, header_gcr + 5);
+            encode_gcr(sector_header, sizeof sector_header, p);
+            p += header_gcr_size;
+            memset(p, gap, header_gap);
+            p += header_gap;
 
-            filepos += fwrite(header_gcr, 1, sizeof header_gcr, f);
-            filepos += fwrite(gap, 1, sizeof gap, f);
+            memcpy(p, sync, sizeof sync);
+            p += sizeof sync;
 
-            filepos += fwrite(sync, 1, sizeof sync, f);
+            encode_gcr_data_block(image, p);
+            p += data_gcr_size;
 
-            char group[5];
-
-            char checksum = image[0] ^ image[1] ^ image[2];
-            char data[4] = { 0x07, (char) image[0], (char) image[1], (char) image[2] };
-            encode_4_bytes_gcr(data, group);
-            filepos += fwrite(group, 1, sizeof group, f);
-            for (int i = 0; i < 0x3f; ++i) {
-                data[0] = image[(i * 4) + 3];
-                data[1] = image[(i * 4) + 4];
-                data[2] = image[(i * 4) + 5];
-                data[3] = image[(i * 4) + 6];
-                encode_4_bytes_gcr(data, group);
-                filepos += fwrite(group, 1, sizeof group, f);
-                checksum ^= (data[0] ^ data[1] ^ data[2] ^ data[3]);
-            }
-            data[0] = image[0xff];
-            data[1] = data[0] ^ checksum;
-            data[2] = 0;
-            data[3] = 0;
-            encode_4_bytes_gcr(data, group);
-            filepos += fwrite(group, 1, sizeof group, f);
-
-            for (int i = gap_bytes; i > 0; --i) {
-                filepos += fwrite(gap, 1, 1, f);
-            }
+            memset(p, gap, gap_bytes);
+            p += gap_bytes;
 
             image += 0x0100;
         } /* for each sector */
 
-        size_t tail_gap = track_bytes - filepos + track_begin;
+        size_t tail_gap = track_bytes - (p - track_begin);
         if (tail_gap > 0) {
-            for (size_t i = tail_gap; i > 0; --i) {
-                filepos += fwrite(gap, 1, 1, f);
-            }
+            memset(p, gap, tail_gap);
+            p += tail_gap;
 
             is_uniform = false;
         }
 
-        for (int i = (track_size - track_bytes); i > 0; --i) {
-            filepos += fwrite(sync, 1, 1, f);
+        int skew_bytes = (int)(angle * track_bytes + 0.5) % track_bytes;
+        if (skew_bytes > 0) {
+            /* rotate the track, so that sector 0 starts at its angle */
+            memcpy(skewed + skew_bytes, track_begin, track_bytes - skew_bytes);
+            memcpy(skewed, track_begin + track_bytes - skew_bytes, skew_bytes);
+            memcpy(track_begin, skewed, track_bytes);
+        }
+
+        if (!compact) {
+            memset(p, sync[0], track_size - track_bytes);
+            p += track_size - track_bytes;
         }
+
+        ok = (fwrite(track_buffer, 1, p - track_buffer, f) == (size_t)(p - track_buffer));
     } /* for each track */
 
-    fclose(f);
+    if (f == job->output) {
+        ok &= (fflush(f) == 0);
+    } else {
+        ok &= (fclose(f) == 0);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: Failed to write %s\n", imagepath);
+        return -1;
+    }
 
     if (!is_uniform) {
         printf("\nWARNING: \"%s\" is not UniFormAt'ed\n", imagepath);
@@ -3725,9 +5135,211 @@ generate_uniformat_g64(unsigned char* image, const char *imagepath)
     return 0;
 }
 
+/* Returns the 8 bits starting at the given bit position of a circular GCR track */
+static unsigned char
+gcr_track_byte(const unsigned char* data, int length, int bit)
+{
+    int offset = (bit >> 3) % length;
+    unsigned int value = (data[offset] << 8) | data[(offset + 1) % length];
+    return (unsigned char)(value >> (8 - (bit & 7)));
+}
+
+/* Copies the GCR bytes starting at the given bit position of a circular GCR track */
+static void
+gcr_track_bytes(const unsigned char* data, int length, int bit, unsigned char* out, int count)
+{
+    for (int i = 0; i < count; ++i, bit += 8) {
+        out[i] = gcr_track_byte(data, length, bit);
+    }
+}
+
+/* Decodes the sectors of a GCR track into the image, sets found for each sector with a valid data block
+   and checksum_error for data blocks that did not match their checksum.
+   Returns the number of valid sector headers beyond the sectors of the track in this image type */
+static int
+read_gcr_track(image_type type, unsigned char* image, int track, const unsigned char* data, int length, bool found[], bool checksum_error[])
+{
+    int num_bits = length * 8;
+
+    /* start behind a 0 bit, so that no sync wraps around */
+    int start = 0;
+    while ((start < num_bits) && ((gcr_track_byte(data, length, start) & 0x80) != 0)) {
+        ++start;
+    }
+    if (start == num_bits) {
+        return 0;
+    }
+
+    /* two revolutions at most, so that blocks behind the start are read as well */
+    int ones = 0;
+    int sector = -1;
+    int num_found = 0;
+    int num_extra = 0;
+    for (int bit = start; (bit < start + 2 * num_bits) && (num_found < num_sectors(type, track)); ++bit) {
+        if ((gcr_track_byte(data, length, bit) & 0x80) != 0) {
+            ++ones;
+            continue;
+        }
+        if (ones < 10) {
+            ones = 0;
+            continue;
+        }
+        ones = 0;
+
+        /* a block starts behind the sync */
+        unsigned char gcr[325];
+        unsigned char block[260];
+        gcr_track_bytes(data, length, bit, gcr, 5);
+        bool ok = decode_gcr(gcr, 5, block);
+        if (ok && (block[0] == 0x08)) {
+            gcr_track_bytes(data, length, bit, gcr, 10);
+            ok = decode_gcr(gcr, 10, block);
+            bool valid = ok && (block[1] == (block[2] ^ block[3] ^ block[4] ^ block[5])) && (block[3] == track);
+            if (valid && (block[2] >= num_sectors(type, track))) {
+                ++num_extra;
+                valid = false;
+            }
+            sector = valid ? block[2] : -1;
+            if (ok) {
+                bit += 10 * 8 - 1; /* valid GCR never contains a sync */
+            }
+        } else if (ok && (block[0] == 0x07) && (sector >= 0)) {
+            gcr_track_bytes(data, length, bit, gcr, sizeof gcr);
+            ok = decode_gcr(gcr, sizeof gcr, block);
+            unsigned char checksum = 0;
+            for (int i = 1; i <= BLOCKSIZE; ++i) {
+                checksum ^= block[i];
+            }
+            if (ok && (checksum == block[BLOCKSIZE + 1]) && !found[sector]) {
+                int offset = linear_sector(type, track, sector) * BLOCKSIZE;
+                memcpy(image + offset, block + 1, BLOCKSIZE);
+                found[sector] = true;
+                ++num_found;
+                checksum_error[sector] = false;
+            } else if (!found[sector]) {
+                checksum_error[sector] = true;
+            }
+            if (ok) {
+                bit += (int)sizeof gcr * 8 - 1;
+            }
+            sector = -1;
+        }
+    }
+
+    return num_extra;
+}
+
+/* Returns the data of a half track in a G64 or G71 image and sets its length, or NULL if the half track is missing */
+static const unsigned char*
+gcr_track_data(const unsigned char* gcr, size_t size, int half_track, int* length)
+{
+    size_t entry = 12 + half_track * 4;
+    unsigned int offset = 0;
+    if ((half_track < gcr[9]) && (entry + 4 <= size)) {
+        offset = gcr[entry] | (gcr[entry + 1] << 8) | (gcr[entry + 2] << 16) | ((unsigned int)gcr[entry + 3] << 24);
+    }
+    if ((offset > 0) && (offset + 2 <= size)) {
+        *length = gcr[offset] | (gcr[offset + 1] << 8);
+        if ((*length > 0) && (offset + 2 + *length <= size)) {
+            return gcr + offset + 2;
+        }
+    }
+    return NULL;
+}
+
+/* Reads a G64 file, or a G71 file for D71 images, into the sector image.
+   Sectors that are missing or have checksum errors are reported and left empty */
+static int
+read_gcr_image(image_type type, unsigned char* image, FILE* f, const char* imagepath)
+{
+    generate_gcr_tables();
+
+    unsigned char* gcr = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
+    while (!feof(f) && !ferror(f)) {
+        if (size == capacity) {
+            capacity = capacity ? capacity * 2 : 0x40000;
+            unsigned char* grown = (unsigned char*)realloc(gcr, capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "ERROR: Memory allocation error\n");
+                free(gcr);
+                return -1;
+            }
+            gcr = grown;
+        }
+        size += fread(gcr + size, 1, capacity - size, f);
+    }
+
+    const char* signature = (type == IMAGE_D71) ? "GCR-1571" : "GCR-1541";
+    if (ferror(f) || (size < 12) || (memcmp(gcr, signature, 8) != 0)) {
+        fprintf(stderr, "ERROR: %s is not a %s file\n", imagepath, (type == IMAGE_D71) ? "G71" : "G64");
+        free(gcr);
+        return -1;
+    }
+
+    /* the tracks of a 40 track image would be dropped silently */
+    if (type == IMAGE_D64) {
+        unsigned char* extended = (unsigned char*)calloc(image_size(IMAGE_D64_EXTENDED_SPEED_DOS), 1);
+        if (extended == NULL) {
+            fprintf(stderr, "ERROR: Memory allocation error\n");
+            free(gcr);
+            return -1;
+        }
+        for (int track = D64NUMTRACKS + 1; track <= (int)image_num_tracks(IMAGE_D64_EXTENDED_SPEED_DOS); ++track) {
+            bool found[SECTORSPERTRACK_D81] = { false };
+            bool checksum_error[SECTORSPERTRACK_D81] = { false };
+            int length;
+            const unsigned char* data = gcr_track_data(gcr, size, g64_half_track(type, track), &length);
+            if (data != NULL) {
+                read_gcr_track(IMAGE_D64_EXTENDED_SPEED_DOS, extended, track, data, length, found, checksum_error);
+            }
+            for (int sector = 0; sector < num_sectors(IMAGE_D64_EXTENDED_SPEED_DOS, track); ++sector) {
+                if (found[sector] || checksum_error[sector]) {
+                    fprintf(stderr, "ERROR: %s has sectors on track %d, use -4 or -5 for 40 track images\n", imagepath, track);
+                    free(extended);
+                    free(gcr);
+                    return -1;
+                }
+            }
+        }
+        free(extended);
+    }
+
+    int num_errors = 0;
+    int num_extra = 0;
+    for (int track = 1; track <= (int)image_num_tracks(type); ++track) {
+        bool found[SECTORSPERTRACK_D81] = { false };
+        bool checksum_error[SECTORSPERTRACK_D81] = { false };
+
+        int length;
+        const unsigned char* data = gcr_track_data(gcr, size, g64_half_track(type, track), &length);
+        if (data != NULL) {
+            num_extra += read_gcr_track(type, image, track, data, length, found, checksum_error);
+        }
+
+        for (int sector = 0; sector < num_sectors(type, track); ++sector) {
+            if (!found[sector]) {
+                printf("WARNING: %s on t%d/s%d in %s\n", checksum_error[sector] ? "Checksum error" : "Missing sector", track, sector, imagepath);
+                ++num_errors;
+            }
+        }
+    }
+    free(gcr);
+
+    if (num_extra > 0) {
+        fprintf(stderr, "ERROR: %s has more sectors per track than the image type, use -X for high density layouts\n", imagepath);
+        return -1;
+    }
+    if (num_errors > 0) {
+        printf("WARNING: %d sectors of %s could not be read\n", num_errors, imagepath);
+    }
+    return 0;
+}
+
 /* Generates a unique filename, either based on the proposed name, or using track and sector. */
 static void
-generate_unique_filename(image_type type, unsigned char *image, unsigned char *name, int track, int sector, int start, char marker)
+generate_unique_filename(unsigned char *image, unsigned char *name, int track, int sector, int start, char marker)
 {
     int i, t, s, o;
     if(name[0] == 0xa0 || name[0] == 0) {
@@ -3754,7 +5366,7 @@ generate_unique_filename(image_type type, unsigned char *image, unsigned char *n
     int appendix = 1;
     int appendix_len = 2;
     int namelen = pstrlen(name);
-    while(find_existing_file(type, image, name, &i, &t, &s, &o)) {
+    while(find_existing_file(image, name, &i, &t, &s, &o)) {
         marker_pos = namelen + appendix_len;
         if(marker_pos > FILENAMEMAXSIZE-1) {
             marker_pos = FILENAMEMAXSIZE-1;
@@ -3864,39 +5476,29 @@ validate_sector_chain(image_type type, unsigned char* image, char* atab, unsigne
 static void
 init_atab(image_type type, unsigned char* image, char* atab)
 {
-    int dt = dirtrack(type);
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int offset = 0;
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
-
-    do {
-        int db = linear_sector(type, dt, ds);
-        atab[db] = ALLOCATED;
-        int filetype = image[db * BLOCKSIZE + offset + FILETYPEOFFSET] & 0xf;
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        int entry = job->image_dir.entries[i].offset;
+        atab[entry / BLOCKSIZE] = ALLOCATED;
+        int filetype = image[entry + FILETYPEOFFSET] & 0xf;
         if(filetype != FILETYPEDEL) {
-            int track = image[db * BLOCKSIZE + offset + FILETRACKOFFSET];
-            int sector = image[db * BLOCKSIZE + offset + FILESECTOROFFSET];
+            int track = image[entry + FILETRACKOFFSET];
+            int sector = image[entry + FILESECTOROFFSET];
             unsigned int last_track;
             int last_sector;
             int error = validate_sector_chain(type, image, atab, track, sector, &last_track, &last_sector);
             if(error != VALID) {
                 printf("WARNING: file ");
-                print_filename(stdout, &image[db * BLOCKSIZE + offset + FILENAMEOFFSET]);
+                print_filename(stdout, &image[entry + FILENAMEOFFSET]);
                 printf(" seems corrupt (%s)\n", error_name[error]);
             }
             mark_sector_chain(type, image, atab, track, sector, last_track, last_sector, ALLOCATED);
         }
-    } while(next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
+    }
 }
 
-/* Write atab into BAM */
+/* Write atab into the allocation map */
 static void
-write_atab(image_type type, unsigned char* image, char* atab)
+write_atab(image_type type, char* atab)
 {
     for(unsigned int t = 1; t <= image_num_tracks(type); t++) {
         for(int s = 0; s < num_sectors(type, t); s++) {
@@ -3904,7 +5506,7 @@ write_atab(image_type type, unsigned char* image, char* atab)
             int free = (atab[b] == UNALLOCATED);
             if(!free) {
                 /* keep allocated BAM entries, only add new ones */
-                mark_sector(type, image, t, s, 0);
+                mark_sector(type, t, s, 0);
             }
         }
     }
@@ -3936,9 +5538,10 @@ undelete_file(image_type type, unsigned char* image, int dt, int ds, int offset,
         name[16] = 0;
         int b = linear_sector(type, track, sector);
         int address = image[b * BLOCKSIZE + 2] + 256 * image[b * BLOCKSIZE + 3];
-        generate_unique_filename(type, image, name, track, sector, address, marker);
+        generate_unique_filename(image, name, track, sector, address, marker);
         memcpy(&image[dirblock + offset + FILENAMEOFFSET], &name, 16);
         image[dirblock + offset + FILETYPEOFFSET] = 0x82; /* original file type is lost, use closed PRG instead */
+        dir_sync_offset(image, dirblock + offset);
         mark_sector_chain(type, image, atab, track, sector, last_track, last_sector, ALLOCATED);
         if(level != RESTORE_DIR_ONLY) {
             int size = count_blocks(type, image, track, sector);
@@ -3953,7 +5556,7 @@ undelete_file(image_type type, unsigned char* image, int dt, int ds, int offset,
     return false;
 }
 
-/* search for scratched directory entries and restore them */
+/* search for scratched directory entries and restore them, returns -1 on error */
 static int
 undelete(image_type type, unsigned char* image, char* atab, int level)
 {
@@ -3964,15 +5567,12 @@ undelete(image_type type, unsigned char* image, char* atab, int level)
     int num_undeleted = 0;
     int final_dt, final_ds; /* last linked directory sector and track */
     char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
-
     bool* searched = calloc(nsectors, sizeof(bool));
-    if(searched == NULL) {
-        fprintf(stderr, "ERROR: error allocating memory");
-        exit(-1);
+    if(blockmap == NULL || searched == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        free(blockmap);
+        free(searched);
+        return -1;
     }
 
     /* go through directory sector chain */
@@ -3983,7 +5583,7 @@ undelete(image_type type, unsigned char* image, char* atab, int level)
         final_dt = dt;
         final_ds = ds;
         int db = linear_sector(type, dt, ds);
-        mark_sector(type, image, dt, ds, 0); /* needs to be updated in BAM, so that dir allocation works correctly later */
+        mark_sector(type, dt, ds, 0); /* needs to be updated in BAM, so that dir allocation works correctly later */
         atab[db] = ALLOCATED;
         int dirblock = db * BLOCKSIZE;
         int filetype = image[dirblock + offset + FILETYPEOFFSET];
@@ -4006,7 +5606,7 @@ undelete(image_type type, unsigned char* image, char* atab, int level)
             }
             if(found) {
                 num_undeleted += 8;
-                if(!quiet) {
+                if(!job->quiet) {
                     printf("Relinking directory sector %d\n", ds);
                 }
                 /* link found dir sector */
@@ -4019,19 +5619,20 @@ undelete(image_type type, unsigned char* image, char* atab, int level)
                 image[block_offset + TRACKLINKOFFSET] = 0;
                 final_dt = dt;
                 final_ds = ds;
-                mark_sector(type, image, dt, ds, 0); /* needs to be updated in BAM, so that dir allocation works correctly later */
+                mark_sector(type, dt, ds, 0); /* needs to be updated in BAM, so that dir allocation works correctly later */
                 atab[db] = ALLOCATED;
             }
         }
     }
     free(searched);
-    write_atab(type, image, atab);
+    write_atab(type, atab);
+    dir_parse(type, image); /* entries and dir sector links were changed */
     return num_undeleted;
 }
 
-/* add new DIR entries for wild chains */
-static void
-add_wild_to_dir(image_type type, unsigned char* image, char* atab, imagefile files[])
+/* add new DIR entries for wild chains, returns -1 if the directory is full */
+static int
+add_wild_to_dir(image_type type, unsigned char* image, char* atab)
 {
     /* create a DIR entry for each FILESTART */
     for(unsigned int t = 1; t <= image_num_tracks(type); t++) {
@@ -4043,7 +5644,9 @@ add_wild_to_dir(image_type type, unsigned char* image, char* atab, imagefile fil
                 name[0] = 0xa0;
                 int dir_index, dir_sector, dir_offset;
                 atab[b] = ALLOCATED;
-                new_dir_slot(type, image, (type == IMAGE_D81 ? 1 : 3), 0, &dir_index, &dir_sector, &dir_offset, files); /* TODO: handle full directory more gracefully */
+                if (new_dir_slot(type, image, (type == IMAGE_D81 ? 1 : 3), 0, &dir_index, &dir_sector, &dir_offset) != 0) {
+                    return -1;
+                }
                 int db = linear_sector(type, dirtrack(type), dir_sector);
                 atab[db] = ALLOCATED; /* make sure that potentially new dir block is marked as used */
                 int offset = db * BLOCKSIZE + dir_offset;
@@ -4051,20 +5654,23 @@ add_wild_to_dir(image_type type, unsigned char* image, char* atab, imagefile fil
                 image[offset + FILETRACKOFFSET] = t;
                 image[offset + FILESECTOROFFSET] = s;
                 image[offset + FILENAMEOFFSET] = 0xa0; /* no proposed filename */
+                dir_sync_entry(image, dir_index);
                 int address = image[b * BLOCKSIZE + 2] + 256 * image[b * BLOCKSIZE + 3];
-                generate_unique_filename(type, image, name, t, s, address, marker);
+                generate_unique_filename(image, name, t, s, address, marker);
                 memcpy(&image[offset + FILENAMEOFFSET], name, 16);
+                dir_sync_entry(image, dir_index);
                 int size = count_blocks(type, image, t, s);
                 image[offset + FILEBLOCKSHIOFFSET] = size / 256;
                 image[offset + FILEBLOCKSLOOFFSET] = size % 256;
             }
         }
     }
+    return 0;
 }
 
-/* search for wild valid chains of unallocated sectors */
+/* search for wild valid chains of unallocated sectors, returns -1 on error */
 static int
-undelete_wild(image_type type, unsigned char* image, char* atab, int level, imagefile files[])
+undelete_wild(image_type type, unsigned char* image, char* atab, int level)
 {
     int num_undeleted = 0;
     int max_bam_sector = (type == IMAGE_D81) ? 2 : 0;
@@ -4125,15 +5731,17 @@ undelete_wild(image_type type, unsigned char* image, char* atab, int level, imag
         }
     }
     if(num_undeleted) {
-        write_atab(type, image, atab);
-        add_wild_to_dir(type, image, atab, files);
+        write_atab(type, atab);
+        if (add_wild_to_dir(type, image, atab) != 0) {
+            return -1;
+        }
     }
     return num_undeleted;
 }
 
-/* search for wild invalid chains of unallocated sectors and fix them */
+/* search for wild invalid chains of unallocated sectors and fix them, returns -1 on error */
 static int
-undelete_fix_wild(image_type type, unsigned char* image, char* atab, imagefile files[])
+undelete_fix_wild(image_type type, unsigned char* image, char* atab)
 {
     int num_undeleted = 0;
     int max_bam_sector = (type == IMAGE_D81) ? 2 : 0;
@@ -4169,63 +5777,69 @@ undelete_fix_wild(image_type type, unsigned char* image, char* atab, imagefile f
         }
     }
     if(num_undeleted) {
-        write_atab(type, image, atab);
-        add_wild_to_dir(type, image, atab, files);
+        write_atab(type, atab);
+        if (add_wild_to_dir(type, image, atab) != 0) {
+            return -1;
+        }
     }
     return num_undeleted;
 }
 
-/* Tries to restore any deleted or formatted files */
-static void
-restore(image_type type, unsigned char* image, int level, imagefile files[])
+/* Tries to restore any deleted or formatted files, returns -1 on error */
+static int
+restore(image_type type, unsigned char* image, int level)
 {
-    int num_undeleted = 0;
     /* create block allocation table */
     char *atab = (char *)calloc(image_num_blocks(type), sizeof(char));
     if (atab == NULL) {
-        fprintf(stderr, "ERROR: error allocating memory");
-        exit(-1);
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        return -1;
     }
     init_atab(type, image, atab);
+    int steps[5];
+    int num_steps = 0;
     if(level == RESTORE_DIR_ONLY) {
-        num_undeleted += undelete(type, image, atab, RESTORE_DIR_ONLY);
+        steps[num_steps++] = undelete(type, image, atab, RESTORE_DIR_ONLY);
     } else {
-        num_undeleted += undelete(type, image, atab, RESTORE_VALID_FILES);
-        if(level >= RESTORE_VALID_CHAINS) {
-            num_undeleted += undelete_wild(type, image, atab, RESTORE_VALID_CHAINS, files);
+        steps[num_steps++] = undelete(type, image, atab, RESTORE_VALID_FILES);
+        if(level >= RESTORE_VALID_CHAINS && steps[num_steps - 1] >= 0) {
+            steps[num_steps++] = undelete_wild(type, image, atab, RESTORE_VALID_CHAINS);
         }
-        if(level >= RESTORE_INVALID_FILES) {
-            num_undeleted += undelete(type, image, atab, RESTORE_INVALID_FILES);
+        if(level >= RESTORE_INVALID_FILES && steps[num_steps - 1] >= 0) {
+            steps[num_steps++] = undelete(type, image, atab, RESTORE_INVALID_FILES);
         }
-        if(level >= RESTORE_INVALID_CHAINS) {
-            num_undeleted += undelete_fix_wild(type, image, atab, files);
+        if(level >= RESTORE_INVALID_CHAINS && steps[num_steps - 1] >= 0) {
+            steps[num_steps++] = undelete_fix_wild(type, image, atab);
         }
-        if(level >= RESTORE_INVALID_SINGLES) {
-            num_undeleted += undelete_wild(type, image, atab, RESTORE_INVALID_SINGLES, files);
+        if(level >= RESTORE_INVALID_SINGLES && steps[num_steps - 1] >= 0) {
+            steps[num_steps++] = undelete_wild(type, image, atab, RESTORE_INVALID_SINGLES);
         }
     }
     free(atab);
+    int num_undeleted = 0;
+    for (int i = 0; i < num_steps; i++) {
+        if (steps[i] < 0) {
+            return -1;
+        }
+        num_undeleted += steps[i];
+    }
     if(num_undeleted) {
-        modified = 1;
+        job->modified = 1;
     }
-    if(!quiet) {
+    if(!job->quiet) {
         printf("%d files undeleted", num_undeleted);
         if(num_undeleted) {
             printf(", '<' at filename end marks truncated files");
         }
         printf("\n");
     }
+    return 0;
 }
 
 /* Prints a command line to create dir art like the given image */
 static void
 convert_to_commandline(image_type type, unsigned char* image)
 {
-    char *blockmap = calloc(image_num_blocks(type), sizeof(char));
-    if(blockmap == NULL) {
-        fprintf(stderr, "ERROR: Memory allocation error\n");
-        exit(-1);
-    }
     printf("\nCommandline to create directory art: -m -n \"");
     unsigned int bam = linear_sector(type, dirtrack(type), 0) * BLOCKSIZE;
     print_filename_with_escapes(image + bam + get_header_offset(type), FILENAMEMAXSIZE);
@@ -4233,11 +5847,8 @@ convert_to_commandline(image_type type, unsigned char* image)
     print_filename_with_escapes(image + bam + get_id_offset(type), 5);
     printf("\" ");
 
-    int ds = (type == IMAGE_D81) ? 3 : 1;
-    int dt = dirtrack(type);
-    int offset = 0;
-    do {
-        int dirblock = linear_sector(type, dt, ds) * BLOCKSIZE + offset;
+    for (int i = 0; i < job->image_dir.num_entries; i++) {
+        int dirblock = job->image_dir.entries[i].offset;
         int filetype = image[dirblock + FILETYPEOFFSET];
         if (filetype) {
             if(filetype != 0x82) {
@@ -4252,56 +5863,66 @@ convert_to_commandline(image_type type, unsigned char* image)
             print_filename_with_escapes(filename, FILENAMEMAXSIZE);
             printf("\" -L ");
         }
-    } while (next_dir_entry(type, image, &dt, &ds, &offset, blockmap));
-    free(blockmap);
+    }
     printf("\n\n");
 }
 
-/* Performs strict CBM DOS validation on the image */
-static void
+/* Performs strict CBM DOS validation on the image, returns -1 if it fails */
+static int
 validate(image_type type, unsigned char* image)
 {
     /* create block allocation table */
     char *atab = (char *)calloc(image_num_blocks(type), sizeof(int));
     if (atab == NULL) {
         fprintf(stderr, "ERROR: error allocating memory");
-        exit(-1);
+        return -1;
     }
     /* check format specifier */
     int format = image[linear_sector(type, dirtrack(type), 0) * BLOCKSIZE + 2];
     if (format != 0x41) {
         fprintf(stderr, "ERROR: validation failed, format specifier in directory (0x%02x) does not specify 1541 (0x41)\n", format);
-        exit(-1);
+        free(atab);
+        return -1;
     }
     /* check each directory entry and set block allocation table */
-    atab[linear_sector(type, dirtrack(type), 0)] = ALLOCATED;
+    atab[geometry[type].first_block[dirtrack(type)]] = ALLOCATED;
     unsigned int dt = dirtrack(type);
     int dirsector = 1;
     unsigned int start_track = 1;
     while (start_track != 0) {
-        atab[linear_sector(type, dt, dirsector)] = ALLOCATED;
-        int dirblock = linear_sector(type, dt, dirsector) * BLOCKSIZE;
+        int db = linear_sector(type, dt, dirsector);
+        if (db < 0) {
+            fprintf(stderr, "ERROR: validation failed, illegal track or sector in directory sector chain (track %u, sector %d)\n", dt, dirsector);
+            free(atab);
+            return -1;
+        }
+        atab[db] = ALLOCATED;
+        int dirblock = db * BLOCKSIZE;
         for (int direntry = 0; direntry < DIRENTRIESPERBLOCK; direntry++) {
             int entryOffset = direntry * DIRENTRYSIZE;
             int filetype = image[dirblock + entryOffset + FILETYPEOFFSET] & 0xf;
             if (filetype > 4) {
                 fprintf(stderr, "ERROR: validation failed, illegal file type (0x%02x) in directory\n", filetype);
-                exit(-1);
+                free(atab);
+                return -1;
             }
             if (filetype != 0) { /* skip deleted entries */
                 start_track = image[dirblock + entryOffset + FILETRACKOFFSET];
                 int start_sector = image[dirblock + entryOffset + FILESECTOROFFSET];
                 if (start_track == 0 || start_track > image_num_tracks(type)) {
                     fprintf(stderr, "ERROR: validation failed, illegal track reference (%u) in directory\n", start_track);
-                    exit(-1);
+                    free(atab);
+                    return -1;
                 }
                 if (start_sector >= num_sectors(type, start_track)) {
                     fprintf(stderr, "ERROR: validation failed, illegal sector reference (track %u, sector %d) in directory\n", start_track, start_sector);
-                    exit(-1);
+                    free(atab);
+                    return -1;
                 }
                 if (atab[linear_sector(type, start_track, start_sector)] == ALLOCATED) {
                     fprintf(stderr, "ERROR: validation failed, file starts in the middle of another file (track %u, sector %d)\n", start_track, start_sector);
-                    exit(-1);
+                    free(atab);
+                    return -1;
                 }
                 if (atab[linear_sector(type, start_track, start_sector)] != FILESTART) { /* loop files are allowed */
                     unsigned int error_track;
@@ -4310,17 +5931,21 @@ validate(image_type type, unsigned char* image)
                     switch(result) {
                     case ILLEGAL_TRACK:
                         fprintf(stderr, "ERROR: validation failed, illegal track reference in file sector chain at track %d, sector %d\n", error_track, error_sector);
-                        exit(-1);
+                        free(atab);
+                        return -1;
                     case ILLEGAL_SECTOR:
                         fprintf(stderr, "ERROR: validation failed, illegal sector reference in file sector chain at track %d, sector %d\n", error_track, error_sector);
-                        exit(-1);
+                        free(atab);
+                        return -1;
                     case LOOP:
                         fprintf(stderr, "ERROR: validation failed, loop in file sector chain at track %d, sector %d\n", error_track, error_sector);
-                        exit(-1);
+                        free(atab);
+                        return -1;
                     case COLLISION:
                     case CHAINED:
                         fprintf(stderr, "ERROR: validation failed, collision with existing file in file sector chain at track %d, sector %d\n", error_track, error_sector);
-                        exit(-1);
+                        free(atab);
+                        return -1;
                     }
                     atab[linear_sector(type, start_track, start_sector)] = FILESTART;
                 }
@@ -4335,6 +5960,7 @@ validate(image_type type, unsigned char* image)
     /* check BAM for consistency with block allocation table */
     for (unsigned int t = 1; t <= image_num_tracks(type); t++) {
         unsigned char* bitmap = image + get_bam_offset(type, t);
+        int count = image[geometry[type].bam_count_offset[t]];
         int num_free = 0;
         for (int s = 0; s < num_sectors(type, t); s++) {
             int atab_used = (atab[linear_sector(type, t, s)] != UNALLOCATED);
@@ -4342,52 +5968,52 @@ validate(image_type type, unsigned char* image)
             num_free += (1 - bam_used);
             if (bam_used != atab_used) {
                 fprintf(stderr, "ERROR: validation failed, BAM (%s) is not consistent with files (%s) for track %u sector %d\n", bam_used ? "used" : "free", atab_used ? "used" : "free", t, s);
-                exit(-1);
+                free(atab);
+                return -1;
             }
         }
-        if (*(bitmap - 1) != num_free) {
-            fprintf(stderr, "ERROR: validation failed, BAM number of free blocks (%d) is not consistent with bitmap (%#02x%#02x%#02x) for track %u\n", *(bitmap - 1), *bitmap, *(bitmap + 1), *(bitmap + 2), t);
-            exit(-1);
+        if (count != num_free) {
+            fprintf(stderr, "ERROR: validation failed, BAM number of free blocks (%d) is not consistent with bitmap (%#02x%#02x%#02x) for track %u\n", count, *bitmap, *(bitmap + 1), *(bitmap + 2), t);
+            free(atab);
+            return -1;
         }
     }
     free(atab);
-    if(!quiet) {
+    if(!job->quiet) {
         fprintf(stderr, "CBM DOS validation passed\n");
     }
+    return 0;
 }
 
-int
-main(int argc, char* argv[])
+/* Sets up the default settings for an image of the given type */
+static void
+init_options(image_options* options, image_type type)
 {
-    imagefile files[MAXNUMFILES_D81];
-    memset(files, 0, sizeof files);
-
-    image_type type = IMAGE_D64;
-    char* imagepath = NULL;
-    char* filename_g64 = NULL;
-    unsigned char* header  = (unsigned char*)"cc1541";
-    unsigned char* id      = (unsigned char*)"00 2a";
-    unsigned char* bam_message = NULL;
-    int dirtracksplit = 1;
-    int usedirtrack = 0;
-    unsigned int shadowdirtrack = 0;
+    memset(options, 0, sizeof *options);
+    options->type = type;
+    options->header = (unsigned char*)"cc1541";
+    options->id = (unsigned char*)"00 2a";
+    options->dirtracksplit = 1;
+    options->dir_sector_interleave = (type == IMAGE_D81) ? 1 : 3;
+    options->numdirblocks = 2;
+    options->restore_level = -1;
+    options->header_gap = -1;
+    options->data_gap = -1;
+}
 
+/* Parses command line options into the settings, the image name is expected as last argument if with_image is set */
+static int
+parse_options(int argc, char* argv[], bool with_image, image_options* options)
+{
     int default_first_sector_new_track = 0;
     int first_sector_new_track = 0;
     int defaultSectorInterleave = 10;
     int sectorInterleave = 0;
-    int dir_sector_interleave = 3;
-    int numdirblocks = 2;
     int nrSectorsShown = -1;
     unsigned char* filename = NULL;
-    int set_header = 0;
-    int nooverwrite = 0;
-    int dovalidate = 0;
-    int restore_level = -1;
-    int ignore_collision = 0;
     int filetype = 0x82; /* default is closed PRG */
     bool filetype_set = false;
-    bool print_art_commandline = false;
+    bool stdin_used = false;
 
     /* flags to detect illegal settings for Transwarp or D81 */
     int transwarp_set = 0;
@@ -4396,49 +6022,45 @@ main(int argc, char* argv[])
     int file_start_sector_set = 0;
     int new_track_start_sector_set = 0;
 
-    int retval = 0;
-
     int i, j;
+    int last = with_image ? argc - 1 : argc;
 
-    if (argc == 1 || strcmp(argv[argc-1], "-h") == 0) {
-        usage();
-    }
-    for (j = 1; j < argc - 1; j++) {
+    for (j = 1; j < last; j++) {
         if (strcmp(argv[j], "-n") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -n\n");
                 return -1;
             }
-            header = (unsigned char*)argv[++j];
-            set_header = 1;
-            modified = 1;
+            options->header = (unsigned char*)argv[++j];
+            options->set_header = 1;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-i") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -i\n");
                 return -1;
             }
-            id = (unsigned char*)argv[++j];
-            set_header = 1;
-            modified = 1;
+            options->id = (unsigned char*)argv[++j];
+            options->set_header = 1;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-H") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -H\n");
                 return -1;
             }
-            bam_message = (unsigned char*)argv[++j];
-            set_header = 1;
-            modified = 1;
+            options->bam_message = (unsigned char*)argv[++j];
+            options->set_header = 1;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-M") == 0) {
-            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &max_hash_length)) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &job->max_hash_length)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -M\n");
                 return -1;
             }
-            if ((max_hash_length < 1) || (max_hash_length > FILENAMEMAXSIZE)) {
-                fprintf(stderr, "ERROR: Hash computation maximum filename length %d specified\n", max_hash_length);
+            if ((job->max_hash_length < 1) || (job->max_hash_length > FILENAMEMAXSIZE)) {
+                fprintf(stderr, "ERROR: Hash computation maximum filename length %d specified\n", job->max_hash_length);
                 return -1;
             }
         } else if (strcmp(argv[j], "-m") == 0) {
-            ignore_collision = 1;
+            options->ignore_collision = 1;
         } else if (strcmp(argv[j], "-F") == 0) {
             if ((argc < j + 2) || !sscanf(argv[++j], "%d", &first_sector_new_track)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -F\n");
@@ -4472,9 +6094,9 @@ main(int argc, char* argv[])
             }
             filename = (unsigned char*)argv[++j];
         } else if (strcmp(argv[j], "-e") == 0) {
-            files[num_files].mode |= MODE_SAVETOEMPTYTRACKS;
+            options->files[job->num_files].mode |= MODE_SAVETOEMPTYTRACKS;
         } else if (strcmp(argv[j], "-E") == 0) {
-            files[num_files].mode |= MODE_FITONSINGLETRACK;
+            options->files[job->num_files].mode |= MODE_FITONSINGLETRACK;
         } else if (strcmp(argv[j], "-r") == 0) {
             if ((argc < j + 2) || !sscanf(argv[++j], "%d", &i)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -r\n");
@@ -4484,24 +6106,24 @@ main(int argc, char* argv[])
                 fprintf(stderr, "ERROR: Invalid minimum track %d specified\n",  i);
                 return -1;
             }
-            files[num_files].mode = (files[num_files].mode & ~MODE_MIN_TRACK_MASK) | (i << MODE_MIN_TRACK_SHIFT);
+            options->files[job->num_files].mode = (options->files[job->num_files].mode & ~MODE_MIN_TRACK_MASK) | (i << MODE_MIN_TRACK_SHIFT);
         } else if (strcmp(argv[j], "-b") == 0) {
             if ((argc < j + 2) || !sscanf(argv[++j], "%d", &i)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -b\n");
                 return -1;
             }
-            if ((i < 0) || (i >= num_sectors(type, 1))) {
+            if ((i < 0) || (i >= num_sectors(options->type, 1))) {
                 fprintf(stderr, "ERROR: Invalid beginning sector %d specified\n", i);
                 return -1;
             }
-            files[num_files].mode = (files[num_files].mode & ~MODE_BEGINNING_SECTOR_MASK) | (i + 1);
+            options->files[job->num_files].mode = (options->files[job->num_files].mode & ~MODE_BEGINNING_SECTOR_MASK) | (i + 1);
             file_start_sector_set = 1;
         } else if (strcmp(argv[j], "-c") == 0) {
-            files[num_files].mode |= MODE_SAVECLUSTEROPTIMIZED;
+            options->files[job->num_files].mode |= MODE_SAVECLUSTEROPTIMIZED;
         } else if (strcmp(argv[j], "-o") == 0) {
-            nooverwrite = 1;
+            options->nooverwrite = 1;
         } else if (strcmp(argv[j], "-V") == 0) {
-            dovalidate = 1;
+            options->dovalidate = 1;
         } else if (strcmp(argv[j], "-T") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -T\n");
@@ -4532,31 +6154,80 @@ main(int argc, char* argv[])
         } else if (strcmp(argv[j], "-P") == 0) {
             filetype |= 0x40;
         } else if (strcmp(argv[j], "-N") == 0) {
-            files[num_files].force_new = 1;
+            options->files[job->num_files].force_new = 1;
+        } else if (strcmp(argv[j], "-C") == 0) {
+            options->verify = true;
+        } else if (strcmp(argv[j], "-p") == 0) {
+#ifdef _WIN32
+            fprintf(stderr, "ERROR: -p is not supported on Windows\n");
+            return -1;
+#endif
+            options->model.step_time = 6000;
+            if ((argc < j + 2) || (sscanf(argv[++j], "%d,%d", &options->model.decode_time, &options->model.step_time) < 1)
+                    || (options->model.decode_time < 0) || (options->model.step_time < 0)) {
+                fprintf(stderr, "ERROR: Error parsing argument for -p\n");
+                return -1;
+            }
+            options->plan = true;
+        } else if (strcmp(argv[j], "-D") == 0) {
+            if (argc < j + 2) {
+                fprintf(stderr, "ERROR: Error parsing argument for -D\n");
+                return -1;
+            }
+            if (filename == NULL) {
+                fprintf(stderr, "ERROR: Decoding a Transwarp file requires its filename set with -f\n");
+                return -1;
+            }
+            if (options->num_extracts == MAXNUMFILES_D81) {
+                fprintf(stderr, "ERROR: Too many files to decode\n");
+                return -1;
+            }
+            transwarp_extract* extract = options->extracts + options->num_extracts++;
+            extract->alocalname = argv[++j];
+            if (evalhexescape(filename, extract->pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0) {
+                return -1;
+            }
+            extract->have_key = options->files[job->num_files].have_key;
+            memcpy(extract->key, options->files[job->num_files].key, TRANSWARPKEYSIZE);
+            options->files[job->num_files].have_key = false;
+            filename = NULL;
         } else if (strcmp(argv[j], "-K") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -K\n");
                 return -1;
             }
-            evalhexescape((unsigned char *) argv[++j], files[num_files].key, TRANSWARPKEYSIZE, 0);
-            files[num_files].have_key = true;
+            if (evalhexescape((unsigned char *) argv[++j], options->files[job->num_files].key, TRANSWARPKEYSIZE, 0) != 0) {
+                return -1;
+            }
+            options->files[job->num_files].have_key = true;
         } else if ((strcmp(argv[j], "-w") == 0)
                    || (strcmp(argv[j], "-W") == 0)) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for %s\n", argv[j]);
                 return -1;
             }
-            files[num_files].alocalname = (unsigned char*)argv[j + 1];
+            options->files[job->num_files].alocalname = (unsigned char*)argv[j + 1];
+            if (strcmp(argv[j + 1], "-") == 0) {
+                if (filename == NULL) {
+                    fprintf(stderr, "ERROR: Files read from stdin require a filename set with -f\n");
+                    return -1;
+                }
+                if (stdin_used) {
+                    fprintf(stderr, "ERROR: Only one file can be read from stdin\n");
+                    return -1;
+                }
+                stdin_used = true;
+            }
             if (filename == NULL) {
-                ascii2petscii(basename(files[num_files].alocalname), files[num_files].pfilename, FILENAMEMAXSIZE); /* do not eval escapes when converting the filename, as the local filename could contain the escape char */
-            } else {
-                evalhexescape(filename, files[num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR);
+                ascii2petscii(basename(options->files[job->num_files].alocalname), options->files[job->num_files].pfilename, FILENAMEMAXSIZE); /* do not eval escapes when converting the filename, as the local filename could contain the escape char */
+            } else if (evalhexescape(filename, options->files[job->num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0) {
+                return -1;
             }
-            files[num_files].sectorInterleave = sectorInterleave ? sectorInterleave : defaultSectorInterleave;
-            files[num_files].first_sector_new_track = first_sector_new_track;
-            files[num_files].nrSectorsShown = nrSectorsShown;
-            files[num_files].filetype = filetype;
-            files[num_files].direntryindex = -1;
+            options->files[job->num_files].sectorInterleave = sectorInterleave ? sectorInterleave : defaultSectorInterleave;
+            options->files[job->num_files].first_sector_new_track = first_sector_new_track;
+            options->files[job->num_files].nrSectorsShown = nrSectorsShown;
+            options->files[job->num_files].filetype = filetype;
+            options->files[job->num_files].direntryindex = -1;
 
             if (strcmp(argv[j], "-W") == 0) {
                 if(nrSectorsShown != -1) {
@@ -4564,12 +6235,12 @@ main(int argc, char* argv[])
                     return -1;
                 }
                 transwarp_set = true;
-                if(!filetype_set && files[num_files].have_key) {
-                    files[num_files].filetype = (filetype & 0xf0) | FILETYPEUSR | FILETYPETRANSWARPMASK;
+                if(!filetype_set && options->files[job->num_files].have_key) {
+                    options->files[job->num_files].filetype = (filetype & 0xf0) | FILETYPEUSR | FILETYPETRANSWARPMASK;
                 } else {
-                    files[num_files].filetype = filetype | FILETYPETRANSWARPMASK;
+                    options->files[job->num_files].filetype = filetype | FILETYPETRANSWARPMASK;
                 }
-                files[num_files].sectorInterleave = 1;
+                options->files[job->num_files].sectorInterleave = 1;
             }
 
             first_sector_new_track = default_first_sector_new_track;
@@ -4578,50 +6249,56 @@ main(int argc, char* argv[])
             nrSectorsShown = -1;
             filetype = 0x82;
             filetype_set = false;
-            num_files++;
-            modified = 1;
+            job->num_files++;
+            job->modified = 1;
             j++;
         } else if (strcmp(argv[j], "-l") == 0) {
             if (argc < j + 2) {
                 fprintf(stderr, "ERROR: Error parsing argument for -l\n");
                 return -1;
             }
-            files[num_files].alocalname = (unsigned char*)argv[j + 1];
-            evalhexescape(files[num_files].alocalname, files[num_files].plocalname, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR);
+            options->files[job->num_files].alocalname = (unsigned char*)argv[j + 1];
+            if (evalhexescape(options->files[job->num_files].alocalname, options->files[job->num_files].plocalname, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0) {
+                return -1;
+            }
             if (filename == NULL) {
                 fprintf(stderr, "ERROR: Loop files require a filename set with -f\n");
                 return -1;
             }
-            evalhexescape(filename, files[num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR);
-            if(memcmp(files[num_files].pfilename, files[num_files].plocalname, FILENAMEMAXSIZE) == 0 && !files[num_files].force_new) {
+            if (evalhexescape(filename, options->files[job->num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0) {
+                return -1;
+            }
+            if(memcmp(options->files[job->num_files].pfilename, options->files[job->num_files].plocalname, FILENAMEMAXSIZE) == 0 && !options->files[job->num_files].force_new) {
                 fprintf(stderr, "ERROR: Loop file cannot have the same name as the file they refer to, unless with -N\n");
                 return -1;
             }
-            files[num_files].mode |= MODE_LOOPFILE;
-            files[num_files].sectorInterleave = 0;
-            files[num_files].first_sector_new_track = first_sector_new_track;
+            options->files[job->num_files].mode |= MODE_LOOPFILE;
+            options->files[job->num_files].sectorInterleave = 0;
+            options->files[job->num_files].first_sector_new_track = first_sector_new_track;
             first_sector_new_track = default_first_sector_new_track;
-            files[num_files].nrSectorsShown = nrSectorsShown;
-            files[num_files].filetype = filetype;
-            files[num_files].direntryindex = -1;
+            options->files[job->num_files].nrSectorsShown = nrSectorsShown;
+            options->files[job->num_files].filetype = filetype;
+            options->files[job->num_files].direntryindex = -1;
             filename = NULL;
             sectorInterleave = 0;
             nrSectorsShown = -1;
             filetype = 0x82;
             filetype_set = false;
-            num_files++;
-            modified = 1;
+            job->num_files++;
+            job->modified = 1;
             j++;
         } else if (strcmp(argv[j], "-L") == 0) {
             if (filename == NULL) {
                 fprintf(stderr, "ERROR: Writing no file using -L requires disk filename set with -f\n");
                 return -1;
             }
-            evalhexescape(filename, files[num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR);
-            files[num_files].nrSectorsShown = nrSectorsShown;
-            files[num_files].filetype = filetype;
-            files[num_files].direntryindex = -1;
-            files[num_files].mode |= MODE_NOFILE;
+            if (evalhexescape(filename, options->files[job->num_files].pfilename, FILENAMEMAXSIZE, FILENAMEEMPTYCHAR) != 0) {
+                return -1;
+            }
+            options->files[job->num_files].nrSectorsShown = nrSectorsShown;
+            options->files[job->num_files].filetype = filetype;
+            options->files[job->num_files].direntryindex = -1;
+            options->files[job->num_files].mode |= MODE_NOFILE;
 
             first_sector_new_track = default_first_sector_new_track;
             filename = NULL;
@@ -4629,20 +6306,20 @@ main(int argc, char* argv[])
             nrSectorsShown = -1;
             filetype = 0x82;
             filetype_set = false;
-            num_files++;
-            modified = 1;
+            job->num_files++;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-x") == 0) {
-            dirtracksplit = 0;
+            options->dirtracksplit = 0;
         } else if (strcmp(argv[j], "-t") == 0) {
-            usedirtrack = 1;
+            options->usedirtrack = 1;
         } else if (strcmp(argv[j], "-d") == 0) {
-            if ((argc < j + 2) || !sscanf(argv[++j], "%u", &shadowdirtrack)) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%u", &options->shadowdirtrack)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -d\n");
                 return -1;
             }
-            modified = 1;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-u") == 0) {
-            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &numdirblocks)) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &options->numdirblocks)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -u\n");
                 return -1;
             }
@@ -4656,98 +6333,145 @@ main(int argc, char* argv[])
                 return -1;
             }
         } else if (strcmp(argv[j], "-4") == 0) {
-            type = IMAGE_D64_EXTENDED_SPEED_DOS;
-            modified = 1;
+            options->type = IMAGE_D64_EXTENDED_SPEED_DOS;
+            job->modified = 1;
         } else if (strcmp(argv[j], "-R") == 0) {
-            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &restore_level)) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &options->restore_level)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -R\n");
                 return -1;
             }
-            if(restore_level < 0 || restore_level > 5) {
+            if(options->restore_level < 0 || options->restore_level > 5) {
                 fprintf(stderr, "ERROR: Argument must be between 0 and 5 for -R\n");
                 return -1;
             }
         } else if (strcmp(argv[j], "-5") == 0) {
-            type = IMAGE_D64_EXTENDED_DOLPHIN_DOS;
-            modified = 1;
+            options->type = IMAGE_D64_EXTENDED_DOLPHIN_DOS;
+            job->modified = 1;
+        } else if (strcmp(argv[j], "-X") == 0) {
+            options->type = IMAGE_D64_HIGH_DENSITY;
+        } else if (strcmp(argv[j], "-y") == 0) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &options->header_gap) || (options->header_gap < 0) || (options->header_gap > 255)) {
+                fprintf(stderr, "ERROR: Error parsing argument for -y\n");
+                return -1;
+            }
+        } else if (strcmp(argv[j], "-k") == 0) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &options->g64_skew) || (options->g64_skew < -21) || (options->g64_skew > 21)) {
+                fprintf(stderr, "ERROR: Error parsing argument for -k\n");
+                return -1;
+            }
+        } else if (strcmp(argv[j], "-Y") == 0) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &options->data_gap) || (options->data_gap < 0) || (options->data_gap > 255)) {
+                fprintf(stderr, "ERROR: Error parsing argument for -Y\n");
+                return -1;
+            }
         } else if (strcmp(argv[j], "-a") == 0) {
-            print_art_commandline = true;
-        } else if(strcmp(argv[j], "-g") == 0) {
+            options->print_art_commandline = true;
+        } else if ((strcmp(argv[j], "-g") == 0) || (strcmp(argv[j], "-G") == 0)) {
             if (argc < j + 2) {
-                fprintf(stderr, "ERROR: Error parsing argument for -g\n");
+                fprintf(stderr, "ERROR: Error parsing argument for %s\n", argv[j]);
                 return -1;
             }
-            filename_g64 = argv[++j];
+            options->compact_g64 = (argv[j][1] == 'G');
+            options->filename_g64 = argv[++j];
         } else if (strcmp(argv[j], "-U") == 0) {
-            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &unicode)) {
+            if ((argc < j + 2) || !sscanf(argv[++j], "%d", &job->unicode)) {
                 fprintf(stderr, "ERROR: Error parsing argument for -U\n");
                 return -1;
             }
-            if(unicode < 0 || unicode > 2) {
+            if(job->unicode < 0 || job->unicode > 2) {
                 fprintf(stderr, "ERROR: Argument must be between 0 and 2 for -U\n");
                 return -1;
             }
         } else if (strcmp(argv[j], "-q") == 0) {
-            quiet = 1;
+            job->quiet = 1;
         } else if (strcmp(argv[j], "-v") == 0) {
-            verbose = 1;
+            job->verbose = 1;
         } else if (strcmp(argv[j], "-h") == 0) {
             usage();
+            return -1;
+        } else if ((strcmp(argv[j], "-j") == 0) || (strcmp(argv[j], "-Z") == 0)) {
+            fprintf(stderr, "ERROR: %s cannot be combined with other options\n", argv[j]);
+            return -1;
         } else {
             fprintf(stderr, "ERROR: Error parsing command line at \"%s\"\n", argv[j]);
             printf("Use -h for help.\n");
             return -1;
         }
     }
-    if (j >= argc) {
-        fprintf(stderr, "ERROR: No image file provided, or misparsed last option\n");
-        return -1;
+    if (with_image) {
+        if (j >= argc) {
+            fprintf(stderr, "ERROR: No image file provided, or misparsed last option\n");
+            return -1;
+        }
+        options->imagepath = argv[argc-1];
     }
-    imagepath = argv[argc-1];
 
-    if (strlen(imagepath) >= 4) {
-        if (strcmp(imagepath + strlen(imagepath) - 4, ".d71") == 0) {
-            if ((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
+    if ((options->imagepath != NULL) && (strlen(options->imagepath) >= 4)) {
+        if (strcmp(options->imagepath + strlen(options->imagepath) - 4, ".d71") == 0) {
+            if ((options->type == IMAGE_D64_EXTENDED_SPEED_DOS) || (options->type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
                 fprintf(stderr, "ERROR: Extended .d71 images are not supported\n");
                 return -1;
             }
-            type = IMAGE_D71;
-        } else if (strcmp(imagepath + strlen(imagepath) - 4, ".d81") == 0) {
-            if ((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
+            options->type = IMAGE_D71;
+        } else if (strcmp(options->imagepath + strlen(options->imagepath) - 4, ".d81") == 0) {
+            if ((options->type == IMAGE_D64_EXTENDED_SPEED_DOS) || (options->type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
                 fprintf(stderr, "ERROR: Extended .d81 images are not supported\n");
                 return -1;
             }
-            type = IMAGE_D81;
-            dir_sector_interleave = 1;
+            options->type = IMAGE_D81;
+            options->dir_sector_interleave = 1;
+        } else if (strcmp(options->imagepath + strlen(options->imagepath) - 4, ".g64") == 0) {
+            options->gcr_image = true;
+        } else if (strcmp(options->imagepath + strlen(options->imagepath) - 4, ".g71") == 0) {
+            if ((options->type == IMAGE_D64_EXTENDED_SPEED_DOS) || (options->type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
+                fprintf(stderr, "ERROR: Extended .g71 images are not supported\n");
+                return -1;
+            }
+            options->type = IMAGE_D71;
+            options->gcr_image = true;
         }
     }
+    if ((options->type == IMAGE_D64_HIGH_DENSITY) && !options->gcr_image) {
+        fprintf(stderr, "ERROR: High density layouts are only supported for .g64 images\n");
+        return -1;
+    }
+    if (options->gcr_image && (options->filename_g64 != NULL) && (strcmp(options->filename_g64, options->imagepath) == 0)) {
+        /* -g or -G with the image itself only selects the layout */
+        options->filename_g64 = NULL;
+    }
+
+    if ((options->imagepath != NULL) && is_stdio_path(options->imagepath) && (options->filename_g64 != NULL) && (strcmp(options->filename_g64, "-") == 0)) {
+        fprintf(stderr, "ERROR: Image and G64 cannot both be written to stdout\n");
+        return -1;
+    }
 
-    if(bam_message != NULL && type != IMAGE_D64 && type != IMAGE_D64_EXTENDED_SPEED_DOS) {
+    if(options->bam_message != NULL && options->type != IMAGE_D64 && options->type != IMAGE_D64_EXTENDED_SPEED_DOS) {
         fprintf(stderr, "ERROR: Bam message only supported for D64 and SPEED DOS images\n");
         return -1;
     }
 
-    if(shadowdirtrack > image_num_tracks(type) || (int)shadowdirtrack == dirtrack(type) || (type == IMAGE_D71 && (int)shadowdirtrack == dirtrack(type) + D64NUMTRACKS)) {
+    if(options->shadowdirtrack > image_num_tracks(options->type) || (int)options->shadowdirtrack == dirtrack(options->type) || (options->type == IMAGE_D71 && (int)options->shadowdirtrack == dirtrack(options->type) + D64NUMTRACKS)) {
         fprintf(stderr, "ERROR: Invalid shadow directory track\n");
         return -1;
     }
 
-    if (type != IMAGE_D64) {
+    if (options->type != IMAGE_D64) {
         if (transwarp_set
-                && (type != IMAGE_D64_EXTENDED_SPEED_DOS)
-                && (type != IMAGE_D64_EXTENDED_DOLPHIN_DOS)) {
-            fprintf(stderr, "ERROR: Transwarp encoding is not supported for non-D64 images\n");
+                && (options->type != IMAGE_D64_EXTENDED_SPEED_DOS)
+                && (options->type != IMAGE_D64_EXTENDED_DOLPHIN_DOS)
+                && (options->type != IMAGE_D71)) {
+            fprintf(stderr, "ERROR: Transwarp encoding is only supported for D64 and D71 images\n");
             return -1;
         }
+    }
 
-        if (filename_g64 != NULL) {
-            fprintf(stderr, "ERROR: G64 output is only supported for non-extended D64 images\n");
-            return -1;
-        }
+    if (options->plan && stdin_used) {
+        fprintf(stderr, "ERROR: -p cannot be used with files read from stdin\n");
+        return -1;
     }
 
     /* Check for unsupported settings for D81 */
-    if (type == IMAGE_D81) {
+    if (options->type == IMAGE_D81) {
         if (default_sector_interleave_set) {
             fprintf(stderr, "ERROR: -S is not supported for D81 images\n");
             return -1;
@@ -4764,38 +6488,130 @@ main(int argc, char* argv[])
             fprintf(stderr, "ERROR: -b is not supported for D81 images\n");
             return -1;
         }
+        if (options->plan) {
+            fprintf(stderr, "ERROR: -p is not supported for D81 images\n");
+            return -1;
+        }
+        if (options->filename_g64 != NULL) {
+            fprintf(stderr, "ERROR: G64 output is not supported for D81 images\n");
+            return -1;
+        }
     }
 
     /* Change locale from C to default to allow unicode printouts */
-    if(unicode != 0) {
+    if(job->unicode != 0) {
         setlocale(LC_ALL, "");
     }
 
     /* quiet has precedence over verbose */
-    if(quiet) {
-        verbose = 0;
+    if(job->quiet) {
+        job->verbose = 0;
     }
 
-    /* open image */
+    return 0;
+}
+
+/* Maps an image file into memory if it holds at least the image size, returns NULL if this is not possible */
+static unsigned char*
+map_image(FILE* f, unsigned int imagesize, bool readonly)
+{
+#ifdef _WIN32
+    (void)f;
+    (void)imagesize;
+    (void)readonly;
+    return NULL;
+#else
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || st.st_size < (off_t)imagesize) {
+        return NULL;
+    }
+    /* changes stay private until save_image() writes the dirty blocks */
+    void* image = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+    if (image == MAP_FAILED) {
+        return NULL;
+    }
+    if (readonly) {
+        /* blocks are loaded when first accessed, no readahead of file data that is never looked at */
+        posix_madvise(image, imagesize, POSIX_MADV_RANDOM);
+    }
+    return (unsigned char*)image;
+#endif
+}
+
+/* Releases an image returned by open_image() */
+static void
+free_image(unsigned char* image, unsigned int imagesize, bool mapped)
+{
+#ifndef _WIN32
+    if (mapped) {
+        munmap(image, imagesize);
+        return;
+    }
+#else
+    (void)imagesize;
+    (void)mapped;
+#endif
+    free(image);
+}
+
+/* Reads the image, or creates it if it does not exist yet, returns NULL on error */
+static unsigned char*
+open_image(image_options* options, bool* existing)
+{
+    image_type type = options->type;
     unsigned int imagesize = image_size(type);
-    unsigned char* image = (unsigned char*)calloc(imagesize, sizeof(unsigned char));
+    unsigned char* image = NULL;
+    FILE* f = is_stdio_path(options->imagepath) ? NULL : fopen(options->imagepath, "rb");
+    *existing = (f != NULL);
+    if ((f != NULL) && !options->gcr_image) {
+        /* listing only touches BAM, directory and, for -v, the file chains */
+        bool readonly = (job->num_files == 0) && !options->dovalidate && (options->restore_level < 0) && !options->set_header && (options->filename_g64 == NULL);
+        image = map_image(f, imagesize, readonly);
+        job->mapped = (image != NULL);
+    }
+    if (image == NULL) {
+        image = (unsigned char*)calloc(imagesize, sizeof(unsigned char));
+    }
     if (image == NULL) {
         fprintf(stderr, "ERROR: Memory allocation error\n");
-        return -1;
+        if (f != NULL) {
+            fclose(f);
+        }
+        return NULL;
     }
-    FILE* f = fopen(imagepath, "rb");
     if (f == NULL) {
-        modified = 1;
-        if (!quiet) {
-            printf("Adding %d files to new image %s\n", num_files, basename((unsigned char*)imagepath));
+        job->modified = 1;
+        job->full_save = true;
+        if (!job->quiet) {
+            printf("Adding %d files to new image %s\n", job->num_files, basename((unsigned char*)options->imagepath));
+        }
+        if ((initialize_directory(type, image, options->header, options->id, options->bam_message, options->shadowdirtrack) != 0)
+                || (dir_parse(type, image) != 0)) {
+            free_image(image, imagesize, job->mapped);
+            return NULL;
         }
-        initialize_directory(type, image, header, id, bam_message, shadowdirtrack);
     } else {
-        if (!quiet) {
-            printf("Adding %d files to existing image %s\n", num_files, basename((unsigned char*)imagepath));
+        if (!job->quiet) {
+            printf("Adding %d files to existing image %s\n", job->num_files, basename((unsigned char*)options->imagepath));
+        }
+        size_t read_size = imagesize;
+        if (options->gcr_image) {
+            if (read_gcr_image(type, image, f, options->imagepath) != 0) {
+                fclose(f);
+                free_image(image, imagesize, job->mapped);
+                return NULL;
+            }
+        } else if (!job->mapped) {
+            read_size = fread(image, 1, imagesize, f);
+            /* files of another size are rewritten with the image size */
+            job->full_save = (read_size != imagesize) || (fgetc(f) != EOF);
         }
-        size_t read_size = fread(image, 1, imagesize, f);
         fclose(f);
+        bam_load(type, image);
+        if (dir_parse(type, image) != 0) {
+            free_image(image, imagesize, job->mapped);
+            return NULL;
+        }
         if (read_size != imagesize) {
             if (((type == IMAGE_D64_EXTENDED_SPEED_DOS) || (type == IMAGE_D64_EXTENDED_DOLPHIN_DOS)) && (read_size == D64SIZE)) {
                 /* Clear extra tracks */
@@ -4804,77 +6620,1141 @@ main(int argc, char* argv[])
                 /* Mark all extra sectors unused */
                 for (unsigned int t = D64NUMTRACKS + 1; t <= image_num_tracks(type); t++) {
                     for (int s = 0; s < num_sectors(type, t); s++) {
-                        mark_sector(type, image, t, s, 1 /* free */);
+                        mark_sector(type, t, s, 1 /* free */);
                     }
                 }
             } else {
                 fprintf(stderr, "ERROR: Wrong filesize: expected to read %u bytes, but read %u bytes\n", imagesize, (unsigned int) read_size);
-                return -1;
+                free(job->image_dir.entries);
+                job->image_dir.entries = NULL;
+                free_image(image, imagesize, job->mapped);
+                return NULL;
+            }
+            bam_commit(type, image);
+        }
+    }
+    return image;
+}
+
+/* Opens the first input files and lets the system read them in the background, write_files() takes them over in order.
+   Files that are not opened here are opened when they are written */
+static void
+prefetch_files(imagefile* files, int num_files)
+{
+    int num_open = 0;
+    for (int i = 0; (i < num_files) && (num_open < PREFETCHMAXFILES); i++) {
+        imagefile* file = files + i;
+        if ((file->mode & (MODE_NOFILE | MODE_LOOPFILE)) || (file->source != NULL) || (strcmp((char*)file->alocalname, "-") == 0)) {
+            continue;
+        }
+        /* errors are reported when the file is written */
+        file->input = fopen((char*)file->alocalname, "rb");
+        if (file->input == NULL) {
+            if ((errno == EMFILE) || (errno == ENFILE)) {
+                break;
+            }
+            continue;
+        }
+        num_open++;
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fileno(file->input), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    }
+}
+
+/* Reads a Transwarp file into source, from stdin for "-", returns -1 on error */
+static int
+read_transwarp_source(imagefile* file)
+{
+    if (strcmp((char*)file->alocalname, "-") == 0) {
+        file->source = read_stdin(&file->source_size, 0);
+        if (file->source == NULL) {
+            fprintf(stderr, "ERROR: Could not read file from stdin\n");
+            return -1;
+        }
+    } else {
+        FILE* f = fopen((char*)file->alocalname, "rb");
+        struct stat st;
+        if ((f == NULL) || (fstat(fileno(f), &st) != 0)) {
+            fprintf(stderr, "ERROR: Could not open file \"%s\" for reading\n", file->alocalname);
+            if (f != NULL) {
+                fclose(f);
             }
+            return -1;
+        }
+        file->source_size = (int)st.st_size;
+        file->source = (unsigned char*)malloc(file->source_size + 1);
+        bool ok = (file->source != NULL) && (fread(file->source, file->source_size, 1, f) == 1);
+        fclose(f);
+        if (!ok) {
+            fprintf(stderr, "ERROR: Unexpected filesize when reading %s\n", file->alocalname);
+            return -1;
+        }
+    }
+    if (file->source_size < 2) {
+        fprintf(stderr, "ERROR: Unexpected filesize when reading %s\n", file->alocalname);
+        return -1;
+    }
+    return 0;
+}
+
+/* Splits Transwarp files that do not fit into 255 blocks into segments of TRANSWARPSEGMENTSIZE bytes,
+   each with its own dir entry. The segment with index s > 0 is named like the file with ".s+1" appended and loads behind segment s-1.
+   Split files and files from stdin are read here once, the segments take their parts from it */
+static int
+split_transwarp_files(imagefile* files, int* num_files)
+{
+    for (int i = *num_files - 1; i >= 0; i--) {
+        imagefile* file = files + i;
+        if (!(file->filetype & FILETYPETRANSWARPMASK) || (file->num_segments > 0) || (file->source != NULL)) {
+            continue;
+        }
+        bool from_stdin = (strcmp((char*)file->alocalname, "-") == 0);
+        struct stat st;
+        if (!from_stdin && (stat((char*)file->alocalname, &st) != 0)) {
+            continue; /* reported when the file is written */
+        }
+        if (from_stdin && (read_transwarp_source(file) != 0)) {
+            return -1;
+        }
+        int size = from_stdin ? file->source_size : (int)st.st_size;
+        int num_segments = (size - 2 + TRANSWARPSEGMENTSIZE - 1) / TRANSWARPSEGMENTSIZE;
+        if (num_segments <= 1) {
+            continue;
+        }
+        if (num_segments > TRANSWARPMAXSEGMENTS) {
+            fprintf(stderr, "ERROR: Transwarp file \"%s\" needs more than %d segments\n", file->alocalname, TRANSWARPMAXSEGMENTS);
+            return -1;
+        }
+        if (*num_files + num_segments - 1 > MAXNUMFILES_D81) {
+            fprintf(stderr, "ERROR: Too many files for the segments of Transwarp file \"%s\"\n", file->alocalname);
+            return -1;
+        }
+
+        int namelength = 0;
+        while ((namelength < FILENAMEMAXSIZE) && (file->pfilename[namelength] != FILENAMEEMPTYCHAR)) {
+            namelength++;
+        }
+        if (namelength > FILENAMEMAXSIZE - 2) {
+            namelength = FILENAMEMAXSIZE - 2;
+        }
+
+        if ((file->source == NULL) && (read_transwarp_source(file) != 0)) {
+            return -1;
+        }
+        memmove(files + i + num_segments, files + i + 1, (*num_files - i - 1) * sizeof(imagefile));
+        file->num_segments = num_segments;
+        for (int s = 1; s < num_segments; s++) {
+            imagefile* segment = files + i + s;
+            *segment = *file;
+            segment->segment = s;
+            segment->pfilename[namelength] = '.';
+            segment->pfilename[namelength + 1] = '1' + s;
+        }
+        *num_files += num_segments - 1;
+    }
+    return 0;
+}
+
+/* Closes input files that write_files() did not get to and frees the data read by split_transwarp_files() */
+static void
+release_files(imagefile* files, int num_files)
+{
+    for (int i = 0; i < num_files; i++) {
+        if (files[i].input != NULL) {
+            fclose(files[i].input);
+            files[i].input = NULL;
+        }
+        if (files[i].segment == 0) {
+            free(files[i].source);
+        }
+        files[i].source = NULL;
+    }
+}
+
+/* Decodes Transwarp files from the image into local files */
+static int
+decode_transwarp_files(image_type type, const unsigned char* image, transwarp_extract* extracts, int num_extracts)
+{
+    for (int i = 0; i < num_extracts; i++) {
+        transwarp_extract* extract = extracts + i;
+        int index;
+        int track;
+        int sector;
+        int offset;
+        if (!find_existing_file(image, extract->pfilename, &index, &track, &sector, &offset)) {
+            fprintf(stderr, "ERROR: File ");
+            print_filename(stderr, extract->pfilename);
+            fprintf(stderr, " not found\n");
+            return -1;
+        }
+
+        int filesize;
+        unsigned char* filedata = decode_transwarp_file(type, image, job->image_dir.entries[index].offset, extract->have_key, extract->key, &filesize, NULL, 0);
+        if (filedata == NULL) {
+            return -1;
+        }
+        FILE* f = fopen(extract->alocalname, "wb");
+        if (f == NULL) {
+            fprintf(stderr, "ERROR: Could not open file \"%s\" for writing\n", extract->alocalname);
+            free(filedata);
+            return -1;
         }
-        if (dovalidate) {
-            validate(type, image);
+        bool written = (fwrite(filedata, filesize, 1, f) == 1);
+        written &= (fclose(f) == 0);
+        free(filedata);
+        if (!written) {
+            fprintf(stderr, "ERROR: Could not write file \"%s\"\n", extract->alocalname);
+            return -1;
+        }
+        if (job->verbose) {
+            printf("Decoded Transwarp file ");
+            print_filename(stdout, extract->pfilename);
+            printf(" to \"%s\", %d bytes\n", extract->alocalname, filesize);
+        }
+    }
+    return 0;
+}
+
+/* Applies validation, restoring, header changes and new files, see change_image() */
+static int
+apply_options(image_options* options, unsigned char* image, bool existing)
+{
+    image_type type = options->type;
+
+    if (existing) {
+        if (options->dovalidate && (validate(type, image) != 0)) {
+            return -1;
         }
-        if (restore_level >= 0) {
-            restore(type, image, restore_level, files);
+        if (options->restore_level >= 0) {
+            memset(job->dirty, 0xff, sizeof job->dirty); /* restoring touches blocks all over the image */
+            if (restore(type, image, options->restore_level) != 0) {
+                return -1;
+            }
         }
-        if (set_header) {
-            update_directory(type, image, header, id, bam_message, shadowdirtrack);
+        if (options->set_header
+                && (update_directory(type, image, options->header, options->id, options->bam_message, options->shadowdirtrack) != 0)) {
+            return -1;
         }
     }
 
     /* Print command line before adding anything to the image */
-    if(print_art_commandline) {
+    if(options->print_art_commandline) {
         convert_to_commandline(type, image);
     }
 
     /* Create directory entries */
-    create_dir_entries(type, image, files, num_files, dir_sector_interleave, shadowdirtrack, nooverwrite);
+    if (create_dir_entries(type, image, options->files, job->num_files, options->dir_sector_interleave, options->shadowdirtrack, options->nooverwrite) != 0) {
+        return -1;
+    }
 
-    /* Write files and mark sectors in BAM */
-    write_files(type, image, files, num_files, usedirtrack, dirtracksplit, shadowdirtrack, numdirblocks, dir_sector_interleave);
+    /* Write files and mark sectors in BAM, the tracks of G64 output may be skewed against each other */
+    load_model model = options->model;
+    model.track_skew = ((options->filename_g64 != NULL) || options->gcr_image) ? options->g64_skew : 0;
+    int retval = write_files(type, image, options->files, job->num_files, options->usedirtrack, options->dirtracksplit, options->shadowdirtrack, options->numdirblocks, options->dir_sector_interleave, options->verify, options->plan ? &model : NULL);
+    if (retval != 0) {
+        return retval;
+    }
 
     /* Print allocation info */
-    if (verbose) {
-        print_file_allocation(type, image, files, num_files);
+    if (job->verbose) {
+        print_file_allocation(type, image, options->files, job->num_files);
+    }
+
+    return decode_transwarp_files(type, image, options->extracts, options->num_extracts);
+}
+
+/* Applies the settings to an opened image: validation, restoring, header changes and new files */
+static int
+change_image(image_options* options, unsigned char* image, bool existing)
+{
+    if (split_transwarp_files(options->files, &job->num_files) != 0) {
+        release_files(options->files, job->num_files);
+        return -1;
     }
+    /* input files are read while the directory is prepared */
+    prefetch_files(options->files, job->num_files);
+    int retval = apply_options(options, image, existing);
+    release_files(options->files, job->num_files);
+    return retval;
+}
+
+/* Prints the directory and directory issues if present */
+static void
+list_image(image_type type, unsigned char* image)
+{
     int blocks_free = check_bam(type, image);
 
     /* Print directory */
-    if (!quiet) {
+    if (!job->quiet) {
         print_directory(type, image, blocks_free);
     }
 
     /* Show directory issues if present */
-    if(dir_error != DIR_OK) {
-        fprintf(stdout, "WARNING: %s\n", dir_error_string[dir_error]);
+    if(job->dir_error != DIR_OK) {
+        fprintf(stdout, "WARNING: %s\n", dir_error_string[job->dir_error]);
     }
+}
 
-    /* Save image */
-    if(modified) {
-        f = fopen(imagepath, "wb");
-        if (f == NULL || fwrite(image, imagesize, 1, f) != 1) {
-            fprintf(stderr, "ERROR: Failed to write %s\n", imagepath);
-            retval = -1;
-        }
-        if (f != NULL) {
-            fclose(f);
+/* Tells whether save_image() has to write a block: changed blocks, or all non-empty blocks of a complete file */
+static bool
+block_to_save(const unsigned char* image, unsigned int block)
+{
+    if (!job->full_save) {
+        return (job->dirty[block / 64] >> (block % 64)) & 1;
+    }
+    for (int i = 0; i < BLOCKSIZE; i++) {
+        if (image[block * BLOCKSIZE + i] != 0) {
+            return true;
         }
     }
+    return false;
+}
 
-    /* Save optional g64 image */
-    if (filename_g64 != NULL) {
-        /* retval might be set to -1 already.  Thus we need to take its
-        previous state and OR it with the following return value. */
-        retval |= generate_uniformat_g64(image, filename_g64);
+/* Writes the image to disk, an existing file only gets the changed blocks and new files are written sparse.
+   Any data behind the image, like error information, is dropped */
+static int
+save_image(const char* imagepath, const unsigned char* image, unsigned int imagesize)
+{
+    if (is_stdio_path(imagepath)) {
+        if (fwrite(image, imagesize, 1, job->output) != 1 || fflush(job->output) != 0) {
+            fprintf(stderr, "ERROR: Failed to write image to stdout\n");
+            return -1;
+        }
+        return 0;
     }
 
-    if (!ignore_collision && check_hashes(type, image)) {
-        fprintf(stderr, "\nERROR: Filename hash collision detected, image is not compatible with Krill's loader. Use -m to ignore this error.\n");
+    unsigned int num_blocks = imagesize / BLOCKSIZE;
+    FILE* f = fopen(imagepath, job->full_save ? "wb" : "r+b");
+    int retval = (f == NULL) ? -1 : 0;
+    unsigned int block = 0;
+    while (retval == 0 && block < num_blocks) {
+        unsigned int first = block;
+        while (first < num_blocks && !block_to_save(image, first)) {
+            first++;
+        }
+        block = first;
+        while (block < num_blocks && block_to_save(image, block)) {
+            block++;
+        }
+        if (block > first) {
+            if (fseek(f, (long)first * BLOCKSIZE, SEEK_SET) != 0 || fwrite(image + first * BLOCKSIZE, BLOCKSIZE, block - first, f) != block - first) {
+                retval = -1;
+            }
+        }
+    }
+    /* skipped empty blocks at the end do not extend the file */
+    if (retval == 0 && job->full_save && !block_to_save(image, num_blocks - 1)) {
+        if (fseek(f, (long)imagesize - 1, SEEK_SET) != 0 || fputc(0, f) == EOF) {
+            retval = -1;
+        }
+    }
+#ifndef _WIN32
+    if (retval == 0 && !job->full_save && (fflush(f) != 0 || ftruncate(fileno(f), imagesize) != 0)) {
+        retval = -1;
+    }
+#endif
+    if (f != NULL && fclose(f) != 0) {
         retval = -1;
     }
+    if (retval != 0) {
+        fprintf(stderr, "ERROR: Failed to write %s\n", imagepath);
+        return -1;
+    }
+    memset(job->dirty, 0, sizeof job->dirty);
+    job->full_save = false;
+    return 0;
+}
 
-    free(image);
+/* Saves the image, or encodes it again for G64 and G71 images */
+static int
+save_image_as(image_options* options, unsigned char* image)
+{
+    if (options->gcr_image) {
+        return generate_uniformat_g64(options, image, options->imagepath);
+    }
+    return save_image(options->imagepath, image, image_size(options->type));
+}
 
+/* Saves the image if modified and the optional g64 image, which is encoded in a child process meanwhile if possible */
+static int
+write_outputs(image_options* options, unsigned char* image)
+{
+    if (options->filename_g64 == NULL) {
+        return job->modified ? save_image_as(options, image) : 0;
+    }
+    int retval = 0;
+#ifndef _WIN32
+    fflush(NULL); /* the child must not repeat pending output */
+    pid_t pid = fork();
+    if (pid == 0) {
+        int status = generate_uniformat_g64(options, image, options->filename_g64);
+        fflush(NULL);
+        _exit((status == 0) ? 0 : 1);
+    }
+#endif
+    if (job->modified) {
+        retval = save_image_as(options, image);
+    }
+#ifndef _WIN32
+    if (pid > 0) {
+        int status;
+        if ((waitpid(pid, &status, 0) != pid) || !WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+            retval = -1;
+        }
+        return retval;
+    }
+#endif
+    /* retval might be set to -1 already.  Thus we need to take its
+    previous state and OR it with the following return value. */
+    retval |= generate_uniformat_g64(options, image, options->filename_g64);
     return retval;
 }
+
+/* Sends all further messages on stdout to stderr and returns a stream to the original stdout for binary output */
+static FILE*
+claim_stdout()
+{
+    fflush(stdout);
+#ifdef _WIN32
+    int fd = _dup(_fileno(stdout));
+    if (fd < 0 || _dup2(_fileno(stderr), _fileno(stdout)) != 0) {
+        return NULL;
+    }
+    _setmode(fd, _O_BINARY);
+    return _fdopen(fd, "wb");
+#else
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        return NULL;
+    }
+    return fdopen(fd, "wb");
+#endif
+}
+
+/* Builds or lists one image as given by the command line */
+static int
+build_image(int argc, char* argv[])
+{
+    image_context context;
+    init_context(&context);
+    job = &context;
+
+    if (argc == 1 || strcmp(argv[argc-1], "-h") == 0) {
+        usage();
+        return -1;
+    }
+
+    image_options options;
+    init_options(&options, IMAGE_D64);
+    if (parse_options(argc, argv, true, &options) != 0) {
+        return -1;
+    }
+    image_type type = options.type;
+
+    /* binary output on stdout */
+    if (is_stdio_path(options.imagepath) || ((options.filename_g64 != NULL) && (strcmp(options.filename_g64, "-") == 0))) {
+        job->output = claim_stdout();
+        if (job->output == NULL) {
+            fprintf(stderr, "ERROR: Could not write to stdout\n");
+            return -1;
+        }
+    }
+
+    /* open image */
+    bool existing;
+    unsigned char* image = open_image(&options, &existing);
+    if (image == NULL) {
+        return -1;
+    }
+    int error = change_image(&options, image, existing);
+    if (error != 0) {
+        free(job->image_dir.entries);
+        free_image(image, image_size(type), job->mapped);
+        return error;
+    }
+    list_image(type, image);
+
+    /* Write allocation map back to BAM */
+    bam_commit(type, image);
+
+    /* Nothing is written if the image is not usable with Krill's loader */
+    int retval = 0;
+    if (!options.ignore_collision && check_hashes(image)) {
+        fprintf(stderr, "\nERROR: Filename hash collision detected, image is not compatible with Krill's loader. Use -m to ignore this error.\n");
+        retval = -1;
+    } else {
+        retval = write_outputs(&options, image);
+    }
+
+    free(job->image_dir.entries);
+    free_image(image, image_size(type), job->mapped);
+    if (job->output != NULL) {
+        fclose(job->output);
+    }
+
+    return retval;
+}
+
+/* One image of a manifest, see build_manifest() */
+typedef struct {
+    int    line; /* line number in the manifest */
+    int    argc;
+    char** argv;
+} manifest_job;
+
+/* Splits a manifest line into arguments in place, double quotes group characters including spaces */
+static int
+split_manifest_line(char* line, char** args)
+{
+    int num_args = 0;
+    char* in = line;
+    while (*in != 0) {
+        while (*in == ' ' || *in == '\t') {
+            in++;
+        }
+        if (*in == 0) {
+            break;
+        }
+        char* out = in;
+        bool quoted = false;
+        args[num_args++] = out;
+        while (*in != 0 && (quoted || (*in != ' ' && *in != '\t'))) {
+            if (*in == '"') {
+                quoted = !quoted;
+            } else {
+                *out++ = *in;
+            }
+            in++;
+        }
+        if (quoted) {
+            return -1;
+        }
+        char end = *in;
+        *out = 0;
+        if (end != 0) {
+            in++;
+        }
+    }
+    return num_args;
+}
+
+/* Reads a manifest with the command line of one image per line, returns the number of images or -1 on error */
+static int
+read_manifest(const char* program, const char* filename, char** text, manifest_job** jobs)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open manifest %s\n", filename);
+        return -1;
+    }
+    size_t size = 0;
+    size_t capacity = 4096;
+    *text = (char*)malloc(capacity + 1);
+    while (*text != NULL) {
+        size += fread(*text + size, 1, capacity - size, f);
+        if (size < capacity) {
+            break;
+        }
+        capacity *= 2;
+        char* grown = (char*)realloc(*text, capacity + 1);
+        if (grown == NULL) {
+            free(*text);
+        }
+        *text = grown;
+    }
+    fclose(f);
+    if (*text == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        return -1;
+    }
+    (*text)[size] = 0;
+
+    int num_lines = 1;
+    for (size_t i = 0; i < size; i++) {
+        if ((*text)[i] == '\n') {
+            num_lines++;
+        }
+    }
+    *jobs = (manifest_job*)calloc(num_lines, sizeof(manifest_job));
+    if (*jobs == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        return -1;
+    }
+
+    int num_jobs = 0;
+    char* line = *text;
+    for (int l = 1; line != NULL; l++) {
+        char* next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = 0;
+        }
+        size_t length = strlen(line);
+        if (length > 0 && line[length - 1] == '\r') {
+            line[--length] = 0;
+        }
+        char* first = line + strspn(line, " \t");
+        if (*first != 0 && *first != ';') {
+            /* each argument takes at least two characters including its separator */
+            char** argv = (char**)malloc((length / 2 + 3) * sizeof(char*));
+            if (argv == NULL) {
+                fprintf(stderr, "ERROR: Memory allocation error\n");
+                return -1;
+            }
+            argv[0] = (char*)program;
+            int argc = split_manifest_line(line, argv + 1);
+            if (argc < 0) {
+                fprintf(stderr, "ERROR: Unterminated quote in manifest %s line %d\n", filename, l);
+                free(argv);
+                return -1;
+            }
+            argv[argc + 1] = NULL;
+            (*jobs)[num_jobs].line = l;
+            (*jobs)[num_jobs].argc = argc + 1;
+            (*jobs)[num_jobs].argv = argv;
+            num_jobs++;
+        }
+        line = next;
+    }
+    return num_jobs;
+}
+
+#ifdef _WIN32
+/* Builds the images of a manifest one after another in child processes */
+static int
+run_manifest_jobs(manifest_job* jobs, int num_jobs)
+{
+    char program[MAX_PATH];
+    if (GetModuleFileNameA(NULL, program, MAX_PATH) == 0) {
+        fprintf(stderr, "ERROR: Could not determine program path\n");
+        return -1;
+    }
+    int failed = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        /* the arguments are joined to a command line again, so quote the ones with spaces */
+        for (int a = 1; a < jobs[i].argc; a++) {
+            if (strpbrk(jobs[i].argv[a], " \t") != NULL) {
+                char* quoted = (char*)malloc(strlen(jobs[i].argv[a]) + 3);
+                if (quoted == NULL) {
+                    fprintf(stderr, "ERROR: Memory allocation error\n");
+                    return -1;
+                }
+                sprintf(quoted, "\"%s\"", jobs[i].argv[a]);
+                jobs[i].argv[a] = quoted;
+            }
+        }
+        fflush(stdout);
+        fflush(stderr);
+        intptr_t status = _spawnv(_P_WAIT, program, (const char* const*)jobs[i].argv);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Building %s from manifest line %d failed\n", jobs[i].argv[jobs[i].argc - 1], jobs[i].line);
+            failed++;
+        }
+    }
+    return failed;
+}
+#else
+/* Builds the images of a manifest in parallel child processes, one per core, and prints their output in manifest order.
+   Returns the number of jobs that failed or could not be started */
+static int
+run_manifest_jobs(manifest_job* jobs, int num_jobs)
+{
+    int workers = num_workers();
+    pid_t* pids = (pid_t*)calloc(num_jobs, sizeof(pid_t));
+    int* status = (int*)calloc(num_jobs, sizeof(int));
+    FILE** output = (FILE**)calloc(num_jobs, sizeof(FILE*));
+    if (pids == NULL || status == NULL || output == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        free(pids);
+        free(status);
+        free(output);
+        return -1;
+    }
+
+    int failed = 0;
+    int started = 0;
+    int running = 0;
+    int printed = 0;
+    fflush(stdout);
+    fflush(stderr);
+    while (printed < num_jobs) {
+        /* keep all workers busy */
+        while (running < workers && started < num_jobs) {
+            output[started] = tmpfile();
+            pid_t pid = (output[started] == NULL) ? -1 : fork();
+            if (pid == 0) {
+                /* stdout is collected to keep the listings in order, errors are shown right away */
+                dup2(fileno(output[started]), STDOUT_FILENO);
+                exit(build_image(jobs[started].argc, jobs[started].argv));
+            }
+            if (pid < 0) {
+                fprintf(stderr, "ERROR: Could not start job for manifest line %d\n", jobs[started].line);
+                if (output[started] != NULL) {
+                    fclose(output[started]);
+                    output[started] = NULL;
+                }
+                /* no further jobs are started, they are reported as not built */
+                while (started < num_jobs) {
+                    status[started++] = -1;
+                }
+                break;
+            }
+            pids[started++] = pid;
+            running++;
+        }
+
+        /* print the output of finished jobs in manifest order */
+        while (printed < started && pids[printed] == 0) {
+            if (output[printed] != NULL) {
+                char buffer[BUFSIZ];
+                size_t n;
+                rewind(output[printed]);
+                while ((n = fread(buffer, 1, sizeof buffer, output[printed])) > 0) {
+                    fwrite(buffer, 1, n, stdout);
+                }
+                fclose(output[printed]);
+                fflush(stdout);
+            }
+            if (output[printed] == NULL) {
+                fprintf(stderr, "ERROR: %s from manifest line %d was not built\n", jobs[printed].argv[jobs[printed].argc - 1], jobs[printed].line);
+                failed++;
+            } else if (status[printed] != 0) {
+                fprintf(stderr, "ERROR: Building %s from manifest line %d failed\n", jobs[printed].argv[jobs[printed].argc - 1], jobs[printed].line);
+                failed++;
+            }
+            printed++;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        int wstatus;
+        pid_t pid = wait(&wstatus);
+        if (pid < 0) {
+            /* wait for each running job instead, the others are not started */
+            fprintf(stderr, "ERROR: Lost track of manifest jobs\n");
+            for (int i = printed; i < started; i++) {
+                if (pids[i] != 0) {
+                    status[i] = ((waitpid(pids[i], &wstatus, 0) == pids[i]) && WIFEXITED(wstatus)) ? WEXITSTATUS(wstatus) : -1;
+                    pids[i] = 0;
+                }
+            }
+            running = 0;
+            while (started < num_jobs) {
+                status[started++] = -1;
+            }
+            continue;
+        }
+        for (int i = printed; i < started; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+                status[i] = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+                running--;
+                break;
+            }
+        }
+    }
+
+    free(output);
+    free(status);
+    free(pids);
+    return failed;
+}
+#endif
+
+/* Builds all images given in a manifest file, returns an error if any of them failed */
+static int
+build_manifest(const char* program, const char* filename)
+{
+    char* text = NULL;
+    manifest_job* jobs = NULL;
+    int num_jobs = read_manifest(program, filename, &text, &jobs);
+    int failed = (num_jobs < 0) ? -1 : run_manifest_jobs(jobs, num_jobs);
+    if (failed > 0) {
+        fprintf(stderr, "ERROR: %d of %d images from manifest %s failed\n", failed, num_jobs, filename);
+    }
+    if (jobs != NULL) {
+        for (int i = 0; i < num_jobs; i++) {
+            free(jobs[i].argv);
+        }
+        free(jobs);
+    }
+    free(text);
+    return (failed != 0) ? -1 : 0;
+}
+
+/* An image kept in memory by the server, see serve() */
+typedef struct {
+    image_context  context;
+    image_type     type;
+    char*          imagepath;
+    unsigned int   shadowdirtrack;
+    unsigned char* image;
+} resident_image;
+
+static resident_image** resident_images = NULL; /* images opened by the server */
+static int num_resident_images = 0;
+static resident_image* current_image = NULL;    /* image the server commands refer to */
+
+/* Reads a line of arbitrary length without the line break, returns false at the end of input */
+static bool
+read_line(FILE* in, char** line, size_t* capacity)
+{
+    size_t length = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF && c != '\n') {
+        if (length + 1 >= *capacity) {
+            size_t grown_capacity = (*capacity > 0) ? *capacity * 2 : 256;
+            char* grown = (char*)realloc(*line, grown_capacity);
+            if (grown == NULL) {
+                fprintf(stderr, "ERROR: Memory allocation error\n");
+                return false;
+            }
+            *line = grown;
+            *capacity = grown_capacity;
+        }
+        (*line)[length++] = (char)c;
+    }
+    if (c == EOF && length == 0) {
+        return false;
+    }
+    if (length > 0 && (*line)[length - 1] == '\r') {
+        length--;
+    }
+    (*line)[length] = 0;
+    return true;
+}
+
+/* Drops an image from memory without saving it */
+static void
+close_resident_image(resident_image* resident)
+{
+    for (int i = 0; i < num_resident_images; i++) {
+        if (resident_images[i] == resident) {
+            resident_images[i] = resident_images[--num_resident_images];
+            break;
+        }
+    }
+    if (current_image == resident) {
+        current_image = NULL;
+    }
+    free(resident->context.image_dir.entries);
+    free(resident->imagepath);
+    free_image(resident->image, image_size(resident->type), resident->context.mapped);
+    free(resident);
+}
+
+/* Opens an image as given by options and image name, or makes it the current image if it is open already */
+static int
+serve_open(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "ERROR: No image file provided\n");
+        return -1;
+    }
+    for (int i = 0; i < num_resident_images; i++) {
+        if (strcmp(resident_images[i]->imagepath, argv[argc - 1]) == 0) {
+            if (argc > 2) {
+                fprintf(stderr, "ERROR: Image %s is open already\n", argv[argc - 1]);
+                return -1;
+            }
+            current_image = resident_images[i];
+            return 0;
+        }
+    }
+
+    resident_image* resident = (resident_image*)calloc(1, sizeof(resident_image));
+    image_options* options = (image_options*)malloc(sizeof(image_options));
+    resident_image** grown = (resident_image**)realloc(resident_images, (num_resident_images + 1) * sizeof(resident_image*));
+    if (grown != NULL) {
+        resident_images = grown;
+    }
+    if (resident == NULL || options == NULL || grown == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        free(options);
+        free(resident);
+        return -1;
+    }
+    init_context(&resident->context);
+    job = &resident->context;
+    init_options(options, IMAGE_D64);
+
+    if (parse_options(argc, argv, true, options) != 0) {
+        free(options);
+        free(resident);
+        return -1;
+    }
+    if ((options->filename_g64 != NULL) || options->gcr_image) {
+        fprintf(stderr, "ERROR: -g, -G and G64 images are not supported by the server\n");
+        free(options);
+        free(resident);
+        return -1;
+    }
+    bool existing;
+    resident->image = open_image(options, &existing);
+    if (resident->image == NULL) {
+        free(resident->context.image_dir.entries);
+        free(options);
+        free(resident);
+        return -1;
+    }
+    resident->type = options->type;
+    resident->shadowdirtrack = options->shadowdirtrack;
+    resident->imagepath = (char*)malloc(strlen(options->imagepath) + 1);
+    if (resident->imagepath != NULL) {
+        strcpy(resident->imagepath, options->imagepath);
+    }
+    resident_images[num_resident_images++] = resident;
+    if (resident->imagepath == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        close_resident_image(resident);
+        free(options);
+        return -1;
+    }
+
+    int retval = change_image(options, resident->image, existing);
+    bam_commit(resident->type, resident->image);
+    if (retval != 0) {
+        close_resident_image(resident);
+    } else {
+        current_image = resident;
+    }
+    free(options);
+    return retval;
+}
+
+/* Adds files to the current image as given by options, the image is left unchanged if this fails */
+static int
+serve_add(int argc, char* argv[])
+{
+    image_type type = current_image->type;
+    unsigned int imagesize = image_size(type);
+    image_options* options = (image_options*)malloc(sizeof(image_options));
+    unsigned char* snapshot = (unsigned char*)malloc(imagesize);
+    if (options == NULL || snapshot == NULL) {
+        fprintf(stderr, "ERROR: Memory allocation error\n");
+        free(snapshot);
+        free(options);
+        return -1;
+    }
+    memcpy(snapshot, current_image->image, imagesize);
+    init_options(options, type);
+    options->shadowdirtrack = current_image->shadowdirtrack;
+    job->num_files = 0;
+
+    /* switches like -v or -M only apply to this command, later ones start with the settings of open again */
+    int quiet = job->quiet;
+    int verbose = job->verbose;
+    int max_hash_length = job->max_hash_length;
+    int unicode = job->unicode;
+
+    int retval = parse_options(argc, argv, false, options);
+    if (retval == 0 && options->type != type) {
+        fprintf(stderr, "ERROR: Image type cannot be changed\n");
+        retval = -1;
+    }
+    if (retval == 0 && options->filename_g64 != NULL) {
+        fprintf(stderr, "ERROR: -g and -G are not supported by the server\n");
+        retval = -1;
+    }
+    if (retval == 0) {
+        retval = change_image(options, current_image->image, true);
+    }
+    if (retval == 0) {
+        bam_commit(type, current_image->image);
+        if (!options->ignore_collision && check_hashes(current_image->image)) {
+            fprintf(stderr, "\nERROR: Filename hash collision detected, image is not compatible with Krill's loader. Use -m to ignore this error.\n");
+            retval = -1;
+        }
+    }
+
+    if (retval == 0) {
+        current_image->shadowdirtrack = options->shadowdirtrack;
+    } else {
+        /* the allocation map and directory model are rebuilt from the restored image */
+        memcpy(current_image->image, snapshot, imagesize);
+        bam_load(type, current_image->image);
+        dir_parse(type, current_image->image);
+    }
+    job->quiet = quiet;
+    job->verbose = verbose;
+    job->max_hash_length = max_hash_length;
+    job->unicode = unicode;
+    free(snapshot);
+    free(options);
+    return retval;
+}
+
+/* Executes server commands until the end of input, returns true if the server should quit */
+static bool
+serve(FILE* in)
+{
+    char* line = NULL;
+    size_t capacity = 0;
+    bool quit = false;
+    while (!quit && read_line(in, &line, &capacity)) {
+        char** argv = (char**)malloc((strlen(line) / 2 + 3) * sizeof(char*));
+        if (argv == NULL) {
+            fprintf(stderr, "ERROR: Memory allocation error\n");
+            break;
+        }
+        int argc = split_manifest_line(line, argv);
+        int retval = 0;
+        if (argc < 0) {
+            fprintf(stderr, "ERROR: Unterminated quote\n");
+            retval = -1;
+        } else if (argc == 0) {
+            free(argv);
+            continue;
+        } else {
+            for (int i = 1; i < argc; i++) {
+                if (strcmp(argv[i], "-h") == 0) {
+                    fprintf(stderr, "ERROR: -h is not supported by the server\n");
+                    retval = -1;
+                } else if (is_stdio_path(argv[i])) {
+                    fprintf(stderr, "ERROR: stdin and stdout are not supported by the server\n");
+                    retval = -1;
+                }
+            }
+        }
+        if (retval == 0) {
+            if (current_image != NULL) {
+                job = &current_image->context;
+            }
+            if (strcmp(argv[0], "open") == 0) {
+                retval = serve_open(argc, argv);
+            } else if (strcmp(argv[0], "quit") == 0) {
+                quit = true;
+            } else if ((argc > 1) && (strcmp(argv[0], "add") != 0)) {
+                fprintf(stderr, "ERROR: Unexpected arguments for %s\n", argv[0]);
+                retval = -1;
+            } else if ((current_image == NULL) && (strcmp(argv[0], "add") == 0 || strcmp(argv[0], "list") == 0 || strcmp(argv[0], "validate") == 0 || strcmp(argv[0], "save") == 0 || strcmp(argv[0], "close") == 0)) {
+                fprintf(stderr, "ERROR: No image open\n");
+                retval = -1;
+            } else if (strcmp(argv[0], "add") == 0) {
+                retval = serve_add(argc, argv);
+            } else if (strcmp(argv[0], "list") == 0) {
+                print_directory(current_image->type, current_image->image, check_bam(current_image->type, current_image->image));
+                if (job->dir_error != DIR_OK) {
+                    fprintf(stdout, "WARNING: %s\n", dir_error_string[job->dir_error]);
+                }
+            } else if (strcmp(argv[0], "validate") == 0) {
+                retval = validate(current_image->type, current_image->image);
+            } else if (strcmp(argv[0], "save") == 0) {
+                retval = save_image(current_image->imagepath, current_image->image, image_size(current_image->type));
+            } else if (strcmp(argv[0], "close") == 0) {
+                close_resident_image(current_image);
+            } else {
+                fprintf(stderr, "ERROR: Unknown command \"%s\"\n", argv[0]);
+                retval = -1;
+            }
+        }
+        free(argv);
+
+        fflush(stderr);
+        printf("%s\n", (retval == 0) ? "OK" : "ERROR");
+        fflush(stdout);
+    }
+    free(line);
+    return quit;
+}
+
+#ifndef _WIN32
+/* Serves the connections to a Unix domain socket one after another, until a client sends quit */
+static int
+serve_socket(const char* path)
+{
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof address.sun_path) {
+        fprintf(stderr, "ERROR: Socket path %s is too long\n", path);
+        return -1;
+    }
+    memset(&address, 0, sizeof address);
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        fprintf(stderr, "ERROR: Could not create socket\n");
+        return -1;
+    }
+    remove(path);
+    if ((bind(server, (struct sockaddr*)&address, sizeof address) != 0) || (listen(server, 1) != 0)) {
+        fprintf(stderr, "ERROR: Could not listen on socket %s\n", path);
+        close(server);
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN); /* clients may hang up any time */
+
+    int retval = 0;
+    bool quit = false;
+    while (!quit) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            fprintf(stderr, "ERROR: Could not accept connection on socket %s\n", path);
+            retval = -1;
+            break;
+        }
+
+        /* replies and messages go to the client */
+        fflush(stdout);
+        fflush(stderr);
+        int saved_stdout = dup(STDOUT_FILENO);
+        int saved_stderr = dup(STDERR_FILENO);
+        dup2(client, STDOUT_FILENO);
+        dup2(client, STDERR_FILENO);
+        FILE* in = fdopen(client, "r");
+        if (in != NULL) {
+            quit = serve(in);
+            fclose(in);
+        } else {
+            close(client);
+        }
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_stdout, STDOUT_FILENO);
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stdout);
+        close(saved_stderr);
+    }
+    close(server);
+    remove(path);
+    return retval;
+}
+#endif
+
+/* Runs as server, taking commands from stdin or a Unix domain socket, and keeping the opened images in memory */
+static int
+run_server(const char* endpoint)
+{
+    int retval = 0;
+    if (strcmp(endpoint, "-") == 0) {
+        serve(stdin);
+    } else {
+#ifdef _WIN32
+        fprintf(stderr, "ERROR: Sockets are not supported on this platform, use - for stdin\n");
+        retval = -1;
+#else
+        retval = serve_socket(endpoint);
+#endif
+    }
+    while (num_resident_images > 0) {
+        close_resident_image(resident_images[0]);
+    }
+    free(resident_images);
+    return retval;
+}
+
+int
+main(int argc, char* argv[])
+{
+    init_geometry();
+
+    if (argc == 3 && strcmp(argv[1], "-j") == 0) {
+        return build_manifest(argv[0], argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "-Z") == 0) {
+        return run_server(argv[2]);
+    }
+    return build_image(argc, argv);
+}
@@ -219,6 +219,43 @@ main(int argc, char* argv[])
     }
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
 
+    description = "Size of empty compact G64 image should be 252646";
+    ++test;
+    if (run_binary_cleanup(binary, "-G image.g64", "image.g64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (size == 252646) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+
+    description = "Size of empty 40 track G64 image should be 308412";
+    ++test;
+    if (run_binary_cleanup(binary, "-4 -g image.g64", "image.g64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (size == 308412) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+
+    description = "Size of empty G71 image should be 539936";
+    ++test;
+    if (run_binary_cleanup(binary, "-g image.g71", "image.d71", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if ((stat("image.g71", &st) == 0) && (st.st_size == 539936)) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("image.g71");
+
     description = "Size of empty D71 image should be 2*174848";
     ++test;
     if (run_binary_cleanup(binary, "", "image.d71", &image, &size, false) != NO_ERROR) {
@@ -676,6 +713,38 @@ main(int argc, char* argv[])
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
     remove("1.prg");
 
+    description = "Transwarp file should continue on the same track of the second side for -c";
+    ++test;
+    create_value_file("1.prg", 2 * 21 * 223, 1);
+    if (run_binary_cleanup(binary, "-f file1 -c -W 1.prg -w \"transwarp v0.86.prg\"", "image.d71", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (image[track_offset[17] + 256 + 24] == (char)(17 | 0x80) /* start track with cylinder flag */
+               && image[track_offset[17] + 0xdd + 52 - 36] == 0 /* no free sectors on track 52 */
+               && image[track_offset[17] + 4 * 16] == 21) { /* track 16 untouched */
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Transwarp file should not start on the second side without -c";
+    ++test;
+    create_value_file("1.prg", 21 * 223, 1);
+    if (run_binary_cleanup(binary, "-f file1 -r 36 -W 1.prg -w \"transwarp v0.86.prg\"", "image.d71", &image, &size, true) == NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "-f file1 -r 36 -c -W 1.prg -w \"transwarp v0.86.prg\"", "image.d71", &image, &size, true) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (image[track_offset[17] + 256 + 24] == (char)(36 | 0x80)) { /* start track with cylinder flag */
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
     description = "File should cover 1 sector on track 19 for -x not set";
     ++test;
     create_value_file("1.prg", 356 * 254, 1); /* leaves only one sector free before track 18 */
@@ -1131,6 +1200,20 @@ main(int argc, char* argv[])
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
     remove("1.prg");
 
+    description = "New DEL entries should keep their dir slots";
+    ++test;
+    create_value_file("1.prg", 2 * 254, 1);
+    if (run_binary_cleanup(binary, "-T DEL -f a -L -T DEL -f b -L -f c -w 1.prg ", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (image[track_offset[17] + 256 + 0*32 + 5] == 'A' && image[track_offset[17] + 256 + 1*32 + 5] == 'B' && image[track_offset[17] + 256 + 2*32 + 5] == 'C') {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
     description = "Directory should allow for 144 entries";
     ++test;
     create_value_file("1.prg", 1 * 254, 1);
@@ -1189,6 +1272,115 @@ main(int argc, char* argv[])
         result = TEST_FAIL;
     }
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+
+    description = "Files in a G64 image should be found when it is read again";
+    ++test;
+    if (run_binary(binary, "-m -f 1 -w 1.prg ", "image.g64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (run_binary_cleanup(binary, "-m -o -f 1 -w 1.prg ", "image.g64", &image, &size, true) != NO_ERROR) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Files in a G64 image with skewed tracks should be found when it is read again";
+    ++test;
+    create_value_file("1.prg", 100 * 254, 1);
+    if (run_binary(binary, "-k 3 -f 1 -w 1.prg ", "image.g64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (run_binary_cleanup(binary, "-o -f 1 -w 1.prg ", "image.g64", &image, &size, true) != NO_ERROR) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "40 track G64 image should not be read as 35 track image";
+    ++test;
+    create_value_file("1.prg", 10 * 254, 1);
+    if (run_binary(binary, "-4 -r 36 -w 1.prg ", "image.g64", &image, &size, true) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (run_binary(binary, "-f 2 -w 1.prg ", "image.g64", &image, &size, true) == NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "-4 ", "image.g64", &image, &size, true) == NO_ERROR) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "High density G64 image should fit a file that is too large for a D64";
+    ++test;
+    create_value_file("1.prg", 690 * 254, 1);
+    if (run_binary_cleanup(binary, "-X -w 1.prg ", "image.g64", &image, &size, true) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (size == 269862) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Filenames with the same hash should return an error";
+    ++test;
+    create_value_file("1.prg", 1 * 254, 1);
+    if (run_binary_cleanup(binary, "-M 1 -f ab -w 1.prg -f b -w 1.prg -f ac -w 1.prg 2> errors.txt", "image.d64", &image, &size, false) == NO_ERROR) {
+        result = TEST_FAIL;
+    } else {
+        /* each member of the colliding group is reported, the other file is not */
+        char errors[1024] = { 0 };
+        FILE* f = fopen("errors.txt", "rb");
+        if (f != NULL) {
+            fread(errors, 1, sizeof errors - 1, f);
+            fclose(f);
+        }
+        if (strstr(errors, "\"ab\" [$4443] is not unique") != NULL
+                && strstr(errors, "\"ac\" [$4443] is not unique") != NULL
+                && strstr(errors, "\"b\" [") == NULL) {
+            result = TEST_PASS;
+            ++passed;
+        } else {
+            result = TEST_FAIL;
+        }
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("errors.txt");
+
+    description = "Filenames with the same hash should be written with -m";
+    ++test;
+    if (run_binary_cleanup(binary, "-m -M 1 -f ab -w 1.prg -f b -w 1.prg -f ac -w 1.prg ", "image.d64", &image, &size, true) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (memcmp(image + track_offset[17] + 256 + 5, "AB\xa0", 3) == 0
+               && memcmp(image + track_offset[17] + 256 + 32 + 5, "B\xa0", 2) == 0
+               && memcmp(image + track_offset[17] + 256 + 64 + 5, "AC\xa0", 3) == 0) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+
+    description = "Image should not be written when filenames have the same hash";
+    ++test;
+    if (run_binary(binary, "-M 1 -f ab -w 1.prg -f b -w 1.prg -f ac -w 1.prg ", "image.d64", &image, &size, true) == NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (stat("image.d64", &st) != 0) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("image.d64");
     remove("1.prg");
 
     description = "Sector chain with invalid track link should be re-added to dir but left invalid for -R 0";
@@ -1925,6 +2117,186 @@ main(int argc, char* argv[])
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
     remove("1.prg");
 
+    description = "Transwarp file above 255 blocks should be split into a second segment";
+    ++test;
+    create_value_file("1.prg", 60000, 1);
+    if (run_binary_cleanup(binary, "-f file1 -W 1.prg -w \"transwarp v0.86.prg\"", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (memcmp(image + track_offset[17] + 256 + 32 + 5, "FILE1.2\xa0", 8) == 0
+               && image[track_offset[17] + 256 + 32 + 21] == 'T' && image[track_offset[17] + 256 + 32 + 22] == 'W') {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Transwarp file above 255 blocks read from stdin should be split as well";
+    ++test;
+    create_value_file("1.prg", 60000, 1);
+    if (run_binary_cleanup(binary, "-f file1 -W - -w \"transwarp v0.86.prg\" < 1.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (memcmp(image + track_offset[17] + 256 + 32 + 5, "FILE1.2\xa0", 8) == 0
+               && image[track_offset[17] + 256 + 32 + 21] == 'T' && image[track_offset[17] + 256 + 32 + 22] == 'W') {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Transwarp file decoded with -D should equal the file that was written";
+    ++test;
+    {
+        char data[5000];
+        data[0] = 0x00; /* load address $2000 */
+        data[1] = 0x20;
+        for (int i = 2; i < 5000; i++) {
+            data[i] = (char)((i * 7) ^ (i >> 8));
+        }
+        write_file("1.prg", sizeof data, data);
+    }
+    if (run_binary(binary, "-f file1 -K secret -W 1.prg -w \"transwarp v0.86.prg\"", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (run_binary_cleanup(binary, "-f file1 -K secret -D 2.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else {
+        char written[5001];
+        char decoded[5001];
+        FILE* f = fopen("1.prg", "rb");
+        size_t written_size = (f != NULL) ? fread(written, 1, sizeof written, f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        f = fopen("2.prg", "rb");
+        size_t decoded_size = (f != NULL) ? fread(decoded, 1, sizeof decoded, f) : 0;
+        if (f != NULL) {
+            fclose(f);
+        }
+        if (written_size == 5000 && decoded_size == written_size && memcmp(decoded, written, written_size) == 0) {
+            result = TEST_PASS;
+            ++passed;
+        } else {
+            result = TEST_FAIL;
+        }
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+    remove("2.prg");
+
+    description = "Written plain and Transwarp files should pass verification with -C";
+    ++test;
+    create_value_file("1.prg", 30000, 3);
+    create_value_file("2.prg", 300, 5);
+    if (run_binary_cleanup(binary, "-C -f file1 -w 1.prg -f file2 -w 2.prg -f file3 -W 1.prg -w \"transwarp v0.86.prg\"", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else {
+        result = TEST_PASS;
+        ++passed;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+    remove("2.prg");
+
+    description = "Transwarp file encoded for another bootfile version should fail verification with -C";
+    ++test;
+    create_value_file("1.prg", 3000, 3);
+    if (run_binary_cleanup(binary, "-C -f file1 -K secret -W 1.prg -f \"transwarp v0.64\" -w \"transwarp v0.86.prg\" 2> errors.txt", "image.d64", &image, &size, false) == NO_ERROR) {
+        result = TEST_FAIL;
+    } else {
+        char errors[1024] = { 0 };
+        FILE* f = fopen("errors.txt", "rb");
+        if (f != NULL) {
+            fread(errors, 1, sizeof errors - 1, f);
+            fclose(f);
+        }
+        if (strstr(errors, "differs from its source on t17/s0") != NULL) {
+            result = TEST_PASS;
+            ++passed;
+        } else {
+            result = TEST_FAIL;
+        }
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("errors.txt");
+    remove("1.prg");
+
+    description = "Planned layout without decode time should use interleave 1";
+    ++test;
+    create_value_file("1.prg", 254 * 4, 1);
+    if (run_binary_cleanup(binary, "-p 0,0 -w 1.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if ((image[track_offset[17] + 256 + 3] == 1)
+               && (image[track_offset[0] + image[track_offset[17] + 256 + 4] * 256 + 1] == (image[track_offset[17] + 256 + 4] + 1) % 21)) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Planned layout should leave enough sectors for the decode time between blocks";
+    ++test;
+    create_value_file("1.prg", 254 * 4, 1);
+    if (run_binary_cleanup(binary, "-p 20000 -w 1.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if ((image[track_offset[17] + 256 + 3] == 1)
+               && (image[track_offset[0] + image[track_offset[17] + 256 + 4] * 256 + 1] == (image[track_offset[17] + 256 + 4] + 4) % 21)) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
+    description = "Planned layout should keep the start track and sector set with -r and -b";
+    ++test;
+    create_value_file("1.prg", 254 * 5, 1);
+    create_value_file("2.prg", 254 * 7, 2);
+    if (run_binary_cleanup(binary, "-p 20000 -r 5 -b 3 -f one -w 1.prg -r 20 -b 7 -f two -w 2.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if ((image[track_offset[17] + 256 + 3] == 5) && (image[track_offset[17] + 256 + 4] == 3)
+               && (image[track_offset[4] + 3 * 256] == 5) && (image[track_offset[4] + 3 * 256 + 1] == 7) /* 4 sectors on 21 sector tracks */
+               && (image[track_offset[17] + 256 + 32 + 3] == 20) && (image[track_offset[17] + 256 + 32 + 4] == 7)
+               && (image[track_offset[19] + 7 * 256] == 20) && (image[track_offset[19] + 7 * 256 + 1] == 10)) { /* 3 sectors on 19 sector tracks */
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+
+    description = "Planned layout should start the next file where the previous one ends";
+    ++test;
+    if (run_binary_cleanup(binary, "-p 20000 -f one -w 1.prg -f two -w 2.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else {
+        /* follow the first file to its last sector, both files fit onto track 1 */
+        int track = image[track_offset[17] + 256 + 3];
+        int sector = image[track_offset[17] + 256 + 4];
+        int last_sector = sector;
+        for (int blocks = 0; (track == 1) && (blocks < 21); blocks++) {
+            last_sector = sector;
+            track = image[track_offset[0] + sector * 256];
+            sector = image[track_offset[0] + sector * 256 + 1];
+        }
+        if ((track == 0)
+                && (image[track_offset[17] + 256 + 32 + 3] == 1)
+                && (image[track_offset[17] + 256 + 32 + 4] == (last_sector + 4) % 21)) {
+            result = TEST_PASS;
+            ++passed;
+        } else {
+            result = TEST_FAIL;
+        }
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+    remove("2.prg");
+
     description = "Sector on new track should not be limited to number of sectors on old track";
     ++test;
     create_value_file("1.prg", 254 * 20, 1); /* track 24 has 19 blocks, track 25 only 18 */
@@ -1994,6 +2366,136 @@ main(int argc, char* argv[])
     }
     printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
 
+    description = "Manifest should build all listed images";
+    ++test;
+    create_value_file("1.prg", 2 * 254, 1);
+    {
+        char manifest[] = "; two images\n-f a -w 1.prg image.d64\n-n \"side 2\" -f b -w 1.prg image2.d64\n";
+        write_file("manifest.txt", strlen(manifest), manifest);
+    }
+    if (run_binary(binary, "-j", "manifest.txt", &image, &size, false) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "", "image.d64", &image, &size, false) != NO_ERROR
+               || image[track_offset[17] + 256 + 5] != 'A') {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "", "image2.d64", &image, &size, false) != NO_ERROR
+               || image[track_offset[17] + 256 + 5] != 'B' || memcmp(&image[track_offset[17] + 0x90], "SIDE 2", 6) != 0) {
+        result = TEST_FAIL;
+    } else {
+        result = TEST_PASS;
+        ++passed;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("manifest.txt");
+    remove("image.d64");
+    remove("image2.d64");
+    remove("1.prg");
+
+    description = "Server should leave the image unchanged when adding a file fails";
+    ++test;
+    create_value_file("1.prg", 254, 1);
+    {
+        char commands[] = "open image.d64\nadd -f a -w 1.prg\nadd -f b -w missing.prg\nadd -f c -w 1.prg\nsave\nquit\n";
+        write_file("commands.txt", strlen(commands), commands);
+    }
+    if (run_binary(binary, "-Z - <", "commands.txt", &image, &size, true) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (image[track_offset[17] + 256 + 5] == 'A' && image[track_offset[17] + 256 + 32 + 5] == 'C') {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("commands.txt");
+    remove("1.prg");
+
+    description = "Server should not keep the switches of one add for the next one";
+    ++test;
+    create_value_file("1.prg", 254, 1);
+    {
+        char commands[] = "open image.d64\nadd -M 3 -m -f abc1 -w 1.prg\nadd -f abc2 -w 1.prg\nsave\nquit\n";
+        write_file("commands.txt", strlen(commands), commands);
+    }
+    if (run_binary(binary, "-Z - <", "commands.txt", &image, &size, true) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (memcmp(image + track_offset[17] + 256 + 5, "ABC1", 4) == 0 && memcmp(image + track_offset[17] + 256 + 32 + 5, "ABC2", 4) == 0) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("commands.txt");
+    remove("1.prg");
+
+    description = "Server should keep running after an invalid filename escape";
+    ++test;
+    create_value_file("1.prg", 254, 1);
+    {
+        char commands[] = "open image.d64\nadd -f #zz -w 1.prg\nadd -f c -w 1.prg\nsave\nquit\n";
+        write_file("commands.txt", strlen(commands), commands);
+    }
+    if (run_binary(binary, "-Z - <", "commands.txt", &image, &size, true) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (run_binary_cleanup(binary, "", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else if (image[track_offset[17] + 256 + 5] == 'C' && image[track_offset[17] + 256 + 32 + 2] == 0) {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("commands.txt");
+    remove("1.prg");
+
+    description = "Listing an image with error information should leave it unchanged, adding a file should drop it";
+    ++test;
+    create_value_file("1.prg", 254, 1);
+    if (run_binary(binary, "-w 1.prg", "image.d64", &image, &size, true) != NO_ERROR) {
+        result = TEST_UNRESOLVED;
+    } else {
+        char* errorimage = calloc(size + 683, 1);
+        memcpy(errorimage, image, size);
+        memset(errorimage + size, 1, 683);
+        write_file("image.d64", size + 683, errorimage);
+        if (run_binary(binary, "", "image.d64", &image, &size, true) != NO_ERROR) {
+            result = TEST_FAIL;
+        } else if (size != 174848 + 683 || memcmp(image, errorimage, size) != 0) {
+            result = TEST_FAIL;
+        } else if (run_binary_cleanup(binary, "-f b -w 1.prg", "image.d64", &image, &size, true) != NO_ERROR) {
+            result = TEST_FAIL;
+        } else if (size == 174848 && image[track_offset[17] + 256 + 32 + 5] == 'B') {
+            result = TEST_PASS;
+            ++passed;
+        } else {
+            result = TEST_FAIL;
+        }
+        free(errorimage);
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("image.d64");
+    remove("1.prg");
+
+    description = "File read from stdin should be written to the image";
+    ++test;
+    create_value_file("1.prg", 254 * 2, 1);
+    if (run_binary_cleanup(binary, "-f a -w - < 1.prg", "image.d64", &image, &size, false) != NO_ERROR) {
+        result = TEST_FAIL;
+    } else if (block_is_filled(image, 0, 1) && block_is_filled(image, 10, 1) && image[track_offset[17] + 256 + 5] == 'A') {
+        result = TEST_PASS;
+        ++passed;
+    } else {
+        result = TEST_FAIL;
+    }
+    printf("%0*d:  %s:  %s\n", test_pad, test, result_str[result], description);
+    remove("1.prg");
+
     /* ideas for tests:
        - test writing of transwarp files
        - test encryption of transwarp files